@@ -0,0 +1,319 @@
+/*
+ * gb_bench.c:
+ *	Microbenchmarks of the hot functions of the GreenBubble daemon
+ *	Built by "make bench" with the daemon sources and the mock hardware (gb_hal_mock.c).
+ *	Each benchmark prints one json line on stdout:
+ *	{"name": "...", "iters": n, "ns_per_op": x, "allocs_per_op": y}
+ *	Allocations are counted on malloc/calloc/realloc of the daemon code (-Wl,--wrap)
+ *	and on everything jansson allocates (json_set_alloc_funcs).
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <jansson.h>
+
+#include <gb_main.h>
+#include <gb_config.h>
+#include <gb_serial.h>
+#include <gb_led.h>
+#include <gb_stats.h>
+#include <gb_rest.h>
+#include <gb_gpio.h>
+
+#define BENCH_MIN_NS  200000000LL   //Each benchmark runs at least 200 ms
+#define HIST_STEP_MS  600000LL      //Sampling period of the history (STATUS_TIMER)
+#define HIST_FULL     433           //Points of a full 3 day window, the next one drops the oldest
+
+//Global GreenBubble entities, gb_main.c is not linked
+gbChan_t Gb_ch;
+ldSys_t Gb_ld_sys[LD_MAX];
+gbSts_t Gb_sts;
+
+static unsigned long Allocs;
+static volatile unsigned long Sink; //Results go here, so the calls are not optimized out
+
+/***************** ALLOCATIONS *******************/
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    Allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    Allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    Allocs++;
+    return __real_realloc(ptr, size);
+}
+
+static void *bench_json_malloc(size_t size)
+{
+    Allocs++;
+    return __real_malloc(size);
+}
+
+static void bench_json_free(void *ptr)
+{
+    free(ptr);
+    return;
+}
+
+/***************** HARNESS *******************/
+
+static long long bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* Run fn n times, n growing until it takes BENCH_MIN_NS, and print the cost of one call */
+static void bench_run(const char *name, void (*fn)(void *arg, unsigned long i), void *arg)
+{
+    unsigned long n = 1, next, i, allocs;
+    long long start, ns;
+
+    while (1) {
+        allocs = Allocs;
+        start = bench_now();
+        for (i = 0; i < n; i++)
+            fn(arg, i);
+        ns = bench_now() - start;
+        allocs = Allocs - allocs;
+
+        if ((ns >= BENCH_MIN_NS) || (n >= 1000000000UL))
+            break;
+
+        //Aim 20% past the minimum from this run, growing at most 100x a time
+        next = (ns > 0) ? (unsigned long)((double)n*BENCH_MIN_NS*1.2/ns) : n*100;
+        if (next > n*100)
+            next = n*100;
+        n = (next > n) ? next : n + 1;
+    }
+
+    printf("{\"name\": \"%s\", \"iters\": %lu, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f}\n",
+            name, n, (double)ns/n, (double)allocs/n);
+    fflush(stdout);
+    return;
+}
+
+/***************** BENCHMARKS *******************/
+
+static void bench_generate_points(void *arg, unsigned long i)
+{
+    ld_generate_points((gbCfg_t *)arg);
+    return;
+}
+
+static void bench_hist_append(void *arg, unsigned long i)
+{
+    static long long next = HIST_FULL;
+
+    hist_append((json_t *)arg, (next++)*HIST_STEP_MS, i);
+    return;
+}
+
+static void bench_get_status(void *arg, unsigned long i)
+{
+    ldSts_t sts;
+
+    Sink += ld_get_status(i % Gb_ch.numb, &sts);
+    return;
+}
+
+static void bench_get_config(void *arg, unsigned long i)
+{
+    ldCfg_t cfg;
+
+    Sink += ld_get_config(i % Gb_ch.numb, &cfg);
+    return;
+}
+
+static void bench_get_system(void *arg, unsigned long i)
+{
+    ldSys_t sys;
+
+    Sink += ld_get_system(i % Gb_ch.numb, &sys);
+    return;
+}
+
+static void bench_curr_from_perc(void *arg, unsigned long i)
+{
+    Sink += get_curr_from_perc(i % Gb_ch.numb, i % 101);
+    return;
+}
+
+static void bench_perc_from_curr(void *arg, unsigned long i)
+{
+    ldBoard_t ld = i % Gb_ch.numb;
+
+    Sink += get_perc_from_curr(ld, i % (Gb_ld_sys[ld].fwd_led_curr + 1));
+    return;
+}
+
+/* A REST body as the server sends it: built, dumped and freed */
+static void bench_json_body(json_t *j_body)
+{
+    char *dump = json_dumps(j_body, JSON_COMPACT);
+
+    Sink += strlen(dump);
+    free(dump);
+    json_decref(j_body);
+    return;
+}
+
+/* A body of the json writer, ready to send as it is */
+static void bench_json_status(void *arg, unsigned long i)
+{
+    size_t len = 0;
+
+    rest_status_body(&len);
+    Sink += len;
+    return;
+}
+
+static void bench_json_config(void *arg, unsigned long i)
+{
+    size_t len = 0;
+
+    rest_config_body(&len);
+    Sink += len;
+    return;
+}
+
+static void bench_json_charts(void *arg, unsigned long i)
+{
+    bench_json_body(rest_charts_json(NULL, 0, LLONG_MAX, *(unsigned int *)arg));
+    return;
+}
+
+/***************** SETUP *******************/
+
+/* Every history series with points samples, the last one now */
+static void bench_hist_fill(unsigned int points)
+{
+    json_t **series[LD_MAX + 7];
+    unsigned int n = 0, i, p;
+    long long start = (time(NULL)*1000LL) - (long long)points*HIST_STEP_MS;
+    ldBoard_t ld;
+
+    FOR_EACH_LED(ld)
+        series[n++] = &Gb_sts.hist.intens[ld];
+    series[n++] = &Gb_sts.hist.humidity;
+    series[n++] = &Gb_sts.hist.rain;
+    series[n++] = &Gb_sts.hist.fog;
+    series[n++] = &Gb_sts.hist.tAir;
+    series[n++] = &Gb_sts.hist.tWater;
+    series[n++] = &Gb_sts.hist.vin;
+    series[n++] = &Gb_sts.hist.tPS;
+
+    for (i = 0; i < n; i++) {
+        json_decref(*series[i]);
+        *series[i] = json_array();
+        for (p = 0; p < points; p++)
+            hist_append(*series[i], start + p*HIST_STEP_MS, p);
+    }
+    return;
+}
+
+int main(void)
+{
+    static const unsigned int hist_sizes[] = { 0, 144, 432 }; //Empty, 1 day and 3 days of samples
+    unsigned int max_points = 0, lttb_points = 100, i;
+    gbCfg_t *cfg, *dense;
+    json_t *hist;
+    char name[64];
+    ldBoard_t ld;
+
+    //Errors only, written by the log thread as in the daemon
+    Log_level = LOG_ERR;
+    if (log_init() < 0)
+        return EXIT_FAILURE;
+    json_set_alloc_funcs(bench_json_malloc, bench_json_free);
+
+    //Default channels and config (no CFG.json here), the simulated drivers lit with the instant config
+    cfg_load();
+    if ((gb_gpio_init() < 0) || (ld_serial_init() < 0) || (ld_sys_init() < 0))
+        return EXIT_FAILURE;
+    FOR_EACH_LED(ld) {
+        ld_set_voltage(ld, cfg_get()->ld_instant[ld].vset);
+        ld_set_current(ld, cfg_get()->ld_instant[ld].cset);
+        ld_set_output(ld, true);
+    }
+    gb_stats_init(&Gb_sts);
+    FOR_EACH_LED(ld)
+        ld_get_status(ld, &Gb_sts.ld_sts[ld]);
+
+    //Routine points from the default spectrums and from a breakpoint each minute (the densest valid one)
+    cfg = malloc(sizeof(*cfg));
+    dense = malloc(sizeof(*dense));
+    *cfg = *cfg_get();
+    *dense = *cfg;
+    FOR_EACH_LED(ld) {
+        dense->ld_spec[ld].n = LD_SPEC_MINS + 1;
+        for (i = 0; i <= LD_SPEC_MINS; i++) {
+            dense->ld_spec[ld].minute[i] = i;
+            dense->ld_spec[ld].perc[i] = (i*7) % 101;
+        }
+    }
+    bench_run("ld_generate_points/spec=default", bench_generate_points, cfg);
+    bench_run("ld_generate_points/spec=1441", bench_generate_points, dense);
+
+    //A series at full retention: each point appended drops the oldest
+    hist = json_array();
+    for (i = 0; i < HIST_FULL; i++)
+        hist_append(hist, i*HIST_STEP_MS, i);
+    bench_run("hist_append/window=3d", bench_hist_append, hist);
+    json_decref(hist);
+
+    bench_run("ld_get_status", bench_get_status, NULL);
+    bench_run("ld_get_config", bench_get_config, NULL);
+    bench_run("ld_get_system", bench_get_system, NULL);
+    bench_run("get_curr_from_perc", bench_curr_from_perc, NULL);
+    bench_run("get_perc_from_curr", bench_perc_from_curr, NULL);
+
+    bench_run("json_status", bench_json_status, NULL);
+    bench_run("json_config", bench_json_config, NULL);
+    for (i = 0; i < sizeof(hist_sizes)/sizeof(hist_sizes[0]); i++) {
+        bench_hist_fill(hist_sizes[i]);
+        snprintf(name, sizeof(name), "json_charts/points=%u", hist_sizes[i]);
+        bench_run(name, bench_json_charts, &max_points);
+    }
+    snprintf(name, sizeof(name), "json_charts/points=%u/max_points=%u", hist_sizes[i - 1], lttb_points);
+    bench_run(name, bench_json_charts, &lttb_points);
+
+    free(cfg);
+    free(dense);
+    gb_stats_decref(&Gb_sts);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,565 @@
+/*
+ * gb_fleet.c:
+ *	Fleet aggregator of GreenBubble daemons
+ *	Built by "make fleet". A pool of threads polls the REST endpoints of every
+ *	bubble given on the command line: /status, and /charts from the last point it
+ *	has, so a poll only moves the new points. The results are merged in memory and
+ *	served for the whole fleet on its own REST endpoints. Each bubble has a token
+ *	bucket of requests (-r per minute) and at most one request at a time, and a
+ *	bubble that does not answer is polled less and less often.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <jansson.h>
+#include <ulfius.h>
+
+#include <gb_log.h>
+
+#define FLEET_PORT        8538
+#define FLEET_PREFIX      "/FLEET"
+#define FLEET_MAX         64        //Bubbles
+#define FLEET_WORKERS     4         //Polls at the same time, on different bubbles
+#define FLEET_INTERVAL_MS 10000     //A poll of each bubble this often (-i)
+#define FLEET_RATE        12        //Requests per minute to a bubble (-r), a poll is two
+#define FLEET_POLL_REQS   2         //Requests of a poll, /status and /charts
+#define FLEET_BURST       FLEET_POLL_REQS //Requests a bubble can take back to back
+#define FLEET_BACKOFF_MS  300000    //Longest wait on a bubble that does not answer
+#define FLEET_TIMEOUT_S   5
+#define FLEET_FIRST_PTS   500       //Points of each series on the first poll (downsampled by the bubble)
+#define FLEET_KEEP_PTS    5000      //Points kept of each series
+
+typedef struct {
+    char name[32];
+    char url[128];                  //http://host:port of the daemon
+    pthread_mutex_t lock;           //The store and the counters, read by the web threads
+
+    // Store
+    json_t *status;                 //Last /status
+    json_t *charts;                 //Series merged from the /charts deltas, same keys
+    long long last_ms;              //Newest point, the next /charts starts there
+
+    // Counters
+    unsigned long polls;
+    unsigned long requests;
+    unsigned long errors;           //Polls failed in a row
+    long long last_ok;              //CLOCK_REALTIME ms of the last answer
+    long long latency_ms;           //Of the last poll
+
+    // Scheduling, under Sched_lock
+    bool busy;
+    long long due;                  //CLOCK_MONOTONIC ms of the next poll
+    double tokens;
+    long long tokens_ms;            //Time of the last refill
+} fleetDev_t;
+
+static fleetDev_t Devs[FLEET_MAX];
+static unsigned int Devs_numb;
+static unsigned int Interval_ms = FLEET_INTERVAL_MS;
+static unsigned int Rate = FLEET_RATE;
+static volatile sig_atomic_t Stop;
+static pthread_mutex_t Sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Sched_cond = PTHREAD_COND_INITIALIZER;
+
+static long long fleet_ms(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return ts.tv_sec*1000LL + ts.tv_nsec/1000000;
+}
+
+/***************** RATE CAP *******************/
+
+/* Must hold Sched_lock. Ms until the bubble can take n requests, 0 if it can now. */
+static long long fleet_tokens_wait(fleetDev_t *d, unsigned int n, long long now)
+{
+    d->tokens += (now - d->tokens_ms) * Rate / 60000.0;
+    if (d->tokens > FLEET_BURST)
+        d->tokens = FLEET_BURST;
+    d->tokens_ms = now;
+    if (d->tokens >= n)
+        return 0;
+    return (long long)((n - d->tokens) * 60000.0 / Rate) + 1;
+}
+
+static bool fleet_take(fleetDev_t *d)
+{
+    bool ok;
+
+    pthread_mutex_lock(&Sched_lock);
+    ok = (fleet_tokens_wait(d, 1, fleet_ms(CLOCK_MONOTONIC)) == 0);
+    if (ok)
+        d->tokens -= 1;
+    pthread_mutex_unlock(&Sched_lock);
+    return ok;
+}
+
+/***************** POLL *******************/
+
+/* GET of a json body, NULL if the bubble did not answer one */
+static json_t *fleet_get(fleetDev_t *d, const char *path)
+{
+    struct _u_request req;
+    struct _u_response resp;
+    json_t *j = NULL;
+
+    ulfius_init_request(&req);
+    ulfius_init_response(&resp);
+    req.http_verb = o_strdup("GET");
+    req.http_url = msprintf("%s/GBBL%s", d->url, path);
+    req.timeout = FLEET_TIMEOUT_S;
+    if (ulfius_send_http_request(&req, &resp) == U_OK) {
+        if (resp.status == 200)
+            j = ulfius_get_json_body_response(&resp, NULL);
+        else
+            gb_log(LOG_DEBUG, "%s: %s answered %ld\n", d->name, path, resp.status);
+    }
+    ulfius_clean_request(&req);
+    ulfius_clean_response(&resp);
+
+    pthread_mutex_lock(&d->lock);
+    d->requests++;
+    pthread_mutex_unlock(&d->lock);
+    return j;
+}
+
+/* Points of src newer than the last one of dst, then the oldest dropped beyond FLEET_KEEP_PTS. Returns the newest time. */
+static long long fleet_merge_series(json_t *dst, json_t *src)
+{
+    long long last, t;
+    json_t *point;
+    size_t i;
+
+    point = json_array_get(dst, json_array_size(dst) - 1);
+    last = point ? json_integer_value(json_array_get(point, 0)) : -1;
+    json_array_foreach(src, i, point) {
+        t = json_integer_value(json_array_get(point, 0));
+        if (t > last) {
+            json_array_append(dst, point);
+            last = t;
+        }
+    }
+    while (json_array_size(dst) > FLEET_KEEP_PTS)
+        json_array_remove(dst, 0);
+    return last;
+}
+
+/* A /charts body into the store: series, or objects of series (hist_ld_spec) */
+static long long fleet_merge(json_t *dst, json_t *src)
+{
+    long long last = 0, t;
+    const char *key;
+    json_t *value, *to;
+
+    json_object_foreach(src, key, value) {
+        to = json_object_get(dst, key);
+        if (!to) {
+            to = json_is_array(value) ? json_array() : json_object();
+            json_object_set_new(dst, key, to);
+        }
+        if (json_is_array(value) && json_is_array(to))
+            t = fleet_merge_series(to, value);
+        else if (json_is_object(value) && json_is_object(to))
+            t = fleet_merge(to, value);
+        else
+            continue;
+        if (t > last)
+            last = t;
+    }
+    return last;
+}
+
+/* One poll of a bubble, its next one in ms from now */
+static long long fleet_poll(fleetDev_t *d)
+{
+    long long start = fleet_ms(CLOCK_MONOTONIC), last, wait;
+    json_t *status = NULL, *charts = NULL;
+    char path[96];
+    bool first;
+
+    if (!fleet_take(d))
+        return 0; //The scheduler waits for the tokens
+    status = fleet_get(d, "/status");
+    if (status && fleet_take(d)) {
+        pthread_mutex_lock(&d->lock);
+        first = (d->charts == NULL);
+        last = d->last_ms;
+        pthread_mutex_unlock(&d->lock);
+        if (first)
+            snprintf(path, sizeof(path), "/charts?max_points=%d", FLEET_FIRST_PTS);
+        else
+            snprintf(path, sizeof(path), "/charts?from=%lld", last);
+        charts = fleet_get(d, path);
+    }
+
+    pthread_mutex_lock(&d->lock);
+    d->polls++;
+    d->latency_ms = fleet_ms(CLOCK_MONOTONIC) - start;
+    if (!status) {
+        if (d->errors++ == 0)
+            gb_log(LOG_WARNING, "%s (%s) does not answer.", d->name, d->url);
+        wait = (long long)Interval_ms << ((d->errors < 6) ? d->errors : 6);
+        pthread_mutex_unlock(&d->lock);
+        return (wait > FLEET_BACKOFF_MS) ? FLEET_BACKOFF_MS : wait;
+    }
+    if (d->errors)
+        gb_log(LOG_NOTICE, "%s answers again after %lu failed polls.", d->name, d->errors);
+    d->errors = 0;
+    d->last_ok = fleet_ms(CLOCK_REALTIME);
+    json_decref(d->status);
+    d->status = status;
+    if (charts) {
+        if (!d->charts)
+            d->charts = json_object();
+        last = fleet_merge(d->charts, charts);
+        if (last > d->last_ms)
+            d->last_ms = last;
+        json_decref(charts);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return Interval_ms;
+}
+
+/* Must hold Sched_lock. Bubble due first that no thread polls, NULL if none. */
+static fleetDev_t *fleet_next(long long *due)
+{
+    fleetDev_t *next = NULL;
+    unsigned int i;
+
+    for (i = 0; i < Devs_numb; i++)
+        if (!Devs[i].busy && (!next || (Devs[i].due < next->due)))
+            next = &Devs[i];
+    if (next)
+        *due = next->due;
+    return next;
+}
+
+static void *fleet_worker(void *arg)
+{
+    struct timespec ts;
+    long long now, due, wait;
+    fleetDev_t *d;
+
+    pthread_mutex_lock(&Sched_lock);
+    while (!Stop) {
+        now = fleet_ms(CLOCK_MONOTONIC);
+        d = fleet_next(&due);
+        if (d && (due <= now)) {
+            wait = fleet_tokens_wait(d, FLEET_POLL_REQS, now);
+            if (wait) {
+                d->due = now + wait;
+                continue;
+            }
+            d->busy = true;
+            pthread_mutex_unlock(&Sched_lock);
+            wait = fleet_poll(d);
+            pthread_mutex_lock(&Sched_lock);
+            d->busy = false;
+            d->due = fleet_ms(CLOCK_MONOTONIC) + wait;
+            pthread_cond_broadcast(&Sched_cond);
+            continue;
+        }
+        // Nothing due: sleep until the next one, or a bubble is released
+        clock_gettime(CLOCK_REALTIME, &ts);
+        wait = d ? due - now : 1000;
+        ts.tv_sec += wait / 1000;
+        ts.tv_nsec += (wait % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&Sched_cond, &Sched_lock, &ts);
+    }
+    pthread_mutex_unlock(&Sched_lock);
+    return NULL;
+}
+
+/***************** REST *******************/
+
+static bool fleet_selected(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p;
+
+    if (!list || !*list)
+        return true;
+    for (p = list; (p = strstr(p, name)) != NULL; p += len)
+        if (((p == list) || (p[-1] == ',')) && ((p[len] == ',') || (p[len] == '\0')))
+            return true;
+    return false;
+}
+
+//sends the bubbles with their state and poll counters
+static int callback_fleet_devices (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    json_t *j_body = json_array();
+    unsigned int i;
+
+    for (i = 0; i < Devs_numb; i++) {
+        pthread_mutex_lock(&Devs[i].lock);
+        json_array_append_new(j_body, json_pack("{sssssssIsIsIsIsI}",
+                "name", Devs[i].name,
+                "url", Devs[i].url,
+                "state", Devs[i].status ? (Devs[i].errors ? "stale" : "up") : "down",
+                "polls", (json_int_t)Devs[i].polls,
+                "requests", (json_int_t)Devs[i].requests,
+                "errors", (json_int_t)Devs[i].errors,
+                "last_ok", (json_int_t)Devs[i].last_ok,
+                "latency_ms", (json_int_t)Devs[i].latency_ms));
+        pthread_mutex_unlock(&Devs[i].lock);
+    }
+    ulfius_set_json_body_response(response, 200, j_body);
+    json_decref(j_body);
+
+  return U_CALLBACK_CONTINUE;
+}
+
+//sends the last /status of each bubble (?device=a,b for some of them)
+static int callback_fleet_status (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    const char *devices = u_map_get(request->map_url, "device");
+    json_t *j_body = json_object();
+    unsigned int i;
+
+    for (i = 0; i < Devs_numb; i++) {
+        if (!fleet_selected(devices, Devs[i].name))
+            continue;
+        pthread_mutex_lock(&Devs[i].lock);
+        if (Devs[i].status)
+            json_object_set_new(j_body, Devs[i].name, json_deep_copy(Devs[i].status));
+        pthread_mutex_unlock(&Devs[i].lock);
+    }
+    ulfius_set_json_body_response(response, 200, j_body);
+    json_decref(j_body);
+
+  return U_CALLBACK_CONTINUE;
+}
+
+/* Points of a series from a time on */
+static json_t *fleet_series_from(json_t *series, long long from)
+{
+    json_t *out = json_array(), *point;
+    size_t i;
+
+    json_array_foreach(series, i, point)
+        if (json_integer_value(json_array_get(point, 0)) >= from)
+            json_array_append(out, point);
+    return out;
+}
+
+/**
+ * sends the merged history of each bubble. Optional query parameters:
+ *  device=a,b                  Only these bubbles (default all)
+ *  series=hist_tempWater,...   Only these keys of /charts (default all)
+ *  from=<ms>                   Points from this time on
+ */
+static int callback_fleet_charts (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    const char *devices = u_map_get(request->map_url, "device");
+    const char *series = u_map_get(request->map_url, "series");
+    const char *from_str = u_map_get(request->map_url, "from");
+    long long from = from_str ? strtoll(from_str, NULL, 10) : 0;
+    json_t *j_body = json_object(), *j_dev, *value, *group, *s;
+    const char *key, *led;
+    unsigned int i;
+
+    for (i = 0; i < Devs_numb; i++) {
+        if (!fleet_selected(devices, Devs[i].name))
+            continue;
+        j_dev = json_object();
+        pthread_mutex_lock(&Devs[i].lock);
+        json_object_foreach(Devs[i].charts, key, value) {
+            if (!fleet_selected(series, key))
+                continue;
+            if (json_is_array(value)) {
+                json_object_set_new(j_dev, key, fleet_series_from(value, from));
+            } else {
+                group = json_object();
+                json_object_foreach(value, led, s)
+                    json_object_set_new(group, led, fleet_series_from(s, from));
+                json_object_set_new(j_dev, key, group);
+            }
+        }
+        pthread_mutex_unlock(&Devs[i].lock);
+        json_object_set_new(j_body, Devs[i].name, j_dev);
+    }
+    ulfius_set_json_body_response(response, 200, j_body);
+    json_decref(j_body);
+
+  return U_CALLBACK_CONTINUE;
+}
+
+//sends min, max and mean of each number of /status over the bubbles that answer, with where the min and max are
+static int callback_fleet_summary (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    json_t *j_body = json_object(), *sum, *value;
+    const char *key;
+    double v;
+    unsigned int i;
+
+    for (i = 0; i < Devs_numb; i++) {
+        pthread_mutex_lock(&Devs[i].lock);
+        if (Devs[i].status && !Devs[i].errors) {
+            json_object_foreach(Devs[i].status, key, value) {
+                if (!json_is_number(value))
+                    continue;
+                v = json_number_value(value);
+                sum = json_object_get(j_body, key);
+                if (!sum) {
+                    json_object_set_new(j_body, key, json_pack("{sfsssfsssfsi}", "min", v, "min_device", Devs[i].name,
+                            "max", v, "max_device", Devs[i].name, "mean", v, "devices", 1));
+                    continue;
+                }
+                if (v < json_real_value(json_object_get(sum, "min"))) {
+                    json_object_set_new(sum, "min", json_real(v));
+                    json_object_set_new(sum, "min_device", json_string(Devs[i].name));
+                }
+                if (v > json_real_value(json_object_get(sum, "max"))) {
+                    json_object_set_new(sum, "max", json_real(v));
+                    json_object_set_new(sum, "max_device", json_string(Devs[i].name));
+                }
+                json_object_set_new(sum, "mean", json_real(json_real_value(json_object_get(sum, "mean")) + v));
+                json_object_set_new(sum, "devices", json_integer(json_integer_value(json_object_get(sum, "devices")) + 1));
+            }
+        }
+        pthread_mutex_unlock(&Devs[i].lock);
+    }
+    json_object_foreach(j_body, key, sum)
+        json_object_set_new(sum, "mean", json_real(json_real_value(json_object_get(sum, "mean")) /
+                json_integer_value(json_object_get(sum, "devices"))));
+
+    ulfius_set_json_body_response(response, 200, j_body);
+    json_decref(j_body);
+
+  return U_CALLBACK_CONTINUE;
+}
+
+/***************** MAIN *******************/
+
+/* name=http://host:port */
+static int fleet_add(const char *arg)
+{
+    const char *eq = strchr(arg, '=');
+    fleetDev_t *d;
+
+    if (!eq || (eq == arg) || (eq - arg >= (int)sizeof(d->name)) || strncmp(eq + 1, "http", 4) || (Devs_numb == FLEET_MAX))
+        return -1;
+    d = &Devs[Devs_numb++];
+    snprintf(d->name, sizeof(d->name), "%.*s", (int)(eq - arg), arg);
+    snprintf(d->url, sizeof(d->url), "%s", eq + 1);
+    if (d->url[strlen(d->url) - 1] == '/')
+        d->url[strlen(d->url) - 1] = '\0';
+    pthread_mutex_init(&d->lock, NULL);
+    d->tokens = FLEET_BURST;
+    d->tokens_ms = fleet_ms(CLOCK_MONOTONIC);
+    d->due = d->tokens_ms + (Devs_numb - 1) * 100; //Not all at once
+    return 0;
+}
+
+/*
+ * gb_fleet [-w port] [-i interval_ms] [-r requests_per_min] [-l level] name=http://host:port ...
+ */
+int main(int argc, char *argv[])
+{
+    struct _u_instance instance;
+    pthread_t workers[FLEET_WORKERS];
+    unsigned int port = FLEET_PORT, i;
+    int opt, level = LOG_LEVEL_DFLT, sig;
+    sigset_t mask;
+
+    while ((opt = getopt(argc, argv, "w:i:r:l:")) != -1) {
+        switch (opt) {
+            case 'w':
+                port = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                Interval_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                Rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                level = log_level_parse(optarg);
+                break;
+            default:
+                port = 0;
+                break;
+        }
+    }
+    for (i = optind; i < (unsigned int)argc; i++)
+        if (fleet_add(argv[i]) < 0)
+            port = 0;
+    if (!port || !Interval_ms || !Rate || (level < 0) || !Devs_numb) {
+        fprintf(stderr, "Usage: %s [-w port] [-i interval_ms] [-r requests_per_min] [-l level] name=http://host:port ...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // The threads leave SIGTERM and SIGINT to main
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    openlog("gb_fleet", LOG_PID, LOG_DAEMON);
+    if (log_init() < 0)
+        return EXIT_FAILURE;
+    log_set_level(level);
+
+    if (ulfius_init_instance(&instance, port, NULL, NULL) != U_OK) {
+        gb_log(LOG_CRIT, "Ulfius unable to initiate instance.");
+        return EXIT_FAILURE;
+    }
+    ulfius_add_endpoint_by_val(&instance, "GET", FLEET_PREFIX, "/devices", 0, &callback_fleet_devices, NULL);
+    ulfius_add_endpoint_by_val(&instance, "GET", FLEET_PREFIX, "/status", 0, &callback_fleet_status, NULL);
+    ulfius_add_endpoint_by_val(&instance, "GET", FLEET_PREFIX, "/charts", 0, &callback_fleet_charts, NULL);
+    ulfius_add_endpoint_by_val(&instance, "GET", FLEET_PREFIX, "/summary", 0, &callback_fleet_summary, NULL);
+    u_map_put(instance.default_headers, "Access-Control-Allow-Origin", "*");
+    if (ulfius_start_framework(&instance) != U_OK) {
+        gb_log(LOG_CRIT, "Unable to start the Ulfius framework on port %u.", port);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < FLEET_WORKERS; i++)
+        pthread_create(&workers[i], NULL, fleet_worker, NULL);
+    gb_log(LOG_NOTICE, "Fleet of %u bubbles on port %u, polled each %u ms, %u requests/min at most.", Devs_numb, port, Interval_ms, Rate);
+
+    sigwait(&mask, &sig);
+    Stop = 1;
+    pthread_mutex_lock(&Sched_lock);
+    pthread_cond_broadcast(&Sched_cond);
+    pthread_mutex_unlock(&Sched_lock);
+    for (i = 0; i < FLEET_WORKERS; i++)
+        pthread_join(workers[i], NULL);
+
+    ulfius_stop_framework(&instance);
+    ulfius_clean_instance(&instance);
+    for (i = 0; i < Devs_numb; i++) {
+        json_decref(Devs[i].status);
+        json_decref(Devs[i].charts);
+    }
+    gb_log(LOG_NOTICE, "Fleet aggregator stopped.");
+    log_stop();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+/*
+ * gb_act.c:
+ *	Rain sensor and actuators (fog, periodic water change) of the GreenBubble project
+ *	The rain input is watched: each debounced edge comes through the event loop with
+ *	the time the kernel saw it, and goes to the status and the history right away.
+ *	Fog and PWC follow their duty cycle from the config on a scheduler timer each,
+ *	woken only for their next switch, a config change or a change of the rain.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <gb_act.h>
+#include <gb_main.h>
+#include <gb_gpio.h>
+#include <gb_hal.h>
+#include <gb_sched.h>
+#include <gb_loop.h>
+#include <gb_config.h>
+#include <gb_stats.h>
+#include <gb_log.h>
+
+typedef struct {
+    const char *name;
+    int pin;
+    size_t cfg;         //Offset of its actCfg_t in gbCfg_t
+    bool rain_pause;    //Kept off while it rains
+    bool *sts;
+    json_t **hist;      //History series, NULL if none
+    int timer;
+} act_t;
+
+static act_t Acts[] = {
+    { "fog",          BCM_17, offsetof(gbCfg_t, fog), true,  &Gb_sts.fog, &Gb_sts.hist.fog, -1 },
+    { "water change", BCM_16, offsetof(gbCfg_t, pwc), false, &Gb_sts.pwc, NULL,             -1 }
+};
+#define ACTS_NUMB (sizeof(Acts)/sizeof(Acts[0]))
+
+/***************** RAIN *******************/
+
+/* New state of the rain, at the CLOCK_MONOTONIC ns it changed */
+static void act_rain_set(gbSts_t *sts, bool rain, long long ns)
+{
+    if (rain == sts->rain)
+        return;
+    sts->rain = rain;
+    gb_stats_change(sts->hist.rain, ns, rain ? 100 : 0);
+    gb_log(LOG_INFO, "Rain %s.", rain ? "started" : "stopped");
+    act_wakeup(); //Fog pauses or resumes
+    return;
+}
+
+/* Event loop handler of the rain input edges */
+static void act_rain_event(int fd, uint32_t events, void *arg)
+{
+    int pin, value;
+    long long ns;
+
+    while (hal_gpio_event(fd, &pin, &value, &ns) == 0)
+        if (pin == BCM_18)
+            act_rain_set(arg, value == HAL_HIGH, ns);
+    return;
+}
+
+/* Without edge events the input is read on a timer */
+static long long act_rain_poll(void *arg, long long now)
+{
+    act_rain_set(arg, hal_gpio_read(BCM_18) == HAL_HIGH, hal_clock_ns(CLOCK_MONOTONIC));
+    return now + RAIN_POLL_MS*SCHED_MS;
+}
+
+/***************** ACTUATORS *******************/
+
+static void act_set(act_t *act, bool on)
+{
+    if (on == *act->sts)
+        return;
+    hal_gpio_write(act->pin, on ? HAL_HIGH : HAL_LOW);
+    *act->sts = on;
+    if (act->hist)
+        gb_stats_change(*act->hist, hal_clock_ns(CLOCK_MONOTONIC), on ? 100 : 0);
+    gb_log(LOG_INFO, "Actuator %s switched %s.", act->name, on ? "on" : "off");
+    return;
+}
+
+/* Actuator timer: on for on_s at the start of each period_s of the wall clock. Returns its next switch. */
+static long long act_tick(void *arg, long long now)
+{
+    act_t *act = arg;
+    const actCfg_t *cfg = (const actCfg_t *)((const char *)cfg_get() + act->cfg);
+    long long period = (long long)cfg->period_s*1000*SCHED_MS;
+    long long on = (long long)cfg->on_s*1000*SCHED_MS;
+    long long start;
+
+    if ((period == 0) || (on == 0)) {
+        act_set(act, false);
+        return 0;
+    }
+
+    start = (now/period)*period;
+    act_set(act, (now - start < on) && !(act->rain_pause && Gb_sts.rain));
+    return (now - start < on) ? start + on : start + period;
+}
+
+/***************** API *******************/
+
+void act_sched_init(gbSts_t *sts)
+{
+    unsigned int i;
+    int fd;
+
+    sts->rain = (hal_gpio_read(BCM_18) == HAL_HIGH);
+    fd = hal_gpio_watch(BCM_18, RAIN_DEBOUNCE_US);
+    if ((fd < 0) || (loop_add("rain", fd, EPOLLIN, act_rain_event, sts) < 0)) {
+        gb_log(LOG_NOTICE, "No edge events of the rain sensor, it is read each %u ms.", RAIN_POLL_MS);
+        sched_add("rain", act_rain_poll, sts, sched_now() + RAIN_POLL_MS*SCHED_MS, 0);
+    }
+
+    //Run now to take the state the duty cycle has at this time of the day
+    for (i = 0; i < ACTS_NUMB; i++)
+        Acts[i].timer = sched_add(Acts[i].name, act_tick, &Acts[i], sched_now(), SCHED_F_CLOCK);
+    return;
+}
+
+/* The duty cycles or the rain changed, from any thread: the actuators check their state again */
+void act_wakeup(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < ACTS_NUMB; i++)
+        if (Acts[i].timer >= 0)
+            sched_set(Acts[i].timer, sched_now());
+    return;
+}
+
+/* Daemon stopping: fog and water change are left off */
+void act_stop(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < ACTS_NUMB; i++)
+        act_set(&Acts[i], false);
+    return;
+}
@@ -0,0 +1,37 @@
+/*
+ * gb_act.h:
+ *	Rain sensor and actuators (fog, periodic water change) of the GreenBubble project
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef GB_ACT_H
+#define GB_ACT_H
+
+#include <gb_main.h>
+
+/***************** DEFINES & ENUMS *******************/
+
+#define RAIN_DEBOUNCE_US 20000 //Input settled this long is a change, drops on the sensor bounce
+#define RAIN_POLL_MS     1000  //Rain read this often when the backend has no edge events
+
+/***************** FUNCTIONS *******************/
+void act_sched_init(gbSts_t *sts);
+void act_wakeup(void);
+void act_stop(void);
+
+#endif //GB_ACT_H
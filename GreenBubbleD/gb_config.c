@@ -19,205 +19,934 @@
  ***********************************************************************
  */
 
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <syslog.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/inotify.h>
 #include <jansson.h>
 
 #include <gb_config.h>
 #include <gb_led.h>
 #include <gb_main.h>
 #include <gb_serial.h>
+#include <gb_sched.h>
+#include <gb_regul.h>
+#include <gb_jobs.h>
+#include <gb_snap.h>
+#include <gb_loop.h>
+#include <gb_log.h>
+
+#define CFG_DIR       "."
+#define CFG_FILE_NAME "CFG.json"
+#define CFG_FILE      CFG_DIR "/" CFG_FILE_NAME
+#define CFG_TMP       CFG_FILE ".tmp"
+#define CFG_FLUSH_MS 2000 //Saves asked within this time are written once
+
+/* Led channels used when the config has none. Adding a channel only needs the config. */
+static const struct {
+    ldChan_t chan;
+    ldSys_t sys;                    //Only the limits are used
+    unsigned int vset;              //Default instant voltage, mV
+    unsigned char spec[ROUT_STEP];  //Default spectrum, 0hs to 24hs each 3hs
+} Cfg_dflt_ch[] = {
+    // White: OSRAM GW CSSRM2.CM-M5M7-XX51-1. 120V for BST900, we will limit in current
+    { { "white", "BST900", "LED_WHITE", 0 },
+      { .fwd_led_curr = 700, .fwd_led_volt = 2800, .numb_leds = 36, .wave_length = 6500,
+        .max_volt = 120000, .min_volt = 40000 }, //min: vin 36 + 4 for insurrance
+      120000, { 0, 0, 0, 75, 100, 100, 75, 0, 0 } },
+    // Blue: OSRAM GD CS8PM1.14-UOVJ-W4-1
+    { { "blue", "B6303", "LED_BLUE", 1 },
+      { .fwd_led_curr = 350, .fwd_led_volt = 2850, .numb_leds = 6, .wave_length = 451,
+        .max_volt = 32000, .min_volt = 0 }, //max: vin 36 - 4 for insurrance
+      20000, { 0, 0, 0, 80, 40, 10, 0, 3, 0 } },
+    // Red: OSRAM GH CS8PM1.24-4T2U-1
+    { { "red", "B6303", "LED_RED", 2 },
+      { .fwd_led_curr = 350, .fwd_led_volt = 2150, .numb_leds = 6, .wave_length = 660,
+        .max_volt = 32000, .min_volt = 0 },
+      20000, { 0, 0, 0, 5, 15, 40, 80, 0, 0 } }
+};
+#define CFG_DFLT_CH_NUMB (sizeof(Cfg_dflt_ch)/sizeof(Cfg_dflt_ch[0]))
+
+static int Flush_timer = -1;
+
+// Hot reload: the event loop waits on inotify and queues a job, the worker reads the file
+static int Watch_fd = -1;
+static int Watch_handler = -1;
+static char *Saved_dump; //Last config we wrote ourselves
+static pthread_mutex_t Saved_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *Shutdown_str[] = { "keep", "off", "instant" };
+
+const char *cfg_shutdown_str(shutdownLeds_t leds)
+{
+    return (leds <= SHUTDOWN_INSTANT) ? Shutdown_str[leds] : "unknown";
+}
 
-static void cfg_load_dflt(gbCfg_t *cfg)
+static int cfg_shutdown_parse(const char *str, shutdownLeds_t *leds)
 {
-    cfg->ld_instant_mode = false;
+    unsigned int i;
+
+    for (i = 0; i <= SHUTDOWN_INSTANT; i++) {
+        if (strcmp(str, Shutdown_str[i]) == 0) {
+            *leds = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Spectrum with count points evenly spaced over the day (first at 0hs, last at 24hs) */
+static void cfg_spec_from_steps(ldSpec_t *spec, const unsigned char *perc, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        spec->minute[i] = (i*LD_SPEC_MINS)/(count - 1);
+        spec->perc[i] = perc[i];
+    }
+    spec->n = count;
+    return;
+}
+
+/*
+ * Fill spec from the json of one led. Two formats are accepted:
+ *  [0, 0, 75, ...]                     Percentages evenly spaced over the day (old ld_spec)
+ *  [[0, 0], [390, 10], [420, 60], ...] Breakpoints [minute_of_day, percent], minutes increasing
+ * Returns -1 if invalid, spec is left partially written then.
+ */
+int cfg_parse_spec(json_t *j_spec, ldSpec_t *spec)
+{
+    size_t i, n = json_array_size(j_spec);
+    json_int_t minute, perc;
+    json_t *elem;
+
+    if (!json_is_array(j_spec) || (n == 0) || (n > LD_SPEC_MAX))
+        return -1;
+
+    json_array_foreach(j_spec, i, elem) {
+        if (json_is_array(elem) && (json_array_size(elem) == 2) &&
+                json_is_integer(json_array_get(elem, 0)) && json_is_integer(json_array_get(elem, 1))) {
+            minute = json_integer_value(json_array_get(elem, 0));
+            perc = json_integer_value(json_array_get(elem, 1));
+        } else if (json_is_integer(elem) && (n > 1)) {
+            minute = (i*LD_SPEC_MINS)/(n - 1);
+            perc = json_integer_value(elem);
+        } else
+            return -1;
+
+        if ((minute < 0) || (minute > LD_SPEC_MINS) || (perc < 0) || (perc > 100))
+            return -1;
+        if ((i > 0) && (minute <= spec->minute[i-1]))
+            return -1;
+
+        spec->minute[i] = (unsigned short) minute;
+        spec->perc[i] = (unsigned char) perc;
+    }
+    spec->n = n;
+
+    return 0;
+}
+
+/* Json array with the breakpoints of spec: [[minute, percent], ...] */
+json_t *cfg_spec_to_json(const ldSpec_t *spec)
+{
+    json_t *array = json_array();
+    unsigned int i;
+
+    for (i = 0; i < spec->n; i++)
+        json_array_append_new(array, json_pack("[ii]", spec->minute[i], spec->perc[i]));
+
+    return array;
+}
+
+bool cfg_spec_equal(const ldSpec_t *a, const ldSpec_t *b)
+{
+    return (a->n == b->n) && !memcmp(a->minute, b->minute, a->n*sizeof(a->minute[0])) &&
+            !memcmp(a->perc, b->perc, a->n*sizeof(a->perc[0]));
+}
+
+/***************** VERSIONS *******************/
+
+/*
+ * The published config is never written. A change is made on a copy (cfg_begin), checked,
+ * its routine points generated, and then published with one atomic pointer store (cfg_commit).
+ * The last CFG_VERSIONS configs stay in the ring, so an old version can be restored at once.
+ * A reader that keeps the config across bus transactions or a copy holds it (cfg_hold): the
+ * oldest slot is only taken for a new change once its readers released it.
+ */
+static struct {
+    gbCfg_t cfg;
+    cfgVersion_t meta;
+    unsigned int readers;   //Holds not released yet
+    bool taken;             //cfg_begin() is writing the slot, no new hold
+} Ring[CFG_VERSIONS];
+static unsigned int Ring_head;          //Slot of the published config
+static unsigned int Next_version = 1;
+static gbCfg_t *Cur = &Ring[0].cfg;     //Published config, version 0 is the empty one
+static pthread_mutex_t Write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const gbCfg_t *cfg_get(void)
+{
+    return __atomic_load_n(&Cur, __ATOMIC_ACQUIRE);
+}
+
+static unsigned int cfg_slot(const gbCfg_t *cfg)
+{
+    return ((const char *)cfg - (const char *)Ring) / sizeof(Ring[0]);
+}
+
+/* The current config, not written until cfg_release() */
+const gbCfg_t *cfg_hold(void)
+{
+    const gbCfg_t *cfg;
+    unsigned int slot;
+
+    while (1) {
+        cfg = cfg_get();
+        slot = cfg_slot(cfg);
+        __atomic_add_fetch(&Ring[slot].readers, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&Ring[slot].taken, __ATOMIC_SEQ_CST))
+            return cfg;
+        //Seen long ago and taken since, the current one is newer
+        __atomic_sub_fetch(&Ring[slot].readers, 1, __ATOMIC_SEQ_CST);
+    }
+}
 
-    cfg->ld_instant[LD_WHITE].enable = false;    
-    cfg->ld_instant[LD_WHITE].vset = 120000;    //120V for BST900. We will limit in current
-    cfg->ld_instant[LD_WHITE].cset = 100;       //0.1A
+void cfg_release(const gbCfg_t *cfg)
+{
+    __atomic_sub_fetch(&Ring[cfg_slot(cfg)].readers, 1, __ATOMIC_SEQ_CST);
+    return;
+}
 
-    cfg->ld_instant[LD_BLUE].enable = false;
-    cfg->ld_instant[LD_BLUE].vset = 20000;      //20V
-    cfg->ld_instant[LD_BLUE].cset = 100;        //0.1A
+/* Copy of the current config to be changed. Only one change at a time: commit or abort it. */
+gbCfg_t *cfg_begin(void)
+{
+    struct timespec ts = { 0, 1000000L };
+    unsigned int slot, waits = 0;
+    gbCfg_t *cfg;
+
+    pthread_mutex_lock(&Write_lock);
+    slot = (Ring_head + 1) % CFG_VERSIONS;
+
+    //The oldest version leaves the ring, once nobody reads it
+    __atomic_store_n(&Ring[slot].taken, true, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&Ring[slot].readers, __ATOMIC_SEQ_CST) != 0) {
+        if (waits++ == 1000)
+            gb_log(LOG_WARNING, "Config version %u still read after 1 s.", Ring[slot].meta.version);
+        nanosleep(&ts, NULL);
+    }
+    Ring[slot].meta.version = 0;
+
+    cfg = &Ring[slot].cfg;
+    memcpy(cfg, Cur, sizeof(*cfg));
+    return cfg;
+}
 
-    cfg->ld_instant[LD_RED].enable = false;
-    cfg->ld_instant[LD_RED].vset = 20000;       //20V
-    cfg->ld_instant[LD_RED].cset = 100;         //0.1A
+void cfg_abort(gbCfg_t *cfg)
+{
+    __atomic_store_n(&Ring[cfg_slot(cfg)].taken, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&Write_lock);
+    return;
+}
 
-    {
-        // (0 and 24hs will always repeat the number)
-        unsigned char tmp[LD_NUMB][ROUT_STEP] = {
-                //0hs, 3hs, 6hs, 9hs, 12hs, 15hs, 18hs, 21hs, 24hs
-                { 0,   0,   0,   75,  100,  100,  75,   0,    0 }, //White
-                { 0,   0,   0,   80,   40,   10,   0,   3,    0 }, //Blue
-                { 0,   0,   0,    5,   15,   40,  80,   0,    0 }  //Red
-                };
-        memcpy(cfg->ld_spec, tmp, sizeof(cfg->ld_spec));
+/* Everything a config must respect before the leds can get it */
+static int cfg_validate(const gbCfg_t *cfg)
+{
+    unsigned int ld, i;
+    const ldSpec_t *spec;
+
+    if (cfg->shutdown_leds > SHUTDOWN_INSTANT)
+        return -1;
+    if ((cfg->fog.on_s > cfg->fog.period_s) || (cfg->pwc.on_s > cfg->pwc.period_s))
+        return -1;
+
+    FOR_EACH_LED(ld) {
+        if ((cfg->ld_instant[ld].cset > Gb_ld_sys[ld].fwd_led_curr) ||
+                (cfg->ld_instant[ld].vset > Gb_ld_sys[ld].max_volt))
+            return -1;
+
+        spec = &cfg->ld_spec[ld];
+        if ((spec->n == 0) || (spec->n > LD_SPEC_MAX))
+            return -1;
+        for (i = 0; i < spec->n; i++) {
+            if ((spec->perc[i] > 100) || (spec->minute[i] > LD_SPEC_MINS) ||
+                    ((i > 0) && (spec->minute[i] <= spec->minute[i-1])))
+                return -1;
+        }
     }
+    return 0;
+}
+
+/* Check the copy from cfg_begin, generate its routine and publish it. Returns the version or -1. */
+int cfg_commit(gbCfg_t *cfg, const char *source)
+{
+    unsigned int slot = (Ring_head + 1) % CFG_VERSIONS;
+    int version;
+
+    if (cfg_validate(cfg)) {
+        cfg_abort(cfg);
+        gb_log(LOG_ERR, "Config from %s refused: out of the led limits.", source);
+        return -1;
+    }
+
+    // Generate the numbers in between for ld_routine_perc, before anyone can see it
+    ld_generate_points(cfg);
+
+    version = Next_version++;
+    Ring[slot].meta.version = version;
+    Ring[slot].meta.time = sched_now()/SCHED_MS;
+    Ring[slot].meta.source = source;
+    Ring_head = slot;
+    __atomic_store_n(&Ring[slot].taken, false, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&Cur, cfg, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&Write_lock);
+    snap_save_later();
+    return version;
+}
+
+/* Versions still in the ring, newest first */
+int cfg_versions(cfgVersion_t *list, int max)
+{
+    int i, n = 0;
+    unsigned int slot;
+
+    pthread_mutex_lock(&Write_lock);
+    for (i = 0; (i < CFG_VERSIONS) && (n < max); i++) {
+        slot = (Ring_head + CFG_VERSIONS - i) % CFG_VERSIONS;
+        if (Ring[slot].meta.version == 0)
+            break;
+        list[n++] = Ring[slot].meta;
+    }
+    pthread_mutex_unlock(&Write_lock);
+    return n;
+}
+
+/* Copy of an old version, to roll back to it. Returns -1 if it left the ring. */
+int cfg_version_get(unsigned int version, gbCfg_t *cfg)
+{
+    int i, ret = -1;
+
+    pthread_mutex_lock(&Write_lock);
+    for (i = 0; i < CFG_VERSIONS; i++) {
+        if ((version != 0) && (Ring[i].meta.version == version)) {
+            memcpy(cfg, &Ring[i].cfg, sizeof(*cfg));
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&Write_lock);
+    return ret;
+}
+
+/* Version of a held config: its slot keeps it until cfg_release() */
+unsigned int cfg_version_of(const gbCfg_t *cfg)
+{
+    return __atomic_load_n(&Ring[cfg_slot(cfg)].meta.version, __ATOMIC_RELAXED);
+}
+
+/***************** CHANNELS *******************/
+
+static void cfg_chan_dflt(void)
+{
+    unsigned int i;
+
+    memset(&Gb_ch, 0, sizeof(Gb_ch));
+    for (i = 0; i < CFG_DFLT_CH_NUMB; i++) {
+        Gb_ch.chan[i] = Cfg_dflt_ch[i].chan;
+        Gb_ld_sys[i] = Cfg_dflt_ch[i].sys;
+    }
+    Gb_ch.numb = CFG_DFLT_CH_NUMB;
+    return;
+}
+
+static int cfg_chan_str(json_t *obj, const char *key, char *dst, size_t len)
+{
+    const char *str = json_string_value(json_object_get(obj, key));
+
+    if ((str == NULL) || (str[0] == '\0') || (strlen(str) >= len))
+        return -1;
+    strcpy(dst, str);
+    return 0;
+}
+
+/*
+ * Led channel registry from the config:
+ * "channels": [{"name": "white", "model": "BST900", "driver": "LED_WHITE", "cs": 0,
+ *               "fwd_led_curr": 700, "fwd_led_volt": 2800, "numb_leds": 36,
+ *               "wave_length": 6500, "max_volt": 120000, "min_volt": 40000}, ...]
+ */
+static int cfg_chan_load(json_t *j_chans)
+{
+    gbChan_t ch;
+    ldSys_t sys[LD_MAX];
+    json_t *obj;
+    size_t i, j;
+
+    if (!json_is_array(j_chans) || (json_array_size(j_chans) == 0) || (json_array_size(j_chans) > LD_MAX))
+        return -1;
+
+    memset(&ch, 0, sizeof(ch));
+    memset(sys, 0, sizeof(sys));
+    json_array_foreach(j_chans, i, obj) {
+        if (cfg_chan_str(obj, "name", ch.chan[i].name, sizeof(ch.chan[i].name)) ||
+                cfg_chan_str(obj, "model", ch.chan[i].model, sizeof(ch.chan[i].model)) ||
+                cfg_chan_str(obj, "driver", ch.chan[i].driver, sizeof(ch.chan[i].driver)))
+            return -1;
+        for (j = 0; j < i; j++)
+            if (!strcmp(ch.chan[i].name, ch.chan[j].name))
+                return -1;
+
+        ch.chan[i].cs = json_integer_value(json_object_get(obj, "cs"));
+        sys[i].fwd_led_curr = json_integer_value(json_object_get(obj, "fwd_led_curr"));
+        sys[i].fwd_led_volt = json_integer_value(json_object_get(obj, "fwd_led_volt"));
+        sys[i].numb_leds = json_integer_value(json_object_get(obj, "numb_leds"));
+        sys[i].wave_length = json_integer_value(json_object_get(obj, "wave_length"));
+        sys[i].max_volt = json_integer_value(json_object_get(obj, "max_volt"));
+        sys[i].min_volt = json_integer_value(json_object_get(obj, "min_volt"));
+        if ((ch.chan[i].cs >= LD_CS_MAX) || (sys[i].fwd_led_curr == 0) || (sys[i].max_volt < sys[i].min_volt))
+            return -1;
+        //Two channels on the same address would talk to the same driver
+        for (j = 0; j < i; j++)
+            if (ch.chan[i].cs == ch.chan[j].cs)
+                return -1;
+    }
+    ch.numb = json_array_size(j_chans);
+
+    Gb_ch = ch;
+    memcpy(Gb_ld_sys, sys, sizeof(sys));
+    return 0;
+}
+
+static json_t *cfg_chan_to_json(void)
+{
+    json_t *array = json_array();
+    unsigned int ld;
+
+    FOR_EACH_LED(ld)
+        json_array_append_new(array, json_pack("{sssssssisisisisisisi}",
+                "name", Gb_ch.chan[ld].name,
+                "model", Gb_ch.chan[ld].model,
+                "driver", Gb_ch.chan[ld].driver,
+                "cs", Gb_ch.chan[ld].cs,
+                "fwd_led_curr", Gb_ld_sys[ld].fwd_led_curr,
+                "fwd_led_volt", Gb_ld_sys[ld].fwd_led_volt,
+                "numb_leds", Gb_ld_sys[ld].numb_leds,
+                "wave_length", Gb_ld_sys[ld].wave_length,
+                "max_volt", Gb_ld_sys[ld].max_volt,
+                "min_volt", Gb_ld_sys[ld].min_volt));
+
+    return array;
+}
+
+/* Index of the channel with this name, -1 if none */
+int cfg_chan_find(const char *name)
+{
+    unsigned int ld;
+
+    FOR_EACH_LED(ld)
+        if (!strcmp(Gb_ch.chan[ld].name, name))
+            return ld;
+    return -1;
+}
+
+/***************** CONFIG *******************/
+
+/* Default instant config and spectrum of a channel */
+static void cfg_load_dflt_ld(gbCfg_t *cfg, ldBoard_t ld)
+{
+    static const unsigned char off[2] = { 0, 0 };
+    unsigned int i;
+
+    cfg->ld_instant[ld].enable = false;
+    cfg->ld_instant[ld].vset = Gb_ld_sys[ld].max_volt;
+    cfg->ld_instant[ld].cset = 100; //0.1A
+    cfg_spec_from_steps(&cfg->ld_spec[ld], off, 2);
+
+    for (i = 0; i < CFG_DFLT_CH_NUMB; i++) {
+        if (!strcmp(Cfg_dflt_ch[i].chan.name, Gb_ch.chan[ld].name)) {
+            cfg->ld_instant[ld].vset = Cfg_dflt_ch[i].vset;
+            // (0 and 24hs will always repeat the number)
+            cfg_spec_from_steps(&cfg->ld_spec[ld], Cfg_dflt_ch[i].spec, ROUT_STEP);
+        }
+    }
+    return;
+}
+
+static void cfg_load_dflt(gbCfg_t *cfg)
+{
+    unsigned int ld;
+
+    cfg->ld_instant_mode = false;
+    cfg->regul_ms = REGUL_DFLT_MS;
+    cfg->shutdown_leds = SHUTDOWN_KEEP;
+    cfg->shutdown_ms = SHUTDOWN_DFLT_MS;
+    cfg->fog.period_s = cfg->fog.on_s = 0;
+    cfg->pwc.period_s = cfg->pwc.on_s = 0;
 
-    // Generate the numbers in between for ld_routine_perc
-    // It will also set ld_routine_init to true
-    ld_generate_points();
+    FOR_EACH_LED(ld)
+        cfg_load_dflt_ld(cfg, ld);
 
     return;
 }
 
-static void cfg_print(gbCfg_t *cfg)
+static void cfg_print(const gbCfg_t *cfg)
 {
-    int i;
+    unsigned int i, ld;
 
     debug("CFG LOADED:\n");
+    debug("    channels:\n");
+    FOR_EACH_LED(ld)
+        debug("        %s: %s %s cs:%u\n", Gb_ch.chan[ld].name, Gb_ch.chan[ld].model,
+                Gb_ch.chan[ld].driver, Gb_ch.chan[ld].cs);
     debug("    ld_instant_mode: %d\n", cfg->ld_instant_mode);
+    debug("    regul_ms: %u\n", cfg->regul_ms);
+    debug("    shutdown_leds: %s\n", cfg_shutdown_str(cfg->shutdown_leds));
+    debug("    shutdown_ms: %u\n", cfg->shutdown_ms);
+    debug("    fog: %u s each %u s\n", cfg->fog.on_s, cfg->fog.period_s);
+    debug("    pwc: %u s each %u s\n", cfg->pwc.on_s, cfg->pwc.period_s);
     debug("    ld_instant:\n");
-    debug("        white:\n");
-    debug("            enable: %d\n", cfg->ld_instant[LD_WHITE].enable);
-    debug("            vset: %u\n", cfg->ld_instant[LD_WHITE].vset);
-    debug("            cset: %u\n", cfg->ld_instant[LD_WHITE].cset);
-    debug("        blue:\n");
-    debug("            enable: %d\n", cfg->ld_instant[LD_BLUE].enable);
-    debug("            vset: %u\n", cfg->ld_instant[LD_BLUE].vset);
-    debug("            cset: %u\n", cfg->ld_instant[LD_BLUE].cset);
-    debug("        red:\n");
-    debug("            enable: %d\n", cfg->ld_instant[LD_RED].enable);
-    debug("            vset: %u\n", cfg->ld_instant[LD_RED].vset);
-    debug("            cset: %u\n", cfg->ld_instant[LD_RED].cset);
+    FOR_EACH_LED(ld) {
+        debug("        %s:\n", Gb_ch.chan[ld].name);
+        debug("            enable: %d\n", cfg->ld_instant[ld].enable);
+        debug("            vset: %u\n", cfg->ld_instant[ld].vset);
+        debug("            cset: %u\n", cfg->ld_instant[ld].cset);
+    }
     debug("    ld_spec:\n");
-    debug("        white: [ "); for (i=0; i<ROUT_STEP; i++) debug("%u ", cfg->ld_spec[LD_WHITE][i]); debug("]\n");
-    debug("        blue:  [ "); for (i=0; i<ROUT_STEP; i++) debug("%u ", cfg->ld_spec[LD_BLUE][i]); debug("]\n");
-    debug("        red:   [ "); for (i=0; i<ROUT_STEP; i++) debug("%u ", cfg->ld_spec[LD_RED][i]); debug("]\n\n");
+    FOR_EACH_LED(ld) {
+        debug("        %s: [ ", Gb_ch.chan[ld].name);
+        for (i=0; i<cfg->ld_spec[ld].n; i++)
+            debug("%u:%u ", cfg->ld_spec[ld].minute[i], cfg->ld_spec[ld].perc[i]);
+        debug("]\n");
+    }
+    debug("\n");
 
     return;
 }
 
-void cfg_load(gbCfg_t *cfg)
+/* An actuator from the config, off when missing */
+static void cfg_act_read(json_t *obj, actCfg_t *act)
 {
-    json_t *j_body, *root, *obj, *elem;
-    json_error_t error;
-    const char *key;
-    int i = 0;
-
-    j_body = json_load_file("./CFG.json", 0, &error);
-    if (!j_body) {
-        cfg_load_dflt(cfg);
-        syslog(LOG_ERR, "Unable to open config file (%s). Default config will be used.", error.text);
-        goto decref;
-    }
+    act->period_s = json_integer_value(json_object_get(obj, "period_s"));
+    act->on_s = json_integer_value(json_object_get(obj, "on_s"));
+    return;
+}
 
+/* The config of the registered channels from a CFG.json body. Entries missing get their default. */
+static void cfg_read(json_t *j_body, gbCfg_t *cfg)
+{
+    json_t *obj;
+    unsigned int ld;
 
     cfg->ld_instant_mode = json_boolean_value(json_object_get(j_body,"ld_instant_mode"));
 
+    obj = json_object_get(j_body,"regul_ms");
+    cfg->regul_ms = json_is_integer(obj) ? json_integer_value(obj) : REGUL_DFLT_MS;
+
+    obj = json_object_get(j_body,"shutdown_leds");
+    cfg->shutdown_leds = SHUTDOWN_KEEP;
+    if (json_is_string(obj) && (cfg_shutdown_parse(json_string_value(obj), &cfg->shutdown_leds) < 0))
+        gb_log(LOG_WARNING, "Unknown shutdown_leds %s in the config, the leds are kept.", json_string_value(obj));
+
+    obj = json_object_get(j_body,"shutdown_ms");
+    cfg->shutdown_ms = json_is_integer(obj) ? json_integer_value(obj) : SHUTDOWN_DFLT_MS;
+
+    cfg_act_read(json_object_get(j_body,"fog"), &cfg->fog);
+    cfg_act_read(json_object_get(j_body,"pwc"), &cfg->pwc);
 
-    root = json_object_get(j_body,"ld_instant");
-    //key is white, blue, red. Obj is what is inside it, ex vset: 120000
-    json_object_foreach(root, key, obj) {
-        if (!strncmp("white", key, 5)) i=LD_WHITE;
-        else if (!strncmp("blue",  key, 4)) i=LD_BLUE;
-        else if (!strncmp("red",   key, 3)) i=LD_RED;
-        else {
-            syslog(LOG_ERR, "Config file is invalid.");
-            goto decref;
+    FOR_EACH_LED(ld) {
+        cfg_load_dflt_ld(cfg, ld);
+
+        //Obj is what is inside the channel, ex vset: 120000
+        obj = json_object_get(json_object_get(j_body,"ld_instant"), Gb_ch.chan[ld].name);
+        if (obj) {
+            cfg->ld_instant[ld].enable = json_boolean_value(json_object_get(obj,"enable"));
+            cfg->ld_instant[ld].vset = json_integer_value(json_object_get(obj,"vset"));
+            cfg->ld_instant[ld].cset = json_integer_value(json_object_get(obj,"cset"));
+        }
+
+        obj = json_object_get(json_object_get(j_body,"ld_spec"), Gb_ch.chan[ld].name);
+        if (obj) {
+            ldSpec_t spec;
+            if (cfg_parse_spec(obj, &spec))
+                gb_log(LOG_ERR, "Config file has an invalid %s ld_spec. Default spectrum will be used.", Gb_ch.chan[ld].name);
+            else
+                cfg->ld_spec[ld] = spec;
         }
-        cfg->ld_instant[i].enable = json_boolean_value(json_object_get(obj,"enable"));
-        cfg->ld_instant[i].vset = json_integer_value(json_object_get(obj,"vset"));
-        cfg->ld_instant[i].cset = json_integer_value(json_object_get(obj,"cset"));
-    }
-
-
-    {
-        unsigned char *p = &(cfg->ld_spec[0][0]);
-        int e;
-        root = json_object_get(j_body,"ld_spec");
-        json_object_foreach(root, key, obj) {
-            i = 0;
-            json_array_foreach(obj, e, elem) {
-                i++;
-                if(i <= ROUT_STEP) {
-                    *p = (unsigned char) json_integer_value(elem);
-                    p++;
-                } else
-                    goto decref;
-            }
+    }
+    return;
+}
+
+/*
+ * Load the led channels and the config. Channels, ld_instant and ld_spec entries
+ * missing from the file get their default.
+ */
+void cfg_load(void)
+{
+    json_t *j_body, *root;
+    json_error_t error;
+    gbCfg_t *cfg;
+
+    j_body = json_load_file(CFG_FILE, 0, &error);
+    if (!j_body) {
+        cfg_chan_dflt();
+        gb_log(LOG_ERR, "Unable to open config file (%s). Default config will be used.", error.text);
+    } else {
+        root = json_object_get(j_body,"channels");
+        if (!root)
+            cfg_chan_dflt();
+        else if (cfg_chan_load(root)) {
+            cfg_chan_dflt();
+            gb_log(LOG_ERR, "Config file has invalid channels. Default channels will be used.");
         }
     }
-    //Generate intemediate points
-    ld_generate_points();
 
-    syslog(LOG_NOTICE, "Config successfully loaded.");
-    cfg_print(cfg);
+    cfg = cfg_begin();
+    if (j_body)
+        cfg_read(j_body, cfg);
+    else
+        cfg_load_dflt(cfg);
 
-decref:
+    //Only j_body is ours, the objects got from it are borrowed references
     json_decref(j_body);
-    json_decref(root);
-    json_decref(obj);
-    json_decref(elem);
 
+    if (cfg_commit(cfg, "file") < 0) {
+        gb_log(LOG_ERR, "Config file is out of the led limits. Default config will be used.");
+        cfg = cfg_begin();
+        cfg_load_dflt(cfg);
+        cfg_commit(cfg, "default");
+    } else
+        gb_log(LOG_NOTICE, "Config successfully loaded.");
+
+    cfg_print(cfg_get());
     return;
 }
 
-void cfg_save(gbCfg_t *cfg)
+/* ld_instant as saved and served on /config: {"white": {"enable": false, "vset": 120000, "cset": 100}, ...} */
+json_t *cfg_instant_to_json(const gbCfg_t *cfg)
 {
-    int i;
-    json_t *array_w = json_array();
-    json_t *array_b = json_array();
-    json_t *array_r = json_array();
-    json_t *j_body;
+    json_t *obj = json_object();
+    unsigned int ld;
+
+    FOR_EACH_LED(ld)
+        json_object_set_new(obj, Gb_ch.chan[ld].name, json_pack("{sbsisi}",
+                "enable", cfg->ld_instant[ld].enable,
+                "vset", cfg->ld_instant[ld].vset,
+                "cset", cfg->ld_instant[ld].cset));
+    return obj;
+}
+
+/* An actuator as saved and served on /config: {"period_s": 3600, "on_s": 30} */
+json_t *cfg_act_to_json(const actCfg_t *act)
+{
+    return json_pack("{sisi}", "period_s", act->period_s, "on_s", act->on_s);
+}
 
-    for (i = 0; i < ROUT_STEP; i++) {
-        json_array_append_new(array_w, json_integer(cfg->ld_spec[LD_WHITE][i]));
-        json_array_append_new(array_b, json_integer(cfg->ld_spec[LD_BLUE][i]));
-        json_array_append_new(array_r, json_integer(cfg->ld_spec[LD_RED][i]));
+/* ld_spec as saved and served on /config: {"white": [[minute, percent], ...], ...} */
+json_t *cfg_specs_to_json(const gbCfg_t *cfg)
+{
+    json_t *obj = json_object();
+    unsigned int ld;
+
+    FOR_EACH_LED(ld)
+        json_object_set_new(obj, Gb_ch.chan[ld].name, cfg_spec_to_json(&cfg->ld_spec[ld]));
+    return obj;
+}
+
+/* The fields of /config written as the json above, without building them (see gb_json.c) */
+void cfg_to_jw(jwBuf_t *w, const gbCfg_t *cfg)
+{
+    unsigned int ld, i;
+
+    jw_bool(w, "ld_instant_mode", cfg->ld_instant_mode);
+    jw_int(w, "regul_ms", cfg->regul_ms);
+    jw_str(w, "shutdown_leds", cfg_shutdown_str(cfg->shutdown_leds));
+    jw_int(w, "shutdown_ms", cfg->shutdown_ms);
+    jw_obj(w, "fog");
+    jw_int(w, "period_s", cfg->fog.period_s);
+    jw_int(w, "on_s", cfg->fog.on_s);
+    jw_obj_end(w);
+    jw_obj(w, "pwc");
+    jw_int(w, "period_s", cfg->pwc.period_s);
+    jw_int(w, "on_s", cfg->pwc.on_s);
+    jw_obj_end(w);
+
+    jw_obj(w, "ld_instant");
+    FOR_EACH_LED(ld) {
+        jw_obj(w, Gb_ch.chan[ld].name);
+        jw_bool(w, "enable", cfg->ld_instant[ld].enable);
+        jw_int(w, "vset", cfg->ld_instant[ld].vset);
+        jw_int(w, "cset", cfg->ld_instant[ld].cset);
+        jw_obj_end(w);
+    }
+    jw_obj_end(w);
+
+    jw_obj(w, "ld_spec");
+    FOR_EACH_LED(ld) {
+        const ldSpec_t *spec = &cfg->ld_spec[ld];
+
+        jw_arr(w, Gb_ch.chan[ld].name);
+        for (i = 0; i < spec->n; i++) {
+            jw_arr(w, NULL);
+            jw_int(w, NULL, spec->minute[i]);
+            jw_int(w, NULL, spec->perc[i]);
+            jw_arr_end(w);
+        }
+        jw_arr_end(w);
     }
+    jw_obj_end(w);
+    return;
+}
 
-    j_body = json_pack("{sbs{s{sbsisi}s{sbsisi}s{sbsisi}}s{sososo}}",
-            "ld_instant_mode", cfg->ld_instant_mode,
-            "ld_instant",
-                "white",
-                    "enable", cfg->ld_instant[LD_WHITE].enable,
-                    "vset", cfg->ld_instant[LD_WHITE].vset,
-                    "cset", cfg->ld_instant[LD_WHITE].cset, 
-                "blue",
-                    "enable", cfg->ld_instant[LD_BLUE].enable,
-                    "vset", cfg->ld_instant[LD_BLUE].vset,
-                    "cset", cfg->ld_instant[LD_BLUE].cset, 
-                "red",
-                    "enable", cfg->ld_instant[LD_RED].enable,
-                    "vset", cfg->ld_instant[LD_RED].vset,
-                    "cset", cfg->ld_instant[LD_RED].cset,
-            "ld_spec",
-                "white", array_w,
-                "blue", array_b,
-                "red", array_r);
-
-
-    if (json_dump_file(j_body, "./CFG.json", JSON_INDENT(4)) != 0)
-        syslog(LOG_ERR, "Unable to save config.");
+void cfg_save(void)
+{
+    const gbCfg_t *cfg = cfg_hold();
+    json_t *j_body;
+    char *dump;
+    bool err;
+    FILE *fp;
 
+    j_body = json_pack("{sosbsisssisosososo}",
+            "channels", cfg_chan_to_json(),
+            "ld_instant_mode", cfg->ld_instant_mode,
+            "regul_ms", cfg->regul_ms,
+            "shutdown_leds", cfg_shutdown_str(cfg->shutdown_leds),
+            "shutdown_ms", cfg->shutdown_ms,
+            "fog", cfg_act_to_json(&cfg->fog),
+            "pwc", cfg_act_to_json(&cfg->pwc),
+            "ld_instant", cfg_instant_to_json(cfg),
+            "ld_spec", cfg_specs_to_json(cfg));
+    cfg_release(cfg);
+
+    //The objects were stolen by json_pack "o", they go with j_body
+    dump = json_dumps(j_body, JSON_INDENT(4));
     json_decref(j_body);
-    json_decref(array_w);
-    json_decref(array_b);
-    json_decref(array_r);
+
+    //Written aside and renamed, a crash never leaves half a config
+    fp = dump ? fopen(CFG_TMP, "w") : NULL;
+    err = (fp == NULL) || (fputs(dump, fp) == EOF) || (fflush(fp) != 0) || (fsync(fileno(fp)) != 0);
+    if (fp && (fclose(fp) != 0))
+        err = true;
+    if (err) {
+        gb_log(LOG_ERR, "Unable to save config.");
+        unlink(CFG_TMP);
+        free(dump);
+        return;
+    }
+
+    //The watcher must not reload what we write, it is known before the rename shows it
+    pthread_mutex_lock(&Saved_lock);
+    free(Saved_dump);
+    Saved_dump = dump;
+    pthread_mutex_unlock(&Saved_lock);
+    if (rename(CFG_TMP, CFG_FILE) < 0) {
+        gb_log(LOG_ERR, "Unable to save config: %s.", strerror(errno));
+        unlink(CFG_TMP);
+    }
     return;
 }
 
-void cfg_apply(gbCfg_t *cfg)
+void cfg_apply(void)
 {
+    const gbCfg_t *cfg = cfg_hold();
     int i, ret;
     bool enable;
 
     FOR_EACH_LED(i) {
  
         ret = ld_set_voltage(i, cfg->ld_instant[i].vset);
-        cfg->init_volt_applied[i] = (ret == 0) ? true : false;
+        if (ret == 0)
+            LD_BIT_SET(Gb_ch.volt_ok, i);
+        else
+            LD_BIT_CLR(Gb_ch.volt_ok, i);
 
         if (cfg->ld_instant_mode) {
-            enable = (cfg->ld_instant[i].enable & cfg->ld_instant[i].cset);
+            enable = (cfg->ld_instant[i].enable && cfg->ld_instant[i].cset);
             ret |= ld_set_current(i, cfg->ld_instant[i].cset);
             if (!ret)
                 ret |= ld_set_output(i, enable);
             if (ret)
-                syslog(LOG_ERR, "Error applying the config on Led %i.", i);
+                gb_log(LOG_ERR, "Error applying the config on Led %s.", Gb_ch.chan[i].name);
         }
     }
 
+    cfg_release(cfg);
+    return;
+}
+
+/* Flush timer: write the config asked to be saved */
+static long long cfg_flush_tick(void *arg, long long now)
+{
+    cfg_save();
+    return 0;
+}
+
+void cfg_sched_init(void)
+{
+    Flush_timer = sched_add("cfg_flush", cfg_flush_tick, NULL, 0, 0);
+    return;
+}
+
+/* Save the config shortly, once for a burst of changes */
+void cfg_save_later(void)
+{
+    schedTimer_t t;
+
+    //Keep the deadline already set, it would never expire during a long burst
+    if ((sched_get(Flush_timer, &t) == 0) && (t.deadline != 0))
+        return;
+    sched_set(Flush_timer, sched_now() + CFG_FLUSH_MS*SCHED_MS);
+    return;
+}
+
+/* Shutdown: write now a save still waiting on its timer */
+void cfg_save_pending(void)
+{
+    schedTimer_t t;
+
+    if ((sched_get(Flush_timer, &t) < 0) || (t.deadline == 0))
+        return;
+    sched_set(Flush_timer, 0);
+    cfg_save();
+    return;
+}
+
+/***************** HOT RELOAD *******************/
+
+/* Read the whole config file, NULL if it can not be read */
+static char *cfg_read_file(void)
+{
+    FILE *fp = fopen(CFG_FILE, "r");
+    char *buf = NULL;
+    long len;
+
+    if (fp == NULL)
+        return NULL;
+
+    if ((fseek(fp, 0, SEEK_END) == 0) && ((len = ftell(fp)) >= 0) && (fseek(fp, 0, SEEK_SET) == 0) &&
+            ((buf = malloc(len + 1)) != NULL)) {
+        if (fread(buf, 1, len, fp) != (size_t)len) {
+            free(buf);
+            buf = NULL;
+        } else
+            buf[len] = '\0';
+    }
+    fclose(fp);
+    return buf;
+}
+
+/*
+ * Job worker side of a reload: CFG.json into cfg. 1 to apply it, 0 if there is nothing to
+ * (removed, being replaced or our own save) and -1 if it is invalid.
+ */
+int cfg_reload_read(gbCfg_t *cfg)
+{
+    json_t *j_body, *j_chans;
+    json_error_t error;
+    char *text;
+    bool own;
+
+    text = cfg_read_file();
+    if (text == NULL)
+        return 0; //Removed or being replaced, the new file comes with its own event
+
+    pthread_mutex_lock(&Saved_lock);
+    own = (Saved_dump != NULL) && (strcmp(text, Saved_dump) == 0);
+    pthread_mutex_unlock(&Saved_lock);
+    if (own) {
+        free(text);
+        return 0;
+    }
+
+    j_body = json_loads(text, 0, &error);
+    free(text);
+    if (!j_body) {
+        gb_log(LOG_ERR, "Config file changed but it is invalid (%s, line %d). Keeping the running config.", error.text, error.line);
+        return -1;
+    }
+
+    //The registry is used by every module, it only changes on a restart
+    j_chans = json_object_get(j_body, "channels");
+    if (j_chans) {
+        json_t *j_cur = cfg_chan_to_json();
+        if (!json_equal(j_chans, j_cur))
+            gb_log(LOG_WARNING, "Led channels changed in the config file, restart the daemon to apply them.");
+        json_decref(j_cur);
+    }
+
+    cfg_read(j_body, cfg);
+    json_decref(j_body);
+    return 1;
+}
+
+/* CFG.json changed on disk (or SIGHUP): the job worker reads it, the loop thread only queues the job */
+void cfg_reload(void)
+{
+    gbJob_t job;
+
+    memset(&job, 0, sizeof(job));
+    job.type = JOB_RELOAD;
+    if (job_submit(&job) < 0) {
+        gb_log(LOG_ERR, "Job queue is full, config file changes not applied.");
+        return;
+    }
+    gb_log(LOG_NOTICE, "Config file changed, reloading.");
+    return;
+}
+
+/* Event loop handler of the inotify fd */
+static void cfg_watch(int fd, uint32_t events, void *arg)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+    bool changed = false;
+
+    //Drain it all, a save comes as a burst of events and is reloaded once
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if (ev->len && (strcmp(ev->name, CFG_FILE_NAME) == 0))
+                changed = true;
+        }
+    }
+    if (changed)
+        cfg_reload();
+    return;
+}
+
+/* Watch the directory: editors often write a new file and rename it over the config */
+int cfg_watch_init(void)
+{
+    Watch_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if ((Watch_fd < 0) || (inotify_add_watch(Watch_fd, CFG_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)) {
+        gb_log(LOG_ERR, "Unable to watch the config file: %s", strerror(errno));
+        goto error;
+    }
+
+    Watch_handler = loop_add("config watch", Watch_fd, EPOLLIN, cfg_watch, NULL);
+    if (Watch_handler < 0)
+        goto error;
+    return 0;
+
+error:
+    if (Watch_fd >= 0) close(Watch_fd);
+    Watch_fd = -1;
+    return -1;
+}
+
+void cfg_watch_stop(void)
+{
+    if (Watch_fd < 0)
+        return;
+
+    loop_del(Watch_handler);
+    close(Watch_fd);
+    Watch_fd = -1;
     return;
 }
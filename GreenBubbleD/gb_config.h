@@ -23,9 +23,43 @@
 #define GB_CONFIG_H
 
 #include <gb_main.h>
+#include <gb_json.h>
 
-void cfg_load(gbCfg_t *cfg);
-void cfg_save(gbCfg_t *cfg);
-void cfg_apply(gbCfg_t *cfg);
+#define CFG_VERSIONS 8 //Configs kept for rollback, the published one included
+
+typedef struct {
+    unsigned int version;
+    long long time;         //ms, when it was published
+    const char *source;     //"file", "instant", "spectrum", "reload", "rollback"...
+} cfgVersion_t;
+
+const gbCfg_t *cfg_get(void);
+const gbCfg_t *cfg_hold(void);
+void cfg_release(const gbCfg_t *cfg);
+gbCfg_t *cfg_begin(void);
+int cfg_commit(gbCfg_t *cfg, const char *source);
+void cfg_abort(gbCfg_t *cfg);
+int cfg_versions(cfgVersion_t *list, int max);
+int cfg_version_get(unsigned int version, gbCfg_t *cfg);
+unsigned int cfg_version_of(const gbCfg_t *cfg);
+void cfg_load(void);
+void cfg_save(void);
+void cfg_apply(void);
+void cfg_sched_init(void);
+void cfg_save_later(void);
+int cfg_parse_spec(json_t *j_spec, ldSpec_t *spec);
+json_t *cfg_spec_to_json(const ldSpec_t *spec);
+json_t *cfg_instant_to_json(const gbCfg_t *cfg);
+json_t *cfg_act_to_json(const actCfg_t *act);
+json_t *cfg_specs_to_json(const gbCfg_t *cfg);
+void cfg_to_jw(jwBuf_t *w, const gbCfg_t *cfg);
+int cfg_chan_find(const char *name);
+bool cfg_spec_equal(const ldSpec_t *a, const ldSpec_t *b);
+const char *cfg_shutdown_str(shutdownLeds_t leds);
+void cfg_save_pending(void);
+void cfg_reload(void);
+int cfg_reload_read(gbCfg_t *cfg);
+int cfg_watch_init(void);
+void cfg_watch_stop(void);
 
 #endif //GB_CONFIG_H
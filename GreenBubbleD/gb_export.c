@@ -0,0 +1,572 @@
+/*
+ * gb_export.c:
+ *	Push of the samples to a time-series sink for the GreenBubble project
+ *	Each status sample becomes InfluxDB line protocol records, sent over TCP as
+ *	they are (influx://host:port, a Telegraf socket_listener) or as the payload
+ *	of MQTT QoS 0 publishes (mqtt://host:port/topic). The socket is non-blocking on
+ *	the event loop. Records wait in a bounded queue, the oldest go to a spool file
+ *	while the sink is down, and a write carries as many as fit in EXPORT_BATCH, so
+ *	a backlog drains in a few large writes once the sink is back.
+ *	Neither sink acknowledges the records: a batch is done once the kernel took it,
+ *	so what was still in the socket buffers when the connection drops is lost. Only
+ *	a batch cut in the middle of its write is sent again.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <gb_export.h>
+#include <gb_main.h>
+#include <gb_serial.h>
+#include <gb_loop.h>
+#include <gb_sched.h>
+#include <gb_hal.h>
+#include <gb_log.h>
+
+typedef enum {
+    EXP_DOWN,
+    EXP_RESOLVING,
+    EXP_CONNECTING,
+    EXP_UP
+} expState_t;
+
+static const char *State_str[] = { "down", "resolving", "connecting", "up" };
+
+// Sink
+static char Sink[128];
+static bool Mqtt;
+static char Host[64], Port[8], Topic[128];
+static char Unit[64];               //Tag of the records, the host name
+static expState_t State = EXP_DOWN;
+static struct sockaddr_storage Addr;   //Of the sink, from the resolver thread
+static socklen_t Addr_len;
+static int Addr_err;                    //getaddrinfo() error, 0 once Addr is set
+static int Sock = -1;
+static int Loop_id = -1;
+static int Timer = -1;
+static unsigned int Retry_s = EXPORT_RETRY_S;
+
+// Records not sent yet: the queue, then the spool for the oldest ones
+static char Queue[EXPORT_QUEUE][EXPORT_LINE];
+static unsigned int Head, Len;
+static int Spool = -1;
+static off_t Spool_off, Spool_size; //Sent up to Spool_off
+static bool Spool_full;
+
+// Batch being sent: its records, then the bytes on the socket
+static char Batch[EXPORT_BATCH];
+static size_t Batch_len, Batch_spool;   //Bytes of it from the spool
+static unsigned int Batch_lines;
+static char Out[EXPORT_BATCH + 256];
+static size_t Out_len, Out_pos;
+
+static struct {
+    unsigned long sent;             //Records the sink took
+    unsigned long batches;
+    unsigned long dropped;          //Spool full
+    unsigned long connects;
+} Stats;
+
+// The loop thread runs the export, the web threads read its state
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+
+/***************** SPOOL *******************/
+
+static int spool_open(void)
+{
+    if (Spool >= 0)
+        return 0;
+    Spool = open(EXPORT_SPOOL, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (Spool < 0) {
+        gb_log(LOG_ERR, "Unable to open %s: %s", EXPORT_SPOOL, strerror(errno));
+        return -1;
+    }
+    Spool_size = lseek(Spool, 0, SEEK_END);
+    return 0;
+}
+
+/* Keep records on disk while the sink is down, dropped once the spool is full */
+static void spool_write(const char *buf, size_t len)
+{
+    if (spool_open() < 0)
+        return;
+    if (Spool_size + (off_t)len > EXPORT_SPOOL_MAX) {
+        Stats.dropped++;
+        if (!Spool_full)
+            gb_log(LOG_WARNING, "%s is full, samples are dropped until the sink is back.", EXPORT_SPOOL);
+        Spool_full = true;
+        return;
+    }
+    if (write(Spool, buf, len) != (ssize_t)len) {
+        gb_log(LOG_ERR, "Unable to write %s: %s", EXPORT_SPOOL, strerror(errno));
+        return;
+    }
+    Spool_size += len;
+    return;
+}
+
+/***************** QUEUE *******************/
+
+static void queue_push(const char *line)
+{
+    if (Len == EXPORT_QUEUE) {
+        spool_write(Queue[Head], strlen(Queue[Head]));
+        Head = (Head + 1) % EXPORT_QUEUE;
+        Len--;
+    }
+    snprintf(Queue[(Head + Len) % EXPORT_QUEUE], EXPORT_LINE, "%s", line);
+    Len++;
+    return;
+}
+
+/* Next batch, from the spool first as it has the oldest records. False if there is nothing to send. */
+static bool batch_fill(void)
+{
+    ssize_t n;
+    size_t l;
+
+    if (Batch_len > 0)
+        return true; //Not taken by the sink before the connection dropped
+    Batch_lines = 0;
+    Batch_spool = 0;
+
+    if (Spool_off < Spool_size) {
+        n = pread(Spool, Batch, sizeof(Batch), Spool_off);
+        while ((n > 0) && (Batch[n - 1] != '\n'))
+            n--; //Whole records only
+        if (n <= 0) {
+            gb_log(LOG_ERR, "Unable to read %s, its records are dropped.", EXPORT_SPOOL);
+            Spool_off = Spool_size;
+        } else {
+            Batch_len = Batch_spool = n;
+            for (l = 0; l < Batch_len; l++)
+                Batch_lines += (Batch[l] == '\n');
+            return true;
+        }
+    }
+
+    while (Len > 0) {
+        l = strlen(Queue[Head]);
+        if (Batch_len + l > sizeof(Batch))
+            break;
+        memcpy(Batch + Batch_len, Queue[Head], l);
+        Batch_len += l;
+        Batch_lines++;
+        Head = (Head + 1) % EXPORT_QUEUE;
+        Len--;
+    }
+    return Batch_len > 0;
+}
+
+/* The kernel took the batch, the sink does not say more */
+static void batch_done(void)
+{
+    Stats.sent += Batch_lines;
+    Stats.batches++;
+    Spool_off += Batch_spool;
+    if ((Spool_off > 0) && (Spool_off == Spool_size)) {
+        if (ftruncate(Spool, 0) == 0)
+            Spool_off = Spool_size = 0;
+        Spool_full = false;
+        gb_log(LOG_NOTICE, "Spooled samples sent to %s.", Sink);
+    }
+    Batch_len = 0;
+    return;
+}
+
+/***************** MQTT *******************/
+
+static size_t mqtt_len(char *buf, size_t len)
+{
+    size_t n = 0;
+
+    do {
+        buf[n] = len % 128;
+        len /= 128;
+        if (len)
+            buf[n] |= 0x80;
+        n++;
+    } while (len);
+    return n;
+}
+
+static size_t mqtt_str(char *buf, const char *s)
+{
+    size_t l = strlen(s);
+
+    buf[0] = l >> 8;
+    buf[1] = l & 0xff;
+    memcpy(buf + 2, s, l);
+    return l + 2;
+}
+
+/* CONNECT, clean session and no keep alive: a QoS 0 publisher has no state on the broker */
+static size_t mqtt_connect(char *buf)
+{
+    char var[128], id[64];
+    size_t n = 0, v = 0;
+
+    snprintf(id, sizeof(id), "gb-%.48s", Unit);
+    v += mqtt_str(var + v, "MQTT");
+    var[v++] = 4;       //3.1.1
+    var[v++] = 0x02;    //Clean session
+    var[v++] = 0;
+    var[v++] = 0;       //Keep alive off
+    v += mqtt_str(var + v, id);
+
+    buf[n++] = 0x10;
+    n += mqtt_len(buf + n, v);
+    memcpy(buf + n, var, v);
+    return n + v;
+}
+
+/***************** SOCKET *******************/
+
+static void export_down(const char *why)
+{
+    if (Sock >= 0) {
+        loop_del(Loop_id);
+        close(Sock);
+    }
+    Sock = -1;
+    if (State == EXP_UP)
+        gb_log(LOG_WARNING, "Export to %s lost: %s", Sink, why);
+    else
+        gb_log(LOG_DEBUG, "Export to %s failed: %s\n", Sink, why);
+    State = EXP_DOWN;
+    sched_set(Timer, sched_now() + Retry_s*1000LL*SCHED_MS);
+    Retry_s = (Retry_s*2 > EXPORT_RETRY_MAX) ? EXPORT_RETRY_MAX : Retry_s*2;
+    return;
+}
+
+/* Framing of the batch on the socket, after the MQTT CONNECT of a new connection */
+static void export_frame(bool connect)
+{
+    size_t v;
+
+    Out_len = Out_pos = 0;
+    if (connect && Mqtt)
+        Out_len = mqtt_connect(Out);
+    if (!batch_fill())
+        return;
+    if (Mqtt) {
+        Out[Out_len++] = 0x30; //PUBLISH, QoS 0
+        v = 2 + strlen(Topic) + Batch_len;
+        Out_len += mqtt_len(Out + Out_len, v);
+        Out_len += mqtt_str(Out + Out_len, Topic);
+    }
+    memcpy(Out + Out_len, Batch, Batch_len);
+    Out_len += Batch_len;
+    return;
+}
+
+/* Write what the socket takes, batch after batch */
+static void export_send(void)
+{
+    ssize_t n;
+
+    while (State == EXP_UP) {
+        if (Out_pos == Out_len) {
+            if (Out_len > 0 && Batch_len > 0)
+                batch_done();
+            export_frame(false);
+            if (Out_len == 0) {
+                loop_mod(Loop_id, Sock, EPOLLIN);
+                return;
+            }
+        }
+        n = send(Sock, Out + Out_pos, Out_len - Out_pos, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                loop_mod(Loop_id, Sock, EPOLLIN | EPOLLOUT);
+                return;
+            }
+            export_down(strerror(errno));
+            return;
+        }
+        Out_pos += n;
+    }
+    return;
+}
+
+/* Event loop handler of the socket */
+static void export_event(int fd, uint32_t events, void *arg)
+{
+    char buf[64];
+    socklen_t len = sizeof(int);
+    int err = 0;
+    ssize_t n;
+
+    pthread_mutex_lock(&Lock);
+    if (State == EXP_CONNECTING) {
+        getsockopt(Sock, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            export_down(strerror(err));
+            pthread_mutex_unlock(&Lock);
+            return;
+        }
+        State = EXP_UP;
+        Retry_s = EXPORT_RETRY_S;
+        sched_set(Timer, 0);
+        gb_log(LOG_NOTICE, "Exporting the samples to %s.", Sink);
+        export_frame(true);
+    }
+
+    // The broker only sends the CONNACK, a TCP sink nothing: EOF or a refusal ends the connection
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        n = recv(Sock, buf, sizeof(buf), MSG_DONTWAIT);
+        if ((n == 0) || ((n < 0) && (errno != EAGAIN))) {
+            export_down(n ? strerror(errno) : "closed by the sink");
+            pthread_mutex_unlock(&Lock);
+            return;
+        }
+        if (Mqtt && (n >= 4) && (buf[0] == 0x20) && (buf[3] != 0)) {
+            gb_log(LOG_ERR, "MQTT broker %s refused the connection (code %d).", Sink, buf[3]);
+            export_down("refused");
+            pthread_mutex_unlock(&Lock);
+            return;
+        }
+    }
+    export_send();
+    pthread_mutex_unlock(&Lock);
+    return;
+}
+
+/* getaddrinfo() blocks for the DNS timeouts: it runs here and the timer connects with the answer */
+static void *export_resolve(void *arg)
+{
+    struct addrinfo hints, *ai;
+    int ret;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    ret = getaddrinfo(Host, Port, &hints, &ai);
+
+    pthread_mutex_lock(&Lock);
+    Addr_err = ret;
+    if (ret == 0) {
+        memcpy(&Addr, ai->ai_addr, ai->ai_addrlen);
+        Addr_len = ai->ai_addrlen;
+        freeaddrinfo(ai);
+    }
+    pthread_mutex_unlock(&Lock);
+
+    sched_set(Timer, sched_now());
+    return NULL;
+}
+
+/* The address is looked up again on each connection, the sink may have moved */
+static void export_resolve_start(void)
+{
+    pthread_t resolver;
+
+    State = EXP_RESOLVING;
+    if (pthread_create(&resolver, NULL, export_resolve, NULL) != 0) {
+        export_down("unable to start the resolver");
+        return;
+    }
+    pthread_setname_np(resolver, "gb_resolve");
+    pthread_detach(resolver);
+    return;
+}
+
+static void export_connect(void)
+{
+    int ret;
+
+    if (Addr_err != 0) {
+        export_down(gai_strerror(Addr_err));
+        return;
+    }
+    Sock = socket(Addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (Sock < 0) {
+        export_down(strerror(errno));
+        return;
+    }
+    ret = connect(Sock, (struct sockaddr *)&Addr, Addr_len);
+    if ((ret < 0) && (errno != EINPROGRESS)) {
+        export_down(strerror(errno));
+        return;
+    }
+
+    State = EXP_CONNECTING;
+    Stats.connects++;
+    if (Loop_id < 0)
+        Loop_id = loop_add("export", Sock, EPOLLOUT, export_event, NULL);
+    else
+        loop_mod(Loop_id, Sock, EPOLLOUT);
+    sched_set(Timer, sched_now() + EXPORT_CONNECT_S*1000LL*SCHED_MS);
+    return;
+}
+
+/* Timer of the reconnections, of the resolver answer and of the connection timeout */
+static long long export_tick(void *arg, long long now)
+{
+    pthread_mutex_lock(&Lock);
+    if (State == EXP_CONNECTING)
+        export_down("timeout");
+    else if (State == EXP_RESOLVING)
+        export_connect();
+    else if (State == EXP_DOWN)
+        export_resolve_start();
+    pthread_mutex_unlock(&Lock);
+    return 0; //Armed again by export_down(), export_connect() or the resolver
+}
+
+/***************** RECORDS *******************/
+
+/* Tag values escape the separators of the line protocol */
+static void export_tag(char *buf, size_t size, const char *s)
+{
+    size_t n = 0;
+
+    for (; *s && (n + 2 < size); s++) {
+        if ((*s == ',') || (*s == ' ') || (*s == '='))
+            buf[n++] = '\\';
+        buf[n++] = *s;
+    }
+    buf[n] = '\0';
+    return;
+}
+
+/***************** API *******************/
+
+/* Sink of -e: influx://host[:port] or mqtt://host[:port][/topic] */
+int export_init(const char *sink)
+{
+    const char *p;
+    char host[64];
+    int n = 0;
+
+    if (!strncmp(sink, "mqtt://", 7)) {
+        Mqtt = true;
+        p = sink + 7;
+        snprintf(Port, sizeof(Port), "1883");
+    } else if (!strncmp(sink, "influx://", 9)) {
+        p = sink + 9;
+        snprintf(Port, sizeof(Port), "8094");
+    } else {
+        gb_log(LOG_ERR, "Unknown export sink %s, expected influx://host:port or mqtt://host:port/topic.", sink);
+        return -1;
+    }
+    if (sscanf(p, "%63[^:/]%n", Host, &n) != 1) {
+        gb_log(LOG_ERR, "No host in the export sink %s.", sink);
+        return -1;
+    }
+    p += n;
+    if (*p == ':') {
+        n = 0;
+        sscanf(p + 1, "%7[0-9]%n", Port, &n);
+        p += n + 1;
+    }
+
+    if (gethostname(host, sizeof(host)) < 0)
+        snprintf(host, sizeof(host), "greenbubble");
+    host[sizeof(host) - 1] = '\0';
+    export_tag(Unit, sizeof(Unit), host);
+    if ((*p == '/') && p[1])
+        snprintf(Topic, sizeof(Topic), "%s", p + 1);
+    else
+        snprintf(Topic, sizeof(Topic), "greenbubble/%s", host);
+    snprintf(Sink, sizeof(Sink), "%s", sink);
+
+    if ((spool_open() == 0) && (Spool_size > 0))
+        gb_log(LOG_NOTICE, "%lld bytes of samples spooled for %s.", (long long)Spool_size, Sink);
+    Timer = sched_add("export", export_tick, NULL, sched_now(), 0);
+    return (Timer < 0) ? -1 : 0;
+}
+
+/* The records of a status sample, on the loop thread */
+void export_sample(gbSts_t *sts)
+{
+    char line[EXPORT_LINE], name[64];
+    long long ns;
+    int ld;
+
+    if (Timer < 0)
+        return;
+    ns = hal_clock_ns(CLOCK_REALTIME);
+
+    pthread_mutex_lock(&Lock);
+    snprintf(line, sizeof(line), "greenbubble,unit=%s temp_air=%di,temp_water=%di,temp_PS=%di,humidity_air=%ui,"
+            "rain=%s,fog=%s,pwc=%s,voltage_in=%ui %lld\n", Unit, sts->temp_air, sts->temp_water, sts->temp_PS,
+            sts->humidity_air, sts->rain ? "true" : "false", sts->fog ? "true" : "false", sts->pwc ? "true" : "false",
+            sts->ld_sts[0].vin, ns);
+    queue_push(line);
+    FOR_EACH_LED(ld) {
+        export_tag(name, sizeof(name), Gb_ch.chan[ld].name);
+        snprintf(line, sizeof(line), "greenbubble_led,unit=%s,led=%s voltage=%ui,current=%ui,intens=%ui %lld\n",
+                Unit, name, sts->ld_sts[ld].vout, sts->ld_sts[ld].cout, get_perc_from_curr(ld, sts->ld_sts[ld].cout), ns);
+        queue_push(line);
+    }
+    if (Out_pos == Out_len)
+        export_send(); //Else the socket is busy, the records go with the next batch
+    pthread_mutex_unlock(&Lock);
+    return;
+}
+
+/* Daemon stopping: what the sink did not take goes to the spool, for the next run */
+void export_stop(void)
+{
+    unsigned int i;
+
+    if (Timer < 0)
+        return;
+    pthread_mutex_lock(&Lock);
+    if (Batch_len > Batch_spool)
+        spool_write(Batch + Batch_spool, Batch_len - Batch_spool);
+    for (i = 0; i < Len; i++)
+        spool_write(Queue[(Head + i) % EXPORT_QUEUE], strlen(Queue[(Head + i) % EXPORT_QUEUE]));
+    Batch_len = Len = 0;
+    if (Sock >= 0) {
+        loop_del(Loop_id);
+        close(Sock);
+        Sock = -1;
+    }
+    pthread_mutex_unlock(&Lock);
+    return;
+}
+
+json_t *export_to_json(void)
+{
+    json_t *j;
+
+    pthread_mutex_lock(&Lock);
+    j = json_pack("{sssssisIsIsIsIsI}",
+            "sink", Sink,
+            "state", State_str[State],
+            "queued", Len,
+            "spooled", (json_int_t)(Spool_size - Spool_off),
+            "sent", (json_int_t)Stats.sent,
+            "batches", (json_int_t)Stats.batches,
+            "dropped", (json_int_t)Stats.dropped,
+            "connects", (json_int_t)Stats.connects);
+    pthread_mutex_unlock(&Lock);
+    return j;
+}
@@ -0,0 +1,45 @@
+/*
+ * gb_export.h:
+ *	Push of the samples to a time-series sink for the GreenBubble project
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef GB_EXPORT_H
+#define GB_EXPORT_H
+
+#include <jansson.h>
+#include <gb_main.h>
+
+/***************** DEFINES & ENUMS *******************/
+
+#define EXPORT_QUEUE      64                //Lines kept in memory, the oldest go to the spool beyond
+#define EXPORT_LINE       512               //Longest line protocol record
+#define EXPORT_BATCH      16384             //Bytes of a write (an MQTT publish), many lines when a backlog drains
+#define EXPORT_SPOOL      "./EXPORT.spool"  //Lines waiting for the sink, kept across restarts
+#define EXPORT_SPOOL_MAX  (4*1024*1024)     //New lines are dropped beyond
+#define EXPORT_CONNECT_S  10                //A connection not up by then is given up
+#define EXPORT_RETRY_S    5                 //Reconnect delay, doubled on each failure...
+#define EXPORT_RETRY_MAX  300               //...up to this
+
+/***************** FUNCTIONS *******************/
+int export_init(const char *sink);
+void export_sample(gbSts_t *sts);
+void export_stop(void);
+json_t *export_to_json(void);
+
+#endif //GB_EXPORT_H
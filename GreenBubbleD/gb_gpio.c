@@ -20,61 +20,55 @@
  */
 
 
-#include <syslog.h>
-#include <wiringPi.h>
-#include <ds18b20.h>
-#include <rht03.h>
 
 #include <gb_gpio.h>
+#include <gb_hal.h>
+#include <gb_log.h>
 
 static void gb_sensor_init(void)
 {
     int ret;
 
     /* We dont neet to use a pin, the kernel identify the sensor */
-    //TODO: Below add the correct serial Nb of each sensor
-    ret =  ds18b20Setup(DS18_01, "0000053af458"); //PS
-    ret |= ds18b20Setup(DS18_02, "0000053af458"); //water
-    ret |= ds18b20Setup(DS18_03, "0000053af458"); //needed?
+    //TODO: Below add the correct serial Nb of each sensor (W1=sysfs maps the ones not found by ID order)
+    ret =  hal_ds18b20_setup(DS18_01, "0000053af458"); //PS
+    ret |= hal_ds18b20_setup(DS18_02, "0000053af458"); //water
+    ret |= hal_ds18b20_setup(DS18_03, "0000053af458"); //needed?
 
-    if (ret)
-        syslog(LOG_ERR, "Could not initialize DS18B20 Sensors Node.");
+    if (ret < 0)
+        gb_log(LOG_ERR, "Could not initialize DS18B20 Sensors Node.");
 
     //DHT22 (same as RHT03)
-    ret =  rht03Setup(DHT22_01, BCM_26);
-    if (ret)
-        syslog(LOG_ERR, "Could not initialize DHT22 Sensor Node.");
+    ret =  hal_dht22_setup(DHT22_01, BCM_26);
+    if (ret < 0)
+        gb_log(LOG_ERR, "Could not initialize DHT22 Sensor Node.");
 
     return;
 }
 
-void gb_gpio_init(void)
+int gb_gpio_init(void)
 {
-    // Initialiye the WiringPi library
-    wiringPiSetupGpio();
+    // Initialize the hardware backend
+    if (hal_init() < 0)
+        return -1;
 
-    /* Set Pin Modes */
-    pinMode(BCM_16, OUTPUT); //PWC
-    pinMode(BCM_17, OUTPUT); //Fog
-    pinMode(BCM_18, INPUT);  //Rain
-    pinMode(BCM_22, OUTPUT); //Led CS0
-    pinMode(BCM_23, OUTPUT); //Led CS1
-    pinMode(BCM_25, INPUT);  //Temp
-    pinMode(BCM_26, INPUT);  //Humid+Temp
-
-    /* Set Pull Resistors for Input Pins */
-    pullUpDnControl(BCM_18, PUD_DOWN);
-    pullUpDnControl(BCM_25, PUD_OFF); //External Circuit has Pull Ups
-    pullUpDnControl(BCM_26, PUD_OFF); //External Circuit has Pull Ups
+    /* Set Pin Modes, with the Pull Resistors of Input Pins */
+    hal_gpio_mode(BCM_16, HAL_OUTPUT, HAL_PULL_OFF); //PWC
+    hal_gpio_mode(BCM_17, HAL_OUTPUT, HAL_PULL_OFF); //Fog
+    hal_gpio_mode(BCM_18, HAL_INPUT, HAL_PULL_DOWN); //Rain
+    hal_gpio_mode(BCM_22, HAL_OUTPUT, HAL_PULL_OFF); //Led CS0
+    hal_gpio_mode(BCM_23, HAL_OUTPUT, HAL_PULL_OFF); //Led CS1
+    hal_gpio_mode(BCM_25, HAL_INPUT, HAL_PULL_OFF);  //Temp, External Circuit has Pull Ups
+    hal_gpio_mode(BCM_26, HAL_INPUT, HAL_PULL_OFF);  //Humid+Temp, External Circuit has Pull Ups
 
     /* Set Initial Values of Outputs */
-    digitalWrite(BCM_16, LOW);
-    digitalWrite(BCM_17, LOW);
-    digitalWrite(BCM_22, LOW);
-    digitalWrite(BCM_23, LOW);
+    hal_gpio_write(BCM_16, HAL_LOW);
+    hal_gpio_write(BCM_17, HAL_LOW);
+    hal_gpio_write(BCM_22, HAL_LOW);
+    hal_gpio_write(BCM_23, HAL_LOW);
 
     /* Initialize temperature and humidity sensor nodes */
     gb_sensor_init();
 
-    return;
+    return 0;
 }
@@ -144,6 +144,6 @@ typedef enum {
 } DHT22_t;
 
 /* Functions */
-void gb_gpio_init(void);
+int gb_gpio_init(void);
 
 #endif //GB_GPIO_H
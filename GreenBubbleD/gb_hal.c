@@ -0,0 +1,111 @@
+/*
+ * gb_hal.c:
+ *	Hardware abstraction layer of the GreenBubble project
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include <gb_hal.h>
+#include <gb_log.h>
+
+// The compiled backend, a recording or a replay take its place
+#if defined(HAL_W1)
+extern halOps_t Hal_w1;
+const halOps_t *Hal = &Hal_w1;
+#elif defined(HAL_IIO)
+extern halOps_t Hal_iio;
+const halOps_t *Hal = &Hal_iio;
+#elif defined(HAL_GPIO_CHARDEV)
+extern halOps_t Hal_chardev;
+const halOps_t *Hal = &Hal_chardev;
+#elif defined(HAL_MOCK)
+extern const halOps_t Hal_mock;
+const halOps_t *Hal = &Hal_mock;
+#else
+extern const halOps_t Hal_wiringpi;
+const halOps_t *Hal = &Hal_wiringpi;
+#endif
+
+/* Clock of the backends that use the one of the system */
+long long hal_sys_clock_ns(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+long long hal_sys_clock_to_sys(long long ns)
+{
+    return ns;
+}
+
+/***************** STACKED BACKENDS *******************/
+
+int hal_stack_init(halOps_t *ops, const halOps_t *base)
+{
+    if (base->init() < 0)
+        return -1;
+
+#define HAL_STACK(fn) if (ops->fn == NULL) ops->fn = base->fn
+    HAL_STACK(gpio_mode);
+    HAL_STACK(gpio_write);
+    HAL_STACK(gpio_write_lines);
+    HAL_STACK(gpio_read);
+    HAL_STACK(gpio_watch);
+    HAL_STACK(gpio_event);
+    HAL_STACK(uart_open);
+    HAL_STACK(uart_close);
+    HAL_STACK(uart_flush);
+    HAL_STACK(uart_write);
+    HAL_STACK(uart_read);
+    HAL_STACK(ds18b20_setup);
+    HAL_STACK(dht22_setup);
+    HAL_STACK(sensor_read);
+#undef HAL_STACK
+    return 0;
+}
+
+/* For the threads of the sysfs backends, off the event loop */
+void hal_sleep_ms(long ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+    return;
+}
+
+/* Reading a sensor thread kept at mono_ns (0 for none yet), HAL_NO_READING once older than max_s */
+int hal_reading(int value, long long mono_ns, unsigned int max_s)
+{
+    if ((mono_ns == 0) || (hal_sys_clock_ns(CLOCK_MONOTONIC) - mono_ns > max_s*1000000000LL))
+        return HAL_NO_READING;
+    return value;
+}
+
+int hal_init(void)
+{
+    if (Hal->init() < 0) {
+        gb_log(LOG_CRIT, "Unable to initialize the %s hardware.", Hal->name);
+        return -1;
+    }
+    gb_log(LOG_NOTICE, "Hardware: %s.", Hal->name);
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * gb_hal.h:
+ *	Hardware abstraction layer of the GreenBubble project
+ *	UART, GPIO, temperature/humidity sensors and clock, behind one table of
+ *	functions. The backend is chosen at build time: wiringPi on the board,
+ *	or simulated devices in the process (make HAL=mock) to run on any Linux.
+ *	At run time the traffic can be recorded to a capture, or a capture replayed
+ *	instead of the hardware (gb_hal_rec.c).
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef GB_HAL_H
+#define GB_HAL_H
+
+#include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+
+/***************** DEFINES & ENUMS *******************/
+
+#define HAL_LOW  0
+#define HAL_HIGH 1
+#define HAL_NO_READING INT_MIN
+
+typedef enum {
+    HAL_INPUT = 0,
+    HAL_OUTPUT
+} halDir_t;
+
+typedef enum {
+    HAL_PULL_OFF = 0,
+    HAL_PULL_DOWN,
+    HAL_PULL_UP
+} halPull_t;
+
+/*
+ * A backend. Pins are BCM numbers. The UART is a file descriptor the serial code
+ * polls, reads and writes go through the backend (the mock answers them).
+ * gpio_write_lines sets n pins at once, bit i of values to pins[i]: the backends that can
+ * change them together do, so the pins never show a mix of the old and new values.
+ * gpio_watch gives an fd for the loop, readable when the pin changed (both edges, settled for
+ * debounce_us), or -1 without events. gpio_event takes the next change out of it with the
+ * CLOCK_MONOTONIC ns it happened at, -1 once there is none left.
+ * Sensors are nodes on a pin base (DS18_01, DHT22_01...), read in tenths: °C, or %
+ * on the second node of a DHT22. HAL_NO_READING when the sensor has none, or only an old one.
+ * clock_to_sys turns a CLOCK_REALTIME time of the backend into the system one, for
+ * the kernel timers: a replay runs its own clock.
+ */
+typedef struct {
+    const char *name;
+    int (*init)(void);
+    void (*gpio_mode)(int pin, halDir_t dir, halPull_t pull);
+    void (*gpio_write)(int pin, int value);
+    void (*gpio_write_lines)(const int *pins, unsigned int n, unsigned int values);
+    int (*gpio_read)(int pin);
+    int (*gpio_watch)(int pin, unsigned int debounce_us);
+    int (*gpio_event)(int fd, int *pin, int *value, long long *ns);
+    int (*uart_open)(const char *dev, int baud);
+    void (*uart_close)(int fd);
+    void (*uart_flush)(int fd);
+    int (*uart_write)(int fd, const char *s);
+    ssize_t (*uart_read)(int fd, void *buf, size_t len);
+    int (*ds18b20_setup)(int base, const char *serial);
+    int (*dht22_setup)(int base, int pin);
+    int (*sensor_read)(int node);
+    long long (*clock_ns)(clockid_t clk);
+    long long (*clock_to_sys)(long long ns);
+} halOps_t;
+
+extern const halOps_t *Hal;
+
+/*
+ * Backends stacked on another one (w1 on iio, iio on chardev, chardev on wiringPi or mock) only
+ * set what they do, plus name and clocks: hal_stack_init() runs the init of base and gives
+ * ops the other functions of base. The sysfs ones read a root (HAL_W1_ROOT, HAL_IIO_ROOT)
+ * that can be a fake tree with the same files, to test.
+ */
+int hal_stack_init(halOps_t *ops, const halOps_t *base);
+void hal_sleep_ms(long ms);
+int hal_reading(int value, long long mono_ns, unsigned int max_s);
+
+/***************** FUNCTIONS *******************/
+int hal_init(void);
+long long hal_sys_clock_ns(clockid_t clk);
+long long hal_sys_clock_to_sys(long long ns);
+
+static inline void hal_gpio_mode(int pin, halDir_t dir, halPull_t pull) { Hal->gpio_mode(pin, dir, pull); }
+static inline void hal_gpio_write(int pin, int value) { Hal->gpio_write(pin, value); }
+static inline void hal_gpio_write_lines(const int *pins, unsigned int n, unsigned int values) { Hal->gpio_write_lines(pins, n, values); }
+static inline int hal_gpio_read(int pin) { return Hal->gpio_read(pin); }
+static inline int hal_gpio_watch(int pin, unsigned int debounce_us) { return Hal->gpio_watch(pin, debounce_us); }
+static inline int hal_gpio_event(int fd, int *pin, int *value, long long *ns) { return Hal->gpio_event(fd, pin, value, ns); }
+static inline int hal_uart_open(const char *dev, int baud) { return Hal->uart_open(dev, baud); }
+static inline void hal_uart_close(int fd) { Hal->uart_close(fd); }
+static inline void hal_uart_flush(int fd) { Hal->uart_flush(fd); }
+static inline int hal_uart_write(int fd, const char *s) { return Hal->uart_write(fd, s); }
+static inline ssize_t hal_uart_read(int fd, void *buf, size_t len) { return Hal->uart_read(fd, buf, len); }
+static inline int hal_ds18b20_setup(int base, const char *serial) { return Hal->ds18b20_setup(base, serial); }
+static inline int hal_dht22_setup(int base, int pin) { return Hal->dht22_setup(base, pin); }
+static inline int hal_sensor_read(int node) { return Hal->sensor_read(node); }
+static inline long long hal_clock_ns(clockid_t clk) { return Hal->clock_ns(clk); }
+static inline long long hal_clock_to_sys(long long ns) { return Hal->clock_to_sys(ns); }
+
+#endif //GB_HAL_H
@@ -0,0 +1,347 @@
+/*
+ * gb_hal_chardev.c:
+ *	GPIOs through the Linux GPIO character device (uAPI v2), for the GreenBubble project
+ *	The pins set up together are the lines of one request on the chip, kept open:
+ *	a write of several lines is a single ioctl and the kernel changes them together,
+ *	which the chip select mux of the led drivers needs. A new mode is set on the
+ *	request, the lines are never released while the daemon runs. A watched input
+ *	gives its edges with the kernel debounce and timestamp. The UART and the
+ *	sensors stay on the backend compiled with it (wiringPi, or mock to run on a
+ *	gpio-sim chip).
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include <gb_hal.h>
+#include <gb_log.h>
+
+#ifndef HAL_GPIOCHIP
+#define HAL_GPIOCHIP "/dev/gpiochip0" //BCM lines of the Pi, line offset = BCM number
+#endif
+
+#ifdef HAL_MOCK
+extern const halOps_t Hal_mock;
+static const halOps_t *Base = &Hal_mock;
+#else
+extern const halOps_t Hal_wiringpi;
+static const halOps_t *Base = &Hal_wiringpi;
+#endif
+extern halOps_t Hal_chardev;
+
+static int Chip = -1;
+static int Reqs[GPIO_V2_LINES_MAX]; //Line requests, kept open: their fds stay valid for the loop
+static unsigned int Req_numb;
+static unsigned int Numb;
+static unsigned int Pending;    //Lines set up and not requested yet
+static struct {
+    int pin;
+    int req;                    //Index in Reqs, -1 until the line is requested
+    unsigned int bit;           //Index of the line in its request
+    halDir_t dir;
+    halPull_t pull;
+    bool watch;                 //Edge events, kernel debounced
+    unsigned int debounce_us;
+} Lines[GPIO_V2_LINES_MAX];
+static uint64_t Values;         //Last output values, bit i for Lines[i]
+
+/***************** LINES *******************/
+
+/* Index of the pin in Lines, -1 if it was not set up */
+static int chardev_line(int pin)
+{
+    unsigned int i;
+
+    for (i = 0; i < Numb; i++)
+        if (Lines[i].pin == pin)
+            return i;
+    return -1;
+}
+
+static uint64_t chardev_flags(unsigned int i)
+{
+    uint64_t flags;
+
+    if (Lines[i].dir == HAL_OUTPUT)
+        return GPIO_V2_LINE_FLAG_OUTPUT;
+    flags = GPIO_V2_LINE_FLAG_INPUT | ((Lines[i].pull == HAL_PULL_UP) ? GPIO_V2_LINE_FLAG_BIAS_PULL_UP :
+            (Lines[i].pull == HAL_PULL_DOWN) ? GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN : GPIO_V2_LINE_FLAG_BIAS_DISABLED);
+    if (Lines[i].watch)
+        flags |= GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    return flags;
+}
+
+/* Modes of the lines of request r, the outputs keep their last values */
+static void chardev_config(int r, struct gpio_v2_line_config *config)
+{
+    struct gpio_v2_line_config_attribute *attr;
+    uint64_t outputs = 0, values = 0, flags, m;
+    uint64_t cur = __atomic_load_n(&Values, __ATOMIC_RELAXED);
+    unsigned int i, a;
+
+    memset(config, 0, sizeof(*config));
+    config->flags = GPIO_V2_LINE_FLAG_INPUT;
+
+    // An attribute for each set of flags, then the debounce of the watched lines and the output values
+    for (i = 0; i < Numb; i++) {
+        if (Lines[i].req != r)
+            continue;
+        m = 1ULL << Lines[i].bit;
+        flags = chardev_flags(i);
+        for (a = 0; a < config->num_attrs; a++)
+            if (config->attrs[a].attr.flags == flags)
+                break;
+        if (a == config->num_attrs) {
+            config->attrs[a].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+            config->attrs[a].attr.flags = flags;
+            config->num_attrs++;
+        }
+        config->attrs[a].mask |= m;
+        if (Lines[i].dir == HAL_OUTPUT) {
+            outputs |= m;
+            if (cur & (1ULL << i))
+                values |= m;
+        }
+    }
+    for (i = 0; i < Numb; i++) {
+        if ((Lines[i].req != r) || !Lines[i].watch || !Lines[i].debounce_us)
+            continue;
+        for (a = 0; a < config->num_attrs; a++)
+            if ((config->attrs[a].attr.id == GPIO_V2_LINE_ATTR_ID_DEBOUNCE) &&
+                    (config->attrs[a].attr.debounce_period_us == Lines[i].debounce_us))
+                break;
+        if (a == config->num_attrs) {
+            config->attrs[a].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+            config->attrs[a].attr.debounce_period_us = Lines[i].debounce_us;
+            config->num_attrs++;
+        }
+        config->attrs[a].mask |= 1ULL << Lines[i].bit;
+    }
+    if (outputs) {
+        attr = &config->attrs[config->num_attrs++];
+        attr->attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+        attr->attr.values = values;
+        attr->mask = outputs;
+    }
+    return;
+}
+
+/*
+ * Request the lines set up since the last request, all together on one request, on their
+ * first use. The pins set up at init share a request and are written in one ioctl.
+ */
+static int chardev_flush(void)
+{
+    struct gpio_v2_line_request req;
+    unsigned int i, n = 0;
+
+    if (Pending == 0)
+        return 0;
+
+    memset(&req, 0, sizeof(req));
+    for (i = 0; i < Numb; i++) {
+        if (Lines[i].req >= 0)
+            continue;
+        Lines[i].req = Req_numb;
+        Lines[i].bit = n;
+        req.offsets[n++] = Lines[i].pin;
+    }
+    strncpy(req.consumer, "GreenBubbleD", sizeof(req.consumer) - 1);
+    req.num_lines = n;
+    chardev_config(Req_numb, &req.config);
+
+    if (ioctl(Chip, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+        gb_log(LOG_ERR, "Unable to request the GPIO lines of %s: %s", HAL_GPIOCHIP, strerror(errno));
+        for (i = 0; i < Numb; i++)
+            if (Lines[i].req == (int)Req_numb)
+                Lines[i].req = -1;
+        return -1;
+    }
+    fcntl(req.fd, F_SETFL, O_NONBLOCK); //The loop drains the edge events
+    Reqs[Req_numb++] = req.fd;
+    Pending = 0;
+    return 0;
+}
+
+/* New modes on the request of the lines: they are not released, so the outputs do not
+ * glitch and the fd of a watch stays valid */
+static int chardev_reconfig(int r)
+{
+    struct gpio_v2_line_config config;
+
+    chardev_config(r, &config);
+    if (ioctl(Reqs[r], GPIO_V2_LINE_SET_CONFIG_IOCTL, &config) < 0) {
+        gb_log(LOG_ERR, "Unable to set up the GPIO lines of %s: %s", HAL_GPIOCHIP, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Lines of the mask to bits, one ioctl for the lines of each request */
+static void chardev_set(uint64_t mask, uint64_t bits)
+{
+    struct gpio_v2_line_values v;
+    uint64_t left = mask, done;
+    unsigned int i, j;
+
+    if (!mask || (chardev_flush() < 0))
+        return;
+    for (i = 0; left; i++) {
+        if (!(left & (1ULL << i)))
+            continue;
+        v.mask = v.bits = done = 0;
+        for (j = i; j < Numb; j++) {
+            if (!(left & (1ULL << j)) || (Lines[j].req != Lines[i].req))
+                continue;
+            done |= 1ULL << j;
+            v.mask |= 1ULL << Lines[j].bit;
+            if (bits & (1ULL << j))
+                v.bits |= 1ULL << Lines[j].bit;
+        }
+        left &= ~done;
+        if (ioctl(Reqs[Lines[i].req], GPIO_V2_LINE_SET_VALUES_IOCTL, &v) < 0) {
+            gb_log(LOG_ERR, "Unable to set the GPIO lines: %s", strerror(errno));
+            continue;
+        }
+        __atomic_and_fetch(&Values, ~done, __ATOMIC_RELAXED);
+        __atomic_or_fetch(&Values, bits & done, __ATOMIC_RELAXED);
+    }
+    return;
+}
+
+/***************** GPIO *******************/
+
+static int chardev_init(void)
+{
+    struct gpiochip_info info;
+
+    Chip = open(HAL_GPIOCHIP, O_RDWR | O_CLOEXEC);
+    if (Chip < 0) {
+        gb_log(LOG_CRIT, "Unable to open %s: %s", HAL_GPIOCHIP, strerror(errno));
+        return -1;
+    }
+    if (ioctl(Chip, GPIO_GET_CHIPINFO_IOCTL, &info) == 0)
+        gb_log(LOG_NOTICE, "GPIOs on %s (%s, %u lines), the rest on %s.", HAL_GPIOCHIP, info.label, info.lines, Base->name);
+    return hal_stack_init(&Hal_chardev, Base);
+}
+
+static void chardev_gpio_mode(int pin, halDir_t dir, halPull_t pull)
+{
+    int i = chardev_line(pin);
+
+    if (i < 0) {
+        if (Numb == GPIO_V2_LINES_MAX)
+            return;
+        i = Numb++;
+        Lines[i].pin = pin;
+        Lines[i].req = -1;
+        Pending++;
+    }
+    Lines[i].dir = dir;
+    Lines[i].pull = pull;
+    if (Lines[i].req >= 0)
+        chardev_reconfig(Lines[i].req);
+    return;
+}
+
+static void chardev_gpio_write(int pin, int value)
+{
+    int i = chardev_line(pin);
+
+    if (i >= 0)
+        chardev_set(1ULL << i, value ? 1ULL << i : 0);
+    return;
+}
+
+static void chardev_gpio_write_lines(const int *pins, unsigned int n, unsigned int values)
+{
+    uint64_t mask = 0, bits = 0;
+    unsigned int k;
+    int i;
+
+    for (k = 0; k < n; k++) {
+        i = chardev_line(pins[k]);
+        if (i < 0)
+            continue;
+        mask |= 1ULL << i;
+        if ((values >> k) & 1)
+            bits |= 1ULL << i;
+    }
+    chardev_set(mask, bits);
+    return;
+}
+
+static int chardev_gpio_read(int pin)
+{
+    struct gpio_v2_line_values v = { .bits = 0, .mask = 0 };
+    int i = chardev_line(pin);
+
+    if ((i < 0) || (chardev_flush() < 0))
+        return HAL_LOW;
+    v.mask = 1ULL << Lines[i].bit;
+    if (ioctl(Reqs[Lines[i].req], GPIO_V2_LINE_GET_VALUES_IOCTL, &v) < 0)
+        return HAL_LOW;
+    return (v.bits & v.mask) ? HAL_HIGH : HAL_LOW;
+}
+
+/* Edge events come on the fd of the request of the line, valid while the daemon runs */
+static int chardev_gpio_watch(int pin, unsigned int debounce_us)
+{
+    int i = chardev_line(pin);
+
+    if ((i < 0) || (Lines[i].dir != HAL_INPUT))
+        return -1;
+    Lines[i].watch = true;
+    Lines[i].debounce_us = debounce_us;
+    if (((Lines[i].req < 0) ? chardev_flush() : chardev_reconfig(Lines[i].req)) < 0)
+        return -1;
+    return Reqs[Lines[i].req];
+}
+
+static int chardev_gpio_event(int fd, int *pin, int *value, long long *ns)
+{
+    struct gpio_v2_line_event ev;
+
+    if (read(fd, &ev, sizeof(ev)) != sizeof(ev))
+        return -1;
+    *pin = ev.offset;
+    *value = (ev.id == GPIO_V2_LINE_EVENT_RISING_EDGE) ? HAL_HIGH : HAL_LOW;
+    *ns = ev.timestamp_ns; //CLOCK_MONOTONIC, taken by the kernel on the edge
+    return 0;
+}
+
+//The UART and the sensors come from Base at init
+halOps_t Hal_chardev = {
+    .name = "GPIO chardev",
+    .init = chardev_init,
+    .gpio_mode = chardev_gpio_mode,
+    .gpio_write = chardev_gpio_write,
+    .gpio_write_lines = chardev_gpio_write_lines,
+    .gpio_read = chardev_gpio_read,
+    .gpio_watch = chardev_gpio_watch,
+    .gpio_event = chardev_gpio_event,
+    .clock_ns = hal_sys_clock_ns,
+    .clock_to_sys = hal_sys_clock_to_sys
+};
@@ -0,0 +1,229 @@
+/*
+ * gb_hal_iio.c:
+ *	DHT22 through the kernel dht11 IIO driver, for the GreenBubble project
+ *	The kernel times the DHT22 protocol (dtoverlay=dht11,gpiopin=26) and gives the
+ *	temperature and the humidity as IIO channels under HAL_IIO_ROOT. A thread reads
+ *	them, retries a failed read after the interval the sensor needs and keeps the
+ *	last good values for sensor_read(), which never waits on the sensor. The GPIOs,
+ *	the UART and the DS18B20 stay on the backend compiled with it.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <gb_hal.h>
+#include <gb_log.h>
+
+#ifndef HAL_IIO_ROOT
+#define HAL_IIO_ROOT "/sys/bus/iio/devices"
+#endif
+
+#define IIO_PERIOD_S   10     //A reading this often
+#define IIO_RETRY_MS   2100   //The sensor answers again after 2 s
+#define IIO_RETRIES    3      //Retries of a failed reading before waiting for the next period
+#define IIO_KEEP_S     60     //A reading is no reading once this old
+
+#if defined(HAL_GPIO_CHARDEV)
+extern halOps_t Hal_chardev;
+static const halOps_t *Base = &Hal_chardev;
+#elif defined(HAL_MOCK)
+extern const halOps_t Hal_mock;
+static const halOps_t *Base = &Hal_mock;
+#else
+extern const halOps_t Hal_wiringpi;
+static const halOps_t *Base = &Hal_wiringpi;
+#endif
+extern halOps_t Hal_iio;
+
+// The channels of the device, node = base + index
+static const char *Chans[] = { "in_temp_input", "in_humidityrelative_input" };
+#define CHANS_NUMB (sizeof(Chans)/sizeof(Chans[0]))
+
+static char Dev[64];                //iio:deviceN, empty if none
+static int Node = -1;               //Node base of the DHT22, -1 before the setup
+static int Values[CHANS_NUMB];      //Last good reading in tenths of °C or %
+static long long Time;              //CLOCK_MONOTONIC ns of it, 0 for none
+static struct {                    //Only the reader thread counts
+    unsigned int reads;             //Readings tried, retries included
+    unsigned int failures;          //Readings the driver failed (checksum, timeout)
+    unsigned int retries;
+    unsigned int missed;            //Periods without a good reading after all the retries
+} Stats;
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t Reader;
+
+/***************** SYSFS *******************/
+
+/* Integer of an attribute of the device, -1 with errno set if the driver failed */
+static int iio_read(const char *dev, const char *file, long *value)
+{
+    char path[256], buf[32];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", HAL_IIO_ROOT, dev, file);
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        if (n == 0)
+            errno = ENODATA;
+        return -1;
+    }
+    buf[n] = '\0';
+    *value = strtol(buf, NULL, 10);
+    return 0;
+}
+
+/* First device with the channels of a DHT22 */
+static void iio_discover(void)
+{
+    struct dirent *e;
+    DIR *dir;
+
+    dir = opendir(HAL_IIO_ROOT);
+    if (!dir) {
+        gb_log(LOG_ERR, "Unable to open %s: %s", HAL_IIO_ROOT, strerror(errno));
+        return;
+    }
+    while ((e = readdir(dir)) != NULL) {
+        char path[512];
+
+        if (strncmp(e->d_name, "iio:device", 10))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/%s", HAL_IIO_ROOT, e->d_name, Chans[1]);
+        if (access(path, R_OK) == 0) {
+            snprintf(Dev, sizeof(Dev), "%.63s", e->d_name);
+            break;
+        }
+    }
+    closedir(dir);
+    return;
+}
+
+/***************** READER *******************/
+
+/* Both channels of one measurement, 0 if they were read */
+static int iio_measure(void)
+{
+    long value[CHANS_NUMB];
+    unsigned int c;
+
+    for (c = 0; c < CHANS_NUMB; c++) {
+        Stats.reads++;
+        if (iio_read(Dev, Chans[c], &value[c]) < 0) {
+            Stats.failures++;
+            gb_log(LOG_DEBUG, "DHT22 %s failed: %s\n", Chans[c], strerror(errno));
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&Lock);
+    for (c = 0; c < CHANS_NUMB; c++)
+        Values[c] = value[c] / 100; //m°C and m%
+    Time = hal_sys_clock_ns(CLOCK_MONOTONIC);
+    pthread_mutex_unlock(&Lock);
+    return 0;
+}
+
+/* The driver bit-bangs in the kernel and fails now and then: retried here, off the event loop */
+static void *iio_reader(void *arg)
+{
+    unsigned int tries, missed = 0;
+    int ret;
+
+    while (1) {
+        ret = iio_measure();
+        for (tries = 0; (ret < 0) && (tries < IIO_RETRIES); tries++) {
+            Stats.retries++;
+            hal_sleep_ms(IIO_RETRY_MS);
+            ret = iio_measure();
+        }
+        if (ret < 0) {
+            Stats.missed++;
+            if (missed++ == 0)
+                gb_log(LOG_WARNING, "No reading from the DHT22 after %u retries, the last one is kept up to %u s (%u failures, %u retries in %u reads).",
+                        IIO_RETRIES, IIO_KEEP_S, Stats.failures, Stats.retries, Stats.reads);
+        } else if (missed) {
+            gb_log(LOG_NOTICE, "DHT22 read again after %u missed periods (%u missed since start).", missed, Stats.missed);
+            missed = 0;
+        }
+        hal_sleep_ms(IIO_PERIOD_S*1000L);
+    }
+    return NULL;
+}
+
+/***************** SENSORS *******************/
+
+static int iio_init(void)
+{
+    iio_discover();
+    if (Dev[0] == '\0') {
+        gb_log(LOG_ERR, "No DHT22 under %s (dtoverlay=dht11 missing?), the rest on %s.", HAL_IIO_ROOT, Base->name);
+        return hal_stack_init(&Hal_iio, Base);
+    }
+    gb_log(LOG_NOTICE, "DHT22 on %s of %s, the rest on %s.", Dev, HAL_IIO_ROOT, Base->name);
+    if (pthread_create(&Reader, NULL, iio_reader, NULL) != 0) {
+        gb_log(LOG_CRIT, "Unable to start the DHT22 reader.");
+        return -1;
+    }
+    pthread_setname_np(Reader, "gb_iio");
+    pthread_detach(Reader);
+    return hal_stack_init(&Hal_iio, Base);
+}
+
+/* The kernel has the pin from the device tree */
+static int iio_dht22_setup(int base, int pin)
+{
+    if (Dev[0] == '\0')
+        return -1;
+    Node = base;
+    return 0;
+}
+
+/* Last good reading, HAL_NO_READING before the first one or once older than IIO_KEEP_S */
+static int iio_sensor_read(int node)
+{
+    int value;
+
+    if ((Node < 0) || (node < Node) || (node >= Node + (int)CHANS_NUMB))
+        return Base->sensor_read(node);
+    pthread_mutex_lock(&Lock);
+    value = hal_reading(Values[node - Node], Time, IIO_KEEP_S);
+    pthread_mutex_unlock(&Lock);
+    return value;
+}
+
+//The GPIOs, the UART and the DS18B20 come from Base at init
+halOps_t Hal_iio = {
+    .name = "dht11 IIO",
+    .init = iio_init,
+    .dht22_setup = iio_dht22_setup,
+    .sensor_read = iio_sensor_read,
+    .clock_ns = hal_sys_clock_ns,
+    .clock_to_sys = hal_sys_clock_to_sys
+};
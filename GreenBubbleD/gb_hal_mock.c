@@ -0,0 +1,281 @@
+/*
+ * gb_hal_mock.c:
+ *	Mock backend of the hardware abstraction layer, simulated devices in the process
+ *	The GPIOs are kept in memory. The UART is one end of a socketpair: a command
+ *	written is run by the simulated led driver the chip select mux points to, and its
+ *	reply is written on the other end, so the serial code (poll, read, parsing) runs
+ *	as on the board, minus the wire. There is a driver on each address of the
+ *	registry and it answers SYSTEM as the one the registry expects.
+ *	The sensors give steady readings, a watched input toggles every MOCK_EDGE_S.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include <gb_hal.h>
+#include <gb_main.h>
+#include <gb_gpio.h>
+
+#define MOCK_PINS 28
+#define MOCK_DRIVERS 4  //Addresses of the chip select mux
+#define MOCK_VIN 36000  //mV - power supply of the drivers
+#define MOCK_EDGE_S 60  //A watched input (rain) changes this often
+
+static int Pins[MOCK_PINS];
+static int Peer = -1; //Driver side of the UART
+static int Watched = -1;
+
+/* Simulated led driver */
+static struct {
+    bool output;
+    unsigned int vset;  //mV
+    unsigned int cset;  //mA
+} Drivers[MOCK_DRIVERS];
+
+static const struct {
+    int node;
+    int value;
+} Sensors[] = {
+    { DS18_01, 350 },       //PS
+    { DS18_02, 245 },       //Water
+    { DS18_03, 240 },
+    { DHT22_01, 225 },      //Air
+    { DHT22_01 + 1, 600 }   //Humidity
+};
+#define SENSORS_NUMB (sizeof(Sensors)/sizeof(Sensors[0]))
+
+/***************** GPIO *******************/
+
+static int mock_init(void)
+{
+    return 0;
+}
+
+static void mock_gpio_mode(int pin, halDir_t dir, halPull_t pull)
+{
+    if ((pin >= 0) && (pin < MOCK_PINS) && (dir == HAL_INPUT))
+        Pins[pin] = (pull == HAL_PULL_UP) ? HAL_HIGH : HAL_LOW;
+    return;
+}
+
+static void mock_gpio_write(int pin, int value)
+{
+    if ((pin >= 0) && (pin < MOCK_PINS))
+        Pins[pin] = value ? HAL_HIGH : HAL_LOW;
+    return;
+}
+
+static void mock_gpio_write_lines(const int *pins, unsigned int n, unsigned int values)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        mock_gpio_write(pins[i], (values >> i) & 1);
+    return;
+}
+
+static int mock_gpio_read(int pin)
+{
+    return ((pin >= 0) && (pin < MOCK_PINS)) ? Pins[pin] : HAL_LOW;
+}
+
+/* A timer stands for the edges of the pin */
+static int mock_gpio_watch(int pin, unsigned int debounce_us)
+{
+    struct itimerspec its = { .it_interval = { MOCK_EDGE_S, 0 }, .it_value = { MOCK_EDGE_S, 0 } };
+    int fd;
+
+    if ((pin < 0) || (pin >= MOCK_PINS) || (Watched >= 0))
+        return -1;
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if ((fd < 0) || (timerfd_settime(fd, 0, &its, NULL) < 0))
+        return -1;
+    Watched = pin;
+    return fd;
+}
+
+static int mock_gpio_event(int fd, int *pin, int *value, long long *ns)
+{
+    uint64_t n;
+
+    if (read(fd, &n, sizeof(n)) != sizeof(n))
+        return -1;
+    if (n & 1)
+        Pins[Watched] = !Pins[Watched];
+    *pin = Watched;
+    *value = Pins[Watched];
+    *ns = hal_sys_clock_ns(CLOCK_MONOTONIC);
+    return 0;
+}
+
+/***************** SENSORS *******************/
+
+static int mock_ds18b20_setup(int base, const char *serial)
+{
+    return 0;
+}
+
+static int mock_dht22_setup(int base, int pin)
+{
+    return 0;
+}
+
+static int mock_sensor_read(int node)
+{
+    unsigned int i;
+
+    for (i = 0; i < SENSORS_NUMB; i++)
+        if (Sensors[i].node == node)
+            return Sensors[i].value;
+    return HAL_NO_READING;
+}
+
+/***************** LED DRIVERS *******************/
+
+/* Expected driver at a mux address, NULL if the registry has none there */
+static const ldChan_t *mock_driver_chan(unsigned int cs)
+{
+    unsigned int i;
+
+    for (i = 0; i < Gb_ch.numb; i++)
+        if (Gb_ch.chan[i].cs == cs)
+            return &Gb_ch.chan[i];
+    return NULL;
+}
+
+/* Run a command on the driver at cs, same replies as the firmware. Returns the reply length. */
+static int mock_driver_run(unsigned int cs, const char *cmd, char *reply, size_t len)
+{
+    const ldChan_t *chan = mock_driver_chan(cs);
+    float f;
+    int i;
+
+    if (chan == NULL)
+        return 0; //Nobody there, the command times out
+
+    if (strncmp(cmd, "SYSTEM", 6) == 0)
+        return snprintf(reply, len, "M: %s\r\nV: 1.2\r\nN: %s\r\nO: OFF\r\nAC: ON\r\nOK\n", chan->model, chan->driver);
+
+    if (strncmp(cmd, "CONFIG", 6) == 0)
+        return snprintf(reply, len, "OUTPUT: %s\r\nVSET: %.2f\r\nCSET: %.2f\r\nOK\n", Drivers[cs].output ? "ON" : "OFF",
+                Drivers[cs].vset/1000.0, Drivers[cs].cset/1000.0);
+
+    if (strncmp(cmd, "STATUS", 6) == 0) {
+        unsigned int vout = Drivers[cs].output ? Drivers[cs].vset : 0;
+        unsigned int cout = Drivers[cs].output ? Drivers[cs].cset : 0;
+
+        return snprintf(reply, len, "OUTPUT: %s\r\nVIN: %.2f %u\r\nVOUT: %.2f %u\r\nCOUT: %.2f %u\r\nCONSTANT: CURRENT\r\nOK\n",
+                Drivers[cs].output ? "ON" : "OFF", MOCK_VIN/1000.0, MOCK_VIN/10, vout/1000.0, vout/10, cout/1000.0, cout);
+    }
+
+    if (sscanf(cmd, "VOLTAGE %f", &f) == 1)
+        Drivers[cs].vset = (unsigned int)(f*1000 + 0.5);
+    else if (sscanf(cmd, "CURRENT %f", &f) == 1)
+        Drivers[cs].cset = (unsigned int)(f*1000 + 0.5);
+    else if (sscanf(cmd, "OUTPUT %d", &i) == 1)
+        Drivers[cs].output = (i != 0);
+    else
+        return snprintf(reply, len, "E!\n");
+
+    return snprintf(reply, len, "OK\n");
+}
+
+/***************** UART *******************/
+
+static int mock_uart_open(const char *dev, int baud)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    Peer = sv[1];
+    return sv[0];
+}
+
+static void mock_uart_close(int fd)
+{
+    close(fd);
+    close(Peer);
+    Peer = -1;
+    return;
+}
+
+static void mock_uart_flush(int fd)
+{
+    char buf[64];
+
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+    return;
+}
+
+/* Pins of the mux, on a gpio-sim chip when the GPIOs go through the character device */
+static int mock_mux_pin(int pin)
+{
+#ifdef HAL_GPIO_CHARDEV
+    extern halOps_t Hal_chardev;
+
+    return Hal_chardev.gpio_read(pin);
+#else
+    return Pins[pin];
+#endif
+}
+
+/* The mux address is BCM_22 (bit 1) and BCM_23 (bit 0), as on the board */
+static int mock_uart_write(int fd, const char *s)
+{
+    char reply[256];
+    int len;
+
+    len = mock_driver_run((mock_mux_pin(BCM_22) << 1) | mock_mux_pin(BCM_23), s, reply, sizeof(reply));
+    if ((len > 0) && (write(Peer, reply, len) != len))
+        return -1;
+    return 0;
+}
+
+static ssize_t mock_uart_read(int fd, void *buf, size_t len)
+{
+    return read(fd, buf, len);
+}
+
+const halOps_t Hal_mock = {
+    .name = "mock",
+    .init = mock_init,
+    .gpio_mode = mock_gpio_mode,
+    .gpio_write = mock_gpio_write,
+    .gpio_write_lines = mock_gpio_write_lines,
+    .gpio_read = mock_gpio_read,
+    .gpio_watch = mock_gpio_watch,
+    .gpio_event = mock_gpio_event,
+    .uart_open = mock_uart_open,
+    .uart_close = mock_uart_close,
+    .uart_flush = mock_uart_flush,
+    .uart_write = mock_uart_write,
+    .uart_read = mock_uart_read,
+    .ds18b20_setup = mock_ds18b20_setup,
+    .dht22_setup = mock_dht22_setup,
+    .sensor_read = mock_sensor_read,
+    .clock_ns = hal_sys_clock_ns,
+    .clock_to_sys = hal_sys_clock_to_sys
+};
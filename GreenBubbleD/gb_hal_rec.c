@@ -0,0 +1,623 @@
+/*
+ * gb_hal_rec.c:
+ *	Record and replay of the hardware traffic of the GreenBubble project
+ *	Recording sits on top of the backend of the build: each serial transaction
+ *	(mux address, command, reply and how long the reply took), sensor reading and
+ *	pin read is written to a binary capture. A replay takes the place of the
+ *	hardware and answers from a capture, on a clock that runs speed times faster
+ *	from the start of the capture: the routine, the sampling and the history see
+ *	the days of the capture go by in minutes.
+ *	A command gets the reply of the last same command (first word) to the same
+ *	driver at or before the replay time, a sensor or a pin its last reading.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <gb_hal.h>
+#include <gb_hal_rec.h>
+#include <gb_gpio.h>
+#include <gb_log.h>
+
+#define REC_CMD_MAX   64
+#define REC_REPLY_MAX 512
+#define REP_KEYS      64 //Commands per driver, sensors and pins of a capture
+#define REP_VERB      8
+
+static const halOps_t *Base;   //Backend being recorded
+static FILE *Rec_file;
+static long long Rec_mono0;
+static unsigned int Rec_cs;    //Mux address, from the pins written
+static pthread_mutex_t Rec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Serial transaction being recorded. The serial code runs one at a time (bus lock).
+static struct {
+    bool open;
+    unsigned int cs;
+    char cmd[REC_CMD_MAX];
+    size_t cmd_len;
+    char reply[REC_REPLY_MAX];
+    size_t reply_len;
+    long long t0;       //ns, command written
+    long long t_last;   //ns, last byte of the reply
+} Tx;
+
+/* Replies and readings of the capture, in time order, for one command of a driver, sensor or pin */
+typedef struct {
+    uint8_t type;
+    uint16_t id;
+    char verb[REP_VERB];
+    const recEntry_t **e;
+    unsigned int n;
+    unsigned int cur;
+} repKey_t;
+
+static char *Rep_data;
+static recHdr_t Rep_hdr;
+static repKey_t Rep_keys[REP_KEYS];
+static unsigned int Rep_keys_numb;
+static unsigned int Rep_speed;
+static long long Rep_real0, Rep_mono0; //System clocks at the start of the replay
+static uint32_t Rep_end_ms;
+static unsigned int Rep_cs;
+static int Rep_peer = -1;
+static pthread_mutex_t Rep_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/***************** RECORD *******************/
+
+static long long rec_now(void)
+{
+    return Base->clock_ns(CLOCK_MONOTONIC);
+}
+
+/* Any error stops the recording, the daemon goes on */
+static void rec_write(uint8_t type, uint16_t id, int32_t value, const char *cmd, size_t cmd_len,
+        const char *reply, size_t reply_len, long long t)
+{
+    static const char zeros[4];
+    size_t pad = REC_PAD(cmd_len + reply_len) - (cmd_len + reply_len);
+    recEntry_t e;
+
+    memset(&e, 0, sizeof(e));
+    e.t_ms = (t - Rec_mono0) / 1000000;
+    e.value = value;
+    e.id = id;
+    e.reply_len = reply_len;
+    e.type = type;
+    e.cmd_len = cmd_len;
+
+    pthread_mutex_lock(&Rec_lock);
+    if ((Rec_file != NULL) && ((fwrite(&e, sizeof(e), 1, Rec_file) != 1) ||
+                (fwrite(cmd, 1, cmd_len, Rec_file) != cmd_len) || (fwrite(reply, 1, reply_len, Rec_file) != reply_len) ||
+                (fwrite(zeros, 1, pad, Rec_file) != pad))) {
+        gb_log(LOG_ERR, "Unable to write the capture, recording stopped: %s", strerror(errno));
+        fclose(Rec_file);
+        Rec_file = NULL;
+    }
+    pthread_mutex_unlock(&Rec_lock);
+    return;
+}
+
+/* The reply is complete once the serial code flushes or sends the next command */
+static void rec_tx_end(void)
+{
+    if (!Tx.open)
+        return;
+    Tx.open = false;
+    rec_write(REC_SERIAL, Tx.cs, Tx.reply_len ? (int32_t)((Tx.t_last - Tx.t0) / 1000) : -1,
+            Tx.cmd, Tx.cmd_len, Tx.reply, Tx.reply_len, Tx.t0);
+    return;
+}
+
+static int rec_init(void)
+{
+    return Base->init();
+}
+
+static void rec_gpio_mode(int pin, halDir_t dir, halPull_t pull)
+{
+    Base->gpio_mode(pin, dir, pull);
+    return;
+}
+
+/* Mux address after a write of the pin */
+static unsigned int rec_mux(unsigned int cs, int pin, int value)
+{
+    if (pin == BCM_22)
+        return (cs & 1) | (value ? 2 : 0);
+    if (pin == BCM_23)
+        return (cs & 2) | (value ? 1 : 0);
+    return cs;
+}
+
+static void rec_gpio_write(int pin, int value)
+{
+    Rec_cs = rec_mux(Rec_cs, pin, value);
+    Base->gpio_write(pin, value);
+    return;
+}
+
+static void rec_gpio_write_lines(const int *pins, unsigned int n, unsigned int values)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        Rec_cs = rec_mux(Rec_cs, pins[i], (values >> i) & 1);
+    Base->gpio_write_lines(pins, n, values);
+    return;
+}
+
+static int rec_gpio_read(int pin)
+{
+    int value = Base->gpio_read(pin);
+
+    rec_write(REC_GPIO, pin, value, NULL, 0, NULL, 0, rec_now());
+    return value;
+}
+
+static int rec_gpio_watch(int pin, unsigned int debounce_us)
+{
+    return Base->gpio_watch(pin, debounce_us);
+}
+
+/* An edge is kept as a read of the pin, at the time it is taken */
+static int rec_gpio_event(int fd, int *pin, int *value, long long *ns)
+{
+    if (Base->gpio_event(fd, pin, value, ns) < 0)
+        return -1;
+    rec_write(REC_GPIO, *pin, *value, NULL, 0, NULL, 0, rec_now());
+    return 0;
+}
+
+static int rec_uart_open(const char *dev, int baud)
+{
+    return Base->uart_open(dev, baud);
+}
+
+static void rec_uart_close(int fd)
+{
+    rec_tx_end();
+    Base->uart_close(fd);
+    return;
+}
+
+static void rec_uart_flush(int fd)
+{
+    rec_tx_end();
+    Base->uart_flush(fd);
+    return;
+}
+
+static int rec_uart_write(int fd, const char *s)
+{
+    rec_tx_end();
+    Tx.open = true;
+    Tx.cs = Rec_cs;
+    Tx.cmd_len = strnlen(s, sizeof(Tx.cmd));
+    memcpy(Tx.cmd, s, Tx.cmd_len);
+    Tx.reply_len = 0;
+    Tx.t0 = rec_now();
+    return Base->uart_write(fd, s);
+}
+
+static ssize_t rec_uart_read(int fd, void *buf, size_t len)
+{
+    ssize_t n = Base->uart_read(fd, buf, len);
+    size_t keep;
+
+    if ((n > 0) && Tx.open) {
+        keep = ((size_t)n < sizeof(Tx.reply) - Tx.reply_len) ? (size_t)n : sizeof(Tx.reply) - Tx.reply_len;
+        memcpy(Tx.reply + Tx.reply_len, buf, keep);
+        Tx.reply_len += keep;
+        Tx.t_last = rec_now();
+    }
+    return n;
+}
+
+static int rec_ds18b20_setup(int base, const char *serial)
+{
+    return Base->ds18b20_setup(base, serial);
+}
+
+static int rec_dht22_setup(int base, int pin)
+{
+    return Base->dht22_setup(base, pin);
+}
+
+static int rec_sensor_read(int node)
+{
+    int value = Base->sensor_read(node);
+
+    rec_write(REC_SENSOR, node, value, NULL, 0, NULL, 0, rec_now());
+    return value;
+}
+
+static long long rec_clock_ns(clockid_t clk)
+{
+    return Base->clock_ns(clk);
+}
+
+static long long rec_clock_to_sys(long long ns)
+{
+    return Base->clock_to_sys(ns);
+}
+
+static const halOps_t Hal_record = {
+    .name = "recording",
+    .init = rec_init,
+    .gpio_mode = rec_gpio_mode,
+    .gpio_write = rec_gpio_write,
+    .gpio_write_lines = rec_gpio_write_lines,
+    .gpio_read = rec_gpio_read,
+    .gpio_watch = rec_gpio_watch,
+    .gpio_event = rec_gpio_event,
+    .uart_open = rec_uart_open,
+    .uart_close = rec_uart_close,
+    .uart_flush = rec_uart_flush,
+    .uart_write = rec_uart_write,
+    .uart_read = rec_uart_read,
+    .ds18b20_setup = rec_ds18b20_setup,
+    .dht22_setup = rec_dht22_setup,
+    .sensor_read = rec_sensor_read,
+    .clock_ns = rec_clock_ns,
+    .clock_to_sys = rec_clock_to_sys
+};
+
+/* Record the traffic of the backend into path. Must be called before hal_init(). */
+int hal_record_start(const char *path)
+{
+    recHdr_t hdr;
+
+    Rec_file = fopen(path, "wbe");
+    if (Rec_file == NULL) {
+        gb_log(LOG_ERR, "Unable to create the capture %s: %s", path, strerror(errno));
+        return -1;
+    }
+    setvbuf(Rec_file, NULL, _IOFBF, 65536);
+
+    Base = Hal;
+    Rec_mono0 = Base->clock_ns(CLOCK_MONOTONIC);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = REC_MAGIC;
+    hdr.version = REC_VERSION;
+    hdr.real_ns = Base->clock_ns(CLOCK_REALTIME);
+    hdr.mono_ns = Rec_mono0;
+    if (fwrite(&hdr, sizeof(hdr), 1, Rec_file) != 1) {
+        fclose(Rec_file);
+        Rec_file = NULL;
+        return -1;
+    }
+
+    Hal = &Hal_record;
+    gb_log(LOG_NOTICE, "Recording the %s hardware into %s.", Base->name, path);
+    return 0;
+}
+
+/* Daemon stopping: the capture is only complete once closed */
+void hal_record_stop(void)
+{
+    if (Hal != &Hal_record)
+        return;
+
+    rec_tx_end();
+    pthread_mutex_lock(&Rec_lock);
+    if ((Rec_file != NULL) && (fclose(Rec_file) != 0))
+        gb_log(LOG_ERR, "Unable to write the capture: %s", strerror(errno));
+    Rec_file = NULL;
+    pthread_mutex_unlock(&Rec_lock);
+    Hal = Base;
+    return;
+}
+
+/***************** REPLAY *******************/
+
+static void rep_verb(const char *cmd, size_t len, char *verb)
+{
+    size_t i;
+
+    for (i = 0; (i < len) && (i < REP_VERB - 1) && (cmd[i] != ' ') && (cmd[i] != '\n'); i++)
+        verb[i] = cmd[i];
+    verb[i] = '\0';
+    return;
+}
+
+static repKey_t *rep_key(uint8_t type, uint16_t id, const char *verb)
+{
+    unsigned int i;
+
+    for (i = 0; i < Rep_keys_numb; i++)
+        if ((Rep_keys[i].type == type) && (Rep_keys[i].id == id) && (strcmp(Rep_keys[i].verb, verb) == 0))
+            return &Rep_keys[i];
+    return NULL;
+}
+
+static int rep_index(const recEntry_t *e)
+{
+    const recEntry_t **grown;
+    char verb[REP_VERB] = "";
+    repKey_t *k;
+
+    if (e->type == REC_SERIAL)
+        rep_verb((const char *)(e + 1), e->cmd_len, verb);
+
+    k = rep_key(e->type, e->id, verb);
+    if (k == NULL) {
+        if (Rep_keys_numb == REP_KEYS)
+            return -1;
+        k = &Rep_keys[Rep_keys_numb++];
+        k->type = e->type;
+        k->id = e->id;
+        strcpy(k->verb, verb);
+    }
+    if ((k->n & (k->n - 1)) == 0) { //Grows on powers of two
+        grown = realloc(k->e, (k->n ? k->n*2 : 1) * sizeof(*k->e));
+        if (grown == NULL)
+            return -1;
+        k->e = grown;
+    }
+    k->e[k->n++] = e;
+    return 0;
+}
+
+/* Must hold the lock. The last entry of the key at or before the replay time, or its first one. */
+static const recEntry_t *rep_lookup(uint8_t type, uint16_t id, const char *verb)
+{
+    repKey_t *k = rep_key(type, id, verb);
+    long long now_ms;
+
+    if (k == NULL)
+        return NULL;
+
+    now_ms = (Hal->clock_ns(CLOCK_MONOTONIC) - Rep_hdr.mono_ns) / 1000000;
+    while ((k->cur + 1 < k->n) && (k->e[k->cur + 1]->t_ms <= now_ms))
+        k->cur++;
+    return k->e[k->cur];
+}
+
+static int rep_init(void)
+{
+    return 0;
+}
+
+static void rep_gpio_mode(int pin, halDir_t dir, halPull_t pull)
+{
+    return;
+}
+
+static void rep_gpio_write(int pin, int value)
+{
+    Rep_cs = rec_mux(Rep_cs, pin, value);
+    return;
+}
+
+static void rep_gpio_write_lines(const int *pins, unsigned int n, unsigned int values)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        Rep_cs = rec_mux(Rep_cs, pins[i], (values >> i) & 1);
+    return;
+}
+
+static int rep_gpio_read(int pin)
+{
+    const recEntry_t *e;
+    int value;
+
+    pthread_mutex_lock(&Rep_lock);
+    e = rep_lookup(REC_GPIO, pin, "");
+    value = e ? e->value : HAL_LOW;
+    pthread_mutex_unlock(&Rep_lock);
+    return value;
+}
+
+/* Edges are not replayed in time, a watched pin keeps the value of its first recorded read */
+static int rep_gpio_watch(int pin, unsigned int debounce_us)
+{
+    return -1;
+}
+
+static int rep_gpio_event(int fd, int *pin, int *value, long long *ns)
+{
+    return -1;
+}
+
+static int rep_uart_open(const char *dev, int baud)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    Rep_peer = sv[1];
+    return sv[0];
+}
+
+static void rep_uart_close(int fd)
+{
+    close(fd);
+    close(Rep_peer);
+    Rep_peer = -1;
+    return;
+}
+
+static void rep_uart_flush(int fd)
+{
+    char buf[64];
+
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+    return;
+}
+
+/* The recorded reply comes after the recorded delay, on the replay clock. No reply: the command times out. */
+static int rep_uart_write(int fd, const char *s)
+{
+    const recEntry_t *e;
+    char verb[REP_VERB];
+    useconds_t delay = 0;
+    const char *reply = NULL;
+    size_t len = 0;
+
+    rep_verb(s, strlen(s), verb);
+    pthread_mutex_lock(&Rep_lock);
+    e = rep_lookup(REC_SERIAL, Rep_cs, verb);
+    if (e != NULL) {
+        reply = (const char *)(e + 1) + e->cmd_len;
+        len = e->reply_len;
+        delay = (e->value > 0) ? e->value / Rep_speed : 0;
+    }
+    pthread_mutex_unlock(&Rep_lock);
+
+    if (delay > 0)
+        usleep(delay);
+    if ((len > 0) && (write(Rep_peer, reply, len) != (ssize_t)len))
+        return -1;
+    return 0;
+}
+
+static ssize_t rep_uart_read(int fd, void *buf, size_t len)
+{
+    return read(fd, buf, len);
+}
+
+static int rep_ds18b20_setup(int base, const char *serial)
+{
+    return 0;
+}
+
+static int rep_dht22_setup(int base, int pin)
+{
+    return 0;
+}
+
+static int rep_sensor_read(int node)
+{
+    const recEntry_t *e;
+    int value;
+
+    pthread_mutex_lock(&Rep_lock);
+    e = rep_lookup(REC_SENSOR, node, "");
+    value = e ? e->value : HAL_NO_READING;
+    pthread_mutex_unlock(&Rep_lock);
+    return value;
+}
+
+/* Time of the capture: from its start, speed times faster than the system clock */
+static long long rep_clock_ns(clockid_t clk)
+{
+    long long sys = hal_sys_clock_ns(clk);
+
+    if (clk == CLOCK_REALTIME)
+        return Rep_hdr.real_ns + (sys - Rep_real0) * Rep_speed;
+    if (clk == CLOCK_MONOTONIC)
+        return Rep_hdr.mono_ns + (sys - Rep_mono0) * Rep_speed;
+    return sys;
+}
+
+static long long rep_clock_to_sys(long long ns)
+{
+    return Rep_real0 + (ns - Rep_hdr.real_ns) / Rep_speed;
+}
+
+static const halOps_t Hal_replay = {
+    .name = "replay",
+    .init = rep_init,
+    .gpio_mode = rep_gpio_mode,
+    .gpio_write = rep_gpio_write,
+    .gpio_write_lines = rep_gpio_write_lines,
+    .gpio_read = rep_gpio_read,
+    .gpio_watch = rep_gpio_watch,
+    .gpio_event = rep_gpio_event,
+    .uart_open = rep_uart_open,
+    .uart_close = rep_uart_close,
+    .uart_flush = rep_uart_flush,
+    .uart_write = rep_uart_write,
+    .uart_read = rep_uart_read,
+    .ds18b20_setup = rep_ds18b20_setup,
+    .dht22_setup = rep_dht22_setup,
+    .sensor_read = rep_sensor_read,
+    .clock_ns = rep_clock_ns,
+    .clock_to_sys = rep_clock_to_sys
+};
+
+/*
+ * Replay the capture of path instead of the hardware, speed times faster than real time.
+ * Must be called before anything reads the clock. The capture is kept in memory.
+ */
+int hal_replay_start(const char *path, unsigned int speed)
+{
+    const recEntry_t *e;
+    FILE *f;
+    long size;
+    size_t off;
+
+    f = fopen(path, "rbe");
+    if (f == NULL) {
+        gb_log(LOG_ERR, "Unable to open the capture %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if ((fseek(f, 0, SEEK_END) < 0) || ((size = ftell(f)) < (long)sizeof(recHdr_t)) || (fseek(f, 0, SEEK_SET) < 0) ||
+            ((Rep_data = malloc(size)) == NULL) || (fread(Rep_data, 1, size, f) != (size_t)size)) {
+        gb_log(LOG_ERR, "Unable to read the capture %s.", path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    memcpy(&Rep_hdr, Rep_data, sizeof(Rep_hdr));
+    if ((Rep_hdr.magic != REC_MAGIC) || (Rep_hdr.version != REC_VERSION)) {
+        gb_log(LOG_ERR, "%s is not a capture of this version.", path);
+        return -1;
+    }
+
+    //Records are written whole, a truncated last one is the end of the capture
+    for (off = sizeof(recHdr_t); off + sizeof(recEntry_t) <= (size_t)size; ) {
+        e = (const recEntry_t *)(Rep_data + off);
+        if (off + sizeof(*e) + REC_PAD(e->cmd_len + e->reply_len) > (size_t)size)
+            break;
+        if (rep_index(e) < 0) {
+            gb_log(LOG_ERR, "Capture %s has too many devices.", path);
+            return -1;
+        }
+        if (e->t_ms > Rep_end_ms)
+            Rep_end_ms = e->t_ms;
+        off += sizeof(*e) + REC_PAD(e->cmd_len + e->reply_len);
+    }
+
+    Rep_speed = speed ? speed : 1;
+    Rep_real0 = hal_sys_clock_ns(CLOCK_REALTIME);
+    Rep_mono0 = hal_sys_clock_ns(CLOCK_MONOTONIC);
+    Hal = &Hal_replay;
+    gb_log(LOG_NOTICE, "Replaying %s (%u s) at %ux.", path, Rep_end_ms/1000, Rep_speed);
+    return 0;
+}
+
+/* CLOCK_REALTIME of the replay at the end of its capture, 0 without a replay */
+long long hal_replay_end(void)
+{
+    if (Hal != &Hal_replay)
+        return 0;
+    return Rep_hdr.real_ns + Rep_end_ms*1000000LL;
+}
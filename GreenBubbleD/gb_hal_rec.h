@@ -0,0 +1,64 @@
+/*
+ * gb_hal_rec.h:
+ *	Record and replay of the hardware traffic of the GreenBubble project
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef GB_HAL_REC_H
+#define GB_HAL_REC_H
+
+#include <stdint.h>
+
+/***************** DEFINES & ENUMS *******************/
+
+#define REC_MAGIC   0x31524247 //"GBR1"
+#define REC_VERSION 1
+#define REC_PAD(len) (((len) + 3) & ~3) //Records start on 4 bytes
+
+typedef enum {
+    REC_SERIAL = 1,     //A command to a led driver and its reply
+    REC_SENSOR,         //A temperature or humidity reading
+    REC_GPIO            //A pin read
+} recType_t;
+
+/* A capture is this header and then the records, in time order for each device */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t real_ns;    //CLOCK_REALTIME at the start of the capture
+    int64_t mono_ns;    //CLOCK_MONOTONIC at the start of the capture
+} recHdr_t;
+
+/* A record, followed by cmd_len bytes of command and reply_len bytes of reply (serial), padded by REC_PAD */
+typedef struct {
+    uint32_t t_ms;      //Since the start of the capture
+    int32_t value;      //Serial: us from the command to the last byte of the reply, -1 without one. Others: reading
+    uint16_t id;        //Serial: mux address. Sensor: node. Gpio: pin
+    uint16_t reply_len;
+    uint8_t type;       //recType_t
+    uint8_t cmd_len;
+    uint16_t pad;
+} recEntry_t;
+
+/***************** FUNCTIONS *******************/
+int hal_record_start(const char *path);
+void hal_record_stop(void);
+int hal_replay_start(const char *path, unsigned int speed);
+long long hal_replay_end(void);
+
+#endif //GB_HAL_REC_H
@@ -0,0 +1,282 @@
+/*
+ * gb_hal_w1.c:
+ *	DS18B20 sensors through the kernel w1 sysfs, for the GreenBubble project
+ *	A thread sweeps the sensors: one write of therm_bulk_read on each bus master
+ *	starts the conversion on all of them at once, then every temperature is
+ *	collected after the single conversion time and kept for sensor_read(). The
+ *	sensors are found under HAL_W1_ROOT and a node takes the one of its serial,
+ *	or the next one by ID when that serial is not on the bus. The GPIOs, the UART
+ *	and the DHT22 stay on the backends compiled with it.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <gb_hal.h>
+#include <gb_log.h>
+
+#ifndef HAL_W1_ROOT
+#define HAL_W1_ROOT "/sys/bus/w1/devices"
+#endif
+
+#define W1_SENSORS  8       //DS18B20 on the buses
+#define W1_MASTERS  4
+#define W1_ID_LEN   16      //"28-" and 12 hex digits
+#define W1_CONV_MS  750     //12 bit conversion
+#define W1_WAIT_MS  100     //therm_bulk_read polled this often once the conversion time is over
+#define W1_TRIES    10
+#define W1_SWEEP_S  30      //A sweep this often
+#define W1_KEEP_S   (3*W1_SWEEP_S)  //A reading is no reading once this old
+
+#if defined(HAL_IIO)
+extern halOps_t Hal_iio;
+static const halOps_t *Base = &Hal_iio;
+#elif defined(HAL_GPIO_CHARDEV)
+extern halOps_t Hal_chardev;
+static const halOps_t *Base = &Hal_chardev;
+#elif defined(HAL_MOCK)
+extern const halOps_t Hal_mock;
+static const halOps_t *Base = &Hal_mock;
+#else
+extern const halOps_t Hal_wiringpi;
+static const halOps_t *Base = &Hal_wiringpi;
+#endif
+extern halOps_t Hal_w1;
+
+static char Masters[W1_MASTERS][32];
+static unsigned int Masters_numb;
+static struct {
+    char id[W1_ID_LEN];
+    int node;           //0 while no node took it
+    int value;          //Last reading in tenths of °C
+    long long time;     //CLOCK_MONOTONIC ns of it, 0 for none
+    unsigned int errors;    //Sweeps in a row without a reading
+} Sensors[W1_SENSORS];  //Sorted by ID
+static unsigned int Sensors_numb;
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t Sweeper;
+
+/***************** SYSFS *******************/
+
+/* First line of a file of the tree, -1 if it can not be read */
+static int w1_read(const char *dir, const char *file, char *buf, size_t len)
+{
+    char path[256];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", HAL_W1_ROOT, dir, file);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    n = read(fd, buf, len - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+static int w1_write(const char *dir, const char *file, const char *s)
+{
+    char path[256];
+    int fd, ret;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", HAL_W1_ROOT, dir, file);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ret = (write(fd, s, strlen(s)) == (ssize_t)strlen(s)) ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+static int w1_id_cmp(const void *a, const void *b)
+{
+    return strcmp(a, b);
+}
+
+/* Bus masters and DS18B20 (family 28) of the tree */
+static void w1_discover(void)
+{
+    struct dirent *e;
+    DIR *dir;
+
+    dir = opendir(HAL_W1_ROOT);
+    if (!dir) {
+        gb_log(LOG_ERR, "Unable to open %s: %s", HAL_W1_ROOT, strerror(errno));
+        return;
+    }
+    while ((e = readdir(dir)) != NULL) {
+        if (!strncmp(e->d_name, "w1_bus_master", 13) && (Masters_numb < W1_MASTERS))
+            snprintf(Masters[Masters_numb++], sizeof(Masters[0]), "%.31s", e->d_name);
+        else if (!strncmp(e->d_name, "28-", 3) && (strlen(e->d_name) < W1_ID_LEN) && (Sensors_numb < W1_SENSORS))
+            snprintf(Sensors[Sensors_numb++].id, W1_ID_LEN, "%.15s", e->d_name);
+    }
+    closedir(dir);
+    qsort(Sensors, Sensors_numb, sizeof(Sensors[0]), w1_id_cmp);
+    return;
+}
+
+/***************** SWEEP *******************/
+
+/* Start the conversion on all the sensors of every master, then wait until it is over */
+static void w1_convert(void)
+{
+    char buf[16];
+    unsigned int i, tries;
+    bool started = false;
+
+    for (i = 0; i < Masters_numb; i++)
+        if (w1_write(Masters[i], "therm_bulk_read", "trigger\n") == 0)
+            started = true;
+    if (!started)
+        return; //Without bulk read each temperature read converts on its own
+
+    hal_sleep_ms(W1_CONV_MS);
+    // -1 while a sensor still converts
+    for (i = 0; i < Masters_numb; i++)
+        for (tries = 0; tries < W1_TRIES; tries++) {
+            if ((w1_read(Masters[i], "therm_bulk_read", buf, sizeof(buf)) < 0) || (atoi(buf) != -1))
+                break;
+            hal_sleep_ms(W1_WAIT_MS);
+        }
+    return;
+}
+
+/* The temperature of every sensor, in tenths of °C */
+static void w1_collect(void)
+{
+    char buf[32];
+    unsigned int i;
+
+    // The IDs do not change after the discovery, only the readings need the lock
+    for (i = 0; i < Sensors_numb; i++) {
+        if (w1_read(Sensors[i].id, "temperature", buf, sizeof(buf)) < 0) {
+            pthread_mutex_lock(&Lock);
+            if (Sensors[i].errors++ == 0)
+                gb_log(LOG_WARNING, "No temperature from the DS18B20 %s.", Sensors[i].id);
+            pthread_mutex_unlock(&Lock);
+            continue;
+        }
+        pthread_mutex_lock(&Lock);
+        Sensors[i].value = atoi(buf) / 100; //m°C
+        Sensors[i].time = hal_sys_clock_ns(CLOCK_MONOTONIC);
+        Sensors[i].errors = 0;
+        pthread_mutex_unlock(&Lock);
+    }
+    return;
+}
+
+/* The blocking sysfs accesses stay off the event loop */
+static void *w1_sweep(void *arg)
+{
+    struct timespec start, end;
+    long long ms;
+
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        w1_convert();
+        w1_collect();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ms = (end.tv_sec - start.tv_sec)*1000LL + (end.tv_nsec - start.tv_nsec)/1000000;
+        gb_log(LOG_DEBUG, "w1 sweep of %u sensors in %lld ms.\n", Sensors_numb, ms);
+        hal_sleep_ms(W1_SWEEP_S*1000L);
+    }
+    return NULL;
+}
+
+/***************** SENSORS *******************/
+
+static int w1_init(void)
+{
+    w1_discover();
+    gb_log(LOG_NOTICE, "%u DS18B20 on %u w1 masters of %s, the rest on %s.", Sensors_numb, Masters_numb, HAL_W1_ROOT, Base->name);
+    if (pthread_create(&Sweeper, NULL, w1_sweep, NULL) != 0) {
+        gb_log(LOG_CRIT, "Unable to start the w1 sweep.");
+        return -1;
+    }
+    pthread_setname_np(Sweeper, "gb_w1");
+    pthread_detach(Sweeper);
+    return hal_stack_init(&Hal_w1, Base);
+}
+
+/* The sensor of the serial, or the first one by ID no node took */
+static int w1_ds18b20_setup(int base, const char *serial)
+{
+    char id[W1_ID_LEN + 8];
+    unsigned int i;
+
+    snprintf(id, sizeof(id), "28-%s", serial);
+    pthread_mutex_lock(&Lock);
+    for (i = 0; i < Sensors_numb; i++)
+        if (!Sensors[i].node && !strcmp(Sensors[i].id, id))
+            break;
+    if (i == Sensors_numb) {
+        for (i = 0; i < Sensors_numb; i++)
+            if (!Sensors[i].node)
+                break;
+        if (i < Sensors_numb)
+            gb_log(LOG_NOTICE, "DS18B20 %s is not on the bus, node %d takes %s.", id, base, Sensors[i].id);
+    }
+    if (i == Sensors_numb) {
+        pthread_mutex_unlock(&Lock);
+        gb_log(LOG_ERR, "No DS18B20 left for node %d.", base);
+        return -1;
+    }
+    Sensors[i].node = base;
+    pthread_mutex_unlock(&Lock);
+    return 0;
+}
+
+/* Last reading of the sweep, HAL_NO_READING before the first one or after W1_KEEP_S without one */
+static int w1_sensor_read(int node)
+{
+    unsigned int i;
+    int value;
+
+    pthread_mutex_lock(&Lock);
+    for (i = 0; i < Sensors_numb; i++)
+        if (Sensors[i].node == node) {
+            value = hal_reading(Sensors[i].value, Sensors[i].time, W1_KEEP_S);
+            pthread_mutex_unlock(&Lock);
+            return value;
+        }
+    pthread_mutex_unlock(&Lock);
+    return Base->sensor_read(node);
+}
+
+//The GPIOs, the UART and the DHT22 come from Base at init
+halOps_t Hal_w1 = {
+    .name = "w1 sysfs",
+    .init = w1_init,
+    .ds18b20_setup = w1_ds18b20_setup,
+    .sensor_read = w1_sensor_read,
+    .clock_ns = hal_sys_clock_ns,
+    .clock_to_sys = hal_sys_clock_to_sys
+};
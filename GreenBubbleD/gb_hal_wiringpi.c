@@ -0,0 +1,182 @@
+/*
+ * gb_hal_wiringpi.c:
+ *	wiringPi backend of the hardware abstraction layer, the Raspberry Pi board
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <wiringPi.h>
+#include <wiringSerial.h>
+#include <ds18b20.h>
+#include <rht03.h>
+
+#include <gb_hal.h>
+
+static int wpi_init(void)
+{
+    return wiringPiSetupGpio();
+}
+
+static void wpi_gpio_mode(int pin, halDir_t dir, halPull_t pull)
+{
+    pinMode(pin, (dir == HAL_OUTPUT) ? OUTPUT : INPUT);
+    if (dir == HAL_INPUT)
+        pullUpDnControl(pin, (pull == HAL_PULL_UP) ? PUD_UP : (pull == HAL_PULL_DOWN) ? PUD_DOWN : PUD_OFF);
+    return;
+}
+
+static void wpi_gpio_write(int pin, int value)
+{
+    digitalWrite(pin, value ? HIGH : LOW);
+    return;
+}
+
+/* One write per pin, wiringPi has no way to change them together */
+static void wpi_gpio_write_lines(const int *pins, unsigned int n, unsigned int values)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        digitalWrite(pins[i], ((values >> i) & 1) ? HIGH : LOW);
+    return;
+}
+
+static int wpi_gpio_read(int pin)
+{
+    return digitalRead(pin);
+}
+
+/* Edges of one pin, from the wiringPi interrupt thread into a pipe the loop reads */
+static struct {
+    int pin;
+    int fd[2];
+    long long debounce_ns;
+    int value;
+    long long last;
+} Watch = { .pin = -1, .fd = { -1, -1 } };
+
+typedef struct {
+    int pin;
+    int value;
+    long long ns;
+} wpiEvent_t;
+
+static void wpi_isr(void)
+{
+    wpiEvent_t ev = { .pin = Watch.pin, .value = digitalRead(Watch.pin), .ns = hal_sys_clock_ns(CLOCK_MONOTONIC) };
+
+    // No kernel debounce here: an edge too close to the last one, or without a change, is bounce
+    if ((ev.value == Watch.value) || (ev.ns - Watch.last < Watch.debounce_ns))
+        return;
+    Watch.value = ev.value;
+    Watch.last = ev.ns;
+    if (write(Watch.fd[1], &ev, sizeof(ev)) != sizeof(ev))
+        Watch.value = -1; //Pipe full, the next edge goes whatever its value
+    return;
+}
+
+static int wpi_gpio_watch(int pin, unsigned int debounce_us)
+{
+    if ((Watch.pin >= 0) || (pipe2(Watch.fd, O_CLOEXEC | O_NONBLOCK) < 0))
+        return -1;
+    Watch.pin = pin;
+    Watch.debounce_ns = debounce_us*1000LL;
+    Watch.value = digitalRead(pin);
+    if (wiringPiISR(pin, INT_EDGE_BOTH, wpi_isr) < 0)
+        return -1;
+    return Watch.fd[0];
+}
+
+static int wpi_gpio_event(int fd, int *pin, int *value, long long *ns)
+{
+    wpiEvent_t ev;
+
+    if (read(fd, &ev, sizeof(ev)) != sizeof(ev))
+        return -1;
+    *pin = ev.pin;
+    *value = ev.value;
+    *ns = ev.ns;
+    return 0;
+}
+
+static int wpi_uart_open(const char *dev, int baud)
+{
+    return serialOpen(dev, baud);
+}
+
+static void wpi_uart_close(int fd)
+{
+    serialClose(fd);
+    return;
+}
+
+static void wpi_uart_flush(int fd)
+{
+    serialFlush(fd);
+    return;
+}
+
+static int wpi_uart_write(int fd, const char *s)
+{
+    serialPuts(fd, s);
+    return 0;
+}
+
+static ssize_t wpi_uart_read(int fd, void *buf, size_t len)
+{
+    return read(fd, buf, len);
+}
+
+/* The kernel w1 driver finds the sensor, there is no pin */
+static int wpi_ds18b20_setup(int base, const char *serial)
+{
+    return ds18b20Setup(base, serial) ? 0 : -1;
+}
+
+static int wpi_dht22_setup(int base, int pin)
+{
+    return rht03Setup(base, pin) ? 0 : -1;
+}
+
+static int wpi_sensor_read(int node)
+{
+    return analogRead(node);
+}
+
+const halOps_t Hal_wiringpi = {
+    .name = "wiringPi",
+    .init = wpi_init,
+    .gpio_mode = wpi_gpio_mode,
+    .gpio_write = wpi_gpio_write,
+    .gpio_write_lines = wpi_gpio_write_lines,
+    .gpio_read = wpi_gpio_read,
+    .gpio_watch = wpi_gpio_watch,
+    .gpio_event = wpi_gpio_event,
+    .uart_open = wpi_uart_open,
+    .uart_close = wpi_uart_close,
+    .uart_flush = wpi_uart_flush,
+    .uart_write = wpi_uart_write,
+    .uart_read = wpi_uart_read,
+    .ds18b20_setup = wpi_ds18b20_setup,
+    .dht22_setup = wpi_dht22_setup,
+    .sensor_read = wpi_sensor_read,
+    .clock_ns = hal_sys_clock_ns,
+    .clock_to_sys = hal_sys_clock_to_sys
+};
@@ -0,0 +1,487 @@
+/*
+ * gb_jobs.c:
+ *	Asynchronous hardware jobs for the GreenBubble project
+ *	The rest callbacks only validate and queue the requests. A single worker
+ *	thread applies them to the Led Drivers, so web threads never wait on the UART.
+ *	Bursts of instant commands (ex. dragging a slider) are coalesced, the bus only
+ *	applies the newest target of each channel. A config reloaded from the file only
+ *	sends what differs from the running one.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <gb_jobs.h>
+#include <gb_main.h>
+#include <gb_serial.h>
+#include <gb_led.h>
+#include <gb_config.h>
+#include <gb_regul.h>
+#include <gb_trace.h>
+#include <gb_act.h>
+#include <gb_log.h>
+
+// Jobs live in a ring indexed by id, the queue only keeps the ids still waiting for the worker.
+// Consecutive instant jobs are coalesced: the newest one replaces the queued one (last writer wins).
+static gbJob_t Jobs[JOB_RING];
+static unsigned int Queue[JOB_RING];
+static unsigned int Q_head, Q_len;
+static unsigned int Next_id = 1;
+static bool Stop;
+static bool Drop;           //Out of time to stop: what is still queued is not run
+static bool Started;
+static pthread_t Worker;
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Cond = PTHREAD_COND_INITIALIZER;
+
+/***************** WORKER *******************/
+
+static gbJob_t *job_queue_peek(unsigned int pos)
+{
+    return &Jobs[Queue[(Q_head + pos) % JOB_RING] % JOB_RING];
+}
+
+/* Must hold the lock. True if a newer instant job waits right behind the running one */
+static bool job_instant_pending(void)
+{
+    return (Q_len > 0) && (job_queue_peek(0)->type == JOB_INSTANT);
+}
+
+/* Out of time to stop: the job running leaves the leds it did not reach, at its next led */
+static bool job_late(gbJob_t *job, ldBoard_t ld)
+{
+    bool late;
+
+    pthread_mutex_lock(&Lock);
+    late = Drop;
+    pthread_mutex_unlock(&Lock);
+    if (!late)
+        return false;
+
+    for (; ld < Gb_ch.numb; ld++) {
+        job->ld_result[ld] = JOB_LD_ERROR;
+        job->ret |= (1 << ld);
+    }
+    return true;
+}
+
+/*
+ * Apply the instant config of a channel, skipping what the driver already has. The registry
+ * setpoint and output are kept by every write to the driver (routine, snapshot, shutdown).
+ */
+static int job_apply_instant(ldBoard_t ld, unsigned int curr, bool enable)
+{
+    if (!((Gb_ch.setpoint_ok & (1 << ld)) && (Gb_ch.setpoint[ld] == curr)) && (ld_set_current(ld, curr) < 0))
+        return -1;
+
+    if (!((Gb_ch.output_ok & (1 << ld)) && (((Gb_ch.output >> ld) & 1) == enable)) && (ld_set_output(ld, enable) < 0))
+        return -1;
+    return 0;
+}
+
+/* The payload allocated by the caller, freed once the job ran or was dropped */
+static void job_free_payload(gbJob_t *job)
+{
+    free(job->spec);
+    job->spec = NULL;
+    free(job->cfg);
+    job->cfg = NULL;
+    return;
+}
+
+/* Publish a config with the job targets first: the routine stops before the drivers are touched */
+static void job_run_instant(gbJob_t *job)
+{
+    gbCfg_t *cfg;
+    ldBoard_t ld;
+    unsigned int curr[LD_MAX];
+    bool enable[LD_MAX], newer;
+
+    cfg = cfg_begin();
+    cfg->ld_instant_mode = true;
+    FOR_EACH_LED(ld) {
+        curr[ld] = get_curr_from_perc(ld, job->intens[ld]);
+        enable[ld] = (job->enable && job->intens[ld]);
+        cfg->ld_instant[ld].cset = curr[ld];
+        cfg->ld_instant[ld].enable = enable[ld];
+    }
+    if (cfg_commit(cfg, "instant") < 0) {
+        job->ret = -1;
+        return;
+    }
+
+    FOR_EACH_LED(ld) {
+        //Stop as soon as a newer target is waiting, it is applied next at the bus pace
+        pthread_mutex_lock(&Lock);
+        newer = job_instant_pending();
+        pthread_mutex_unlock(&Lock);
+        if (newer) {
+            for (; ld < Gb_ch.numb; ld++)
+                job->ld_result[ld] = JOB_LD_SUPERSEDED;
+            break;
+        }
+        if (job_late(job, ld))
+            break;
+
+        if (job_apply_instant(ld, curr[ld], enable[ld]) < 0) {
+            job->ld_result[ld] = JOB_LD_ERROR;
+            job->ret |= (1 << ld);
+        } else
+            job->ld_result[ld] = JOB_LD_OK;
+    }
+    return;
+}
+
+static void job_run_spectrum(gbJob_t *job)
+{
+    gbCfg_t *cfg;
+    ldBoard_t ld;
+    int ret;
+
+    //The whole spectrum is published at once, with its routine points already generated
+    cfg = cfg_begin();
+    cfg->ld_instant_mode = false;
+    memcpy(cfg->ld_spec, job->spec, Gb_ch.numb * sizeof(ldSpec_t));
+    job_free_payload(job);
+    if (cfg_commit(cfg, "spectrum") < 0) {
+        job->ret = -1;
+        return;
+    }
+
+    //Apply the current point
+    ret = ld_daily_routine(1);
+    ld_routine_wakeup();
+
+    FOR_EACH_LED(ld) {
+        if (ret & (2 << ld)) {
+            job->ld_result[ld] = JOB_LD_ERROR;
+            job->ret |= (1 << ld);
+        } else
+            job->ld_result[ld] = JOB_LD_OK;
+    }
+    return;
+}
+
+/* A config from the file or an old version: publish it, then only send what differs from the previous one */
+static void job_run_reload(gbJob_t *job)
+{
+    const gbCfg_t *old;
+    gbCfg_t *cfg;
+    bool mode, spec = false;
+    ldBoard_t ld;
+    int err, ret;
+
+    //CFG.json is read and parsed here, off the event loop
+    if (job->cfg == NULL) {
+        job->cfg = calloc(1, sizeof(gbCfg_t));
+        ret = job->cfg ? cfg_reload_read(job->cfg) : -1;
+        if (ret <= 0) {
+            job_free_payload(job);
+            job->ret = ret;
+            return;
+        }
+    }
+
+    old = cfg_hold(); //Kept in the versions ring until released
+    cfg = cfg_begin();
+    cfg->ld_instant_mode = job->cfg->ld_instant_mode;
+    cfg->regul_ms = job->cfg->regul_ms;
+    cfg->shutdown_leds = job->cfg->shutdown_leds;
+    cfg->shutdown_ms = job->cfg->shutdown_ms;
+    cfg->fog = job->cfg->fog;
+    cfg->pwc = job->cfg->pwc;
+    memcpy(cfg->ld_instant, job->cfg->ld_instant, sizeof(cfg->ld_instant));
+    memcpy(cfg->ld_spec, job->cfg->ld_spec, sizeof(cfg->ld_spec));
+    job_free_payload(job);
+    if (cfg_commit(cfg, job_type_str(job->type)) < 0) {
+        cfg_release(old);
+        job->ret = -1;
+        return;
+    }
+    mode = (cfg->ld_instant_mode != old->ld_instant_mode);
+
+    FOR_EACH_LED(ld) {
+        if (job_late(job, ld)) {
+            cfg_release(old);
+            return;
+        }
+        err = 0;
+
+        if (cfg->ld_instant[ld].vset != old->ld_instant[ld].vset) {
+            err = ld_set_voltage(ld, cfg->ld_instant[ld].vset);
+            if (err == 0)
+                LD_BIT_SET(Gb_ch.volt_ok, ld);
+            else
+                LD_BIT_CLR(Gb_ch.volt_ok, ld);
+        }
+
+        if (!cfg_spec_equal(&cfg->ld_spec[ld], &old->ld_spec[ld]))
+            spec = true;
+
+        if (cfg->ld_instant_mode && (mode || (cfg->ld_instant[ld].cset != old->ld_instant[ld].cset) ||
+                    (cfg->ld_instant[ld].enable != old->ld_instant[ld].enable)))
+            err |= job_apply_instant(ld, cfg->ld_instant[ld].cset, (cfg->ld_instant[ld].enable && cfg->ld_instant[ld].cset));
+
+        if (err) {
+            job->ld_result[ld] = JOB_LD_ERROR;
+            job->ret |= (1 << ld);
+        } else
+            job->ld_result[ld] = JOB_LD_OK;
+    }
+
+    if (cfg->regul_ms != old->regul_ms)
+        regul_set_period(cfg->regul_ms);
+    if (memcmp(&cfg->fog, &old->fog, sizeof(cfg->fog)) || memcmp(&cfg->pwc, &old->pwc, sizeof(cfg->pwc)))
+        act_wakeup();
+
+    //Only a new spectrum needs the routine again, leaving instant mode resends every led
+    if (!cfg->ld_instant_mode && (spec || mode)) {
+        ret = ld_daily_routine(mode);
+        ld_routine_wakeup();
+        FOR_EACH_LED(ld) {
+            if (ret & (2 << ld)) {
+                job->ld_result[ld] = JOB_LD_ERROR;
+                job->ret |= (1 << ld);
+            }
+        }
+    }
+    cfg_release(old);
+    return;
+}
+
+static void job_run(gbJob_t *job)
+{
+    TRACE_BEGIN("job", job_type_str(job->type));
+    if (job->type == JOB_INSTANT)
+        job_run_instant(job);
+    else if (job->type == JOB_SPECTRUM)
+        job_run_spectrum(job);
+    else
+        job_run_reload(job);
+    TRACE_END("job", job_type_str(job->type));
+
+    if (job->save)
+        cfg_save_later();
+
+    if (job->ret)
+        gb_log(LOG_ERR, "Job %u: Error setting config: Code %i", job->id, job->ret);
+    else
+        gb_log(LOG_INFO, "Job %u: %s Config Successfully Applied%s", job->id,
+                job_type_str(job->type), job->save ? " and Saved." : ".");
+    return;
+}
+
+static void *job_worker(void *arg)
+{
+    gbJob_t job;
+    gbJob_t *slot;
+
+    pthread_mutex_lock(&Lock);
+    while (1) {
+        while ((Q_len == 0) && !Stop)
+            pthread_cond_wait(&Cond, &Lock);
+        if (Q_len == 0)
+            break; //Stop requested and queue drained
+        if (Drop) {
+            while (Q_len > 0) {
+                slot = job_queue_peek(0);
+                slot->state = JOB_FAILED;
+                slot->ret = -1;
+                job_free_payload(slot);
+                Q_head = (Q_head + 1) % JOB_RING;
+                Q_len--;
+            }
+            break;
+        }
+
+        slot = job_queue_peek(0);
+        Q_head = (Q_head + 1) % JOB_RING;
+        Q_len--;
+        slot->state = JOB_RUNNING;
+        job = *slot;
+        pthread_mutex_unlock(&Lock);
+
+        //The serial bus is only touched here, outside of the jobs lock
+        job_run(&job);
+        job_free_payload(&job);
+
+        pthread_mutex_lock(&Lock);
+        job.state = job.ret ? JOB_FAILED : JOB_DONE;
+        *slot = job;
+    }
+    pthread_mutex_unlock(&Lock);
+
+    return NULL;
+}
+
+/***************** API *******************/
+
+int job_init(void)
+{
+    Stop = false;
+    Drop = false;
+    if (pthread_create(&Worker, NULL, job_worker, NULL) != 0) {
+        gb_log(LOG_CRIT, "Unable to start the job worker thread.");
+        return -1;
+    }
+    pthread_setname_np(Worker, "gb_jobs");
+    Started = true;
+    return 0;
+}
+
+/*
+ * Run the jobs still queued, until deadline (CLOCK_REALTIME ns, 0 waits for all of them).
+ * Then the others are dropped and the job running stops before its next led, so the wait
+ * after the deadline is the bus transactions of one led (or one routine step, for a
+ * spectrum), each bounded by LD_FEEDBACK_MS. Returns -1 if any was dropped.
+ */
+int job_stop(long long deadline)
+{
+    struct timespec ts;
+    int ret = 0;
+
+    if (!Started)
+        return 0;
+
+    pthread_mutex_lock(&Lock);
+    Stop = true;
+    pthread_cond_signal(&Cond);
+    pthread_mutex_unlock(&Lock);
+
+    if (deadline != 0) {
+        ts.tv_sec = deadline / 1000000000LL;
+        ts.tv_nsec = deadline % 1000000000LL;
+        if (pthread_timedjoin_np(Worker, NULL, &ts) == 0) {
+            Started = false;
+            return 0;
+        }
+
+        pthread_mutex_lock(&Lock);
+        Drop = true;
+        ret = (Q_len > 0) ? -1 : 0;
+        pthread_mutex_unlock(&Lock);
+    }
+
+    pthread_join(Worker, NULL);
+    Started = false;
+    return ret;
+}
+
+/* Queue a copy of the job. Returns its id or -1 if the queue is full or the daemon is stopping. */
+int job_submit(gbJob_t *job)
+{
+    ldBoard_t ld;
+    gbJob_t *slot, *tail;
+    int id;
+
+    pthread_mutex_lock(&Lock);
+    if (Stop) {
+        pthread_mutex_unlock(&Lock);
+        return -1;
+    }
+
+    //An instant job still waiting is replaced by this one, only the newest targets matter
+    tail = NULL;
+    if ((job->type == JOB_INSTANT) && (Q_len > 0)) {
+        tail = job_queue_peek(Q_len - 1);
+        if (tail->type != JOB_INSTANT)
+            tail = NULL;
+    }
+
+    //Do not overwrite a job that did not finish yet, the one replaced aside. Nothing changes if refused.
+    slot = &Jobs[Next_id % JOB_RING];
+    if ((Q_len - (tail ? 1 : 0) >= JOB_RING) ||
+            ((slot != tail) && (slot->id != 0) && ((slot->state == JOB_QUEUED) || (slot->state == JOB_RUNNING)))) {
+        pthread_mutex_unlock(&Lock);
+        return -1;
+    }
+
+    if (tail) {
+        tail->state = JOB_SUPERSEDED;
+        FOR_EACH_LED(ld)
+            tail->ld_result[ld] = JOB_LD_SUPERSEDED;
+        job->save |= tail->save; //The save it asked for is done by this one
+        Q_len--;
+    }
+
+    id = Next_id++;
+    job->id = id;
+    job->state = JOB_QUEUED;
+    job->ret = 0;
+    FOR_EACH_LED(ld)
+        job->ld_result[ld] = JOB_LD_PENDING;
+    *slot = *job;
+    Queue[(Q_head + Q_len) % JOB_RING] = id;
+    Q_len++;
+
+    pthread_cond_signal(&Cond);
+    pthread_mutex_unlock(&Lock);
+
+    return id;
+}
+
+/* Copy the job with this id. Returns -1 if it is unknown or already dropped from the ring. */
+int job_get(unsigned int id, gbJob_t *job)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&Lock);
+    if ((id != 0) && (id < Next_id) && (Jobs[id % JOB_RING].id == id)) {
+        *job = Jobs[id % JOB_RING];
+        ret = 0;
+    }
+    pthread_mutex_unlock(&Lock);
+
+    return ret;
+}
+
+const char *job_type_str(jobType_t type)
+{
+    switch (type) {
+        case JOB_INSTANT:  return "instant";
+        case JOB_SPECTRUM: return "spectrum";
+        case JOB_RELOAD:   return "reload";
+        case JOB_ROLLBACK: return "rollback";
+    }
+    return "unknown";
+}
+
+const char *job_state_str(jobState_t state)
+{
+    switch (state) {
+        case JOB_QUEUED:  return "queued";
+        case JOB_RUNNING: return "running";
+        case JOB_DONE:    return "done";
+        case JOB_FAILED:  return "failed";
+        case JOB_SUPERSEDED: return "superseded";
+    }
+    return "unknown";
+}
+
+const char *job_ld_result_str(jobLdResult_t result)
+{
+    switch (result) {
+        case JOB_LD_PENDING: return "pending";
+        case JOB_LD_OK:      return "ok";
+        case JOB_LD_ERROR:   return "error";
+        case JOB_LD_SUPERSEDED: return "superseded";
+    }
+    return "unknown";
+}
@@ -0,0 +1,75 @@
+/*
+ * gb_jobs.h:
+ *	Asynchronous hardware jobs for the GreenBubble project
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef GB_JOBS_H
+#define GB_JOBS_H
+
+#include <gb_main.h>
+
+/***************** DEFINES & ENUMS *******************/
+
+#define JOB_RING 32 //Jobs kept in memory, queued and finished ones
+
+typedef enum {
+    JOB_QUEUED = 0,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_SUPERSEDED      //Instant job replaced by a newer one before it was applied
+} jobState_t;
+
+typedef enum {
+    JOB_INSTANT = 0,
+    JOB_SPECTRUM,
+    JOB_RELOAD,         //CFG.json changed on disk
+    JOB_ROLLBACK        //Back to an old config version
+} jobType_t;
+
+typedef enum {
+    JOB_LD_PENDING = 0,
+    JOB_LD_OK,
+    JOB_LD_ERROR,
+    JOB_LD_SUPERSEDED   //A newer instant target was applied instead
+} jobLdResult_t;
+
+typedef struct {
+    unsigned int id;
+    jobType_t type;
+    jobState_t state;
+    bool save;
+    bool enable;
+    unsigned char intens[LD_MAX];               //Instant mode intensities (%)
+    ldSpec_t *spec;                             //Spectrum mode, Gb_ch.numb specs allocated by the caller, freed by the worker
+    gbCfg_t *cfg;                               //Reload and rollback, allocated by the caller, freed by the worker
+    jobLdResult_t ld_result[LD_MAX];            //Per led driver result
+    int ret;                                    //Error code, same bits as the old synchronous post
+} gbJob_t;
+
+/***************** FUNCTIONS *******************/
+int job_init(void);
+int job_stop(long long deadline);
+int job_submit(gbJob_t *job);
+int job_get(unsigned int id, gbJob_t *job);
+const char *job_type_str(jobType_t type);
+const char *job_state_str(jobState_t state);
+const char *job_ld_result_str(jobLdResult_t result);
+
+#endif //GB_JOBS_H
@@ -0,0 +1,265 @@
+/*
+ * gb_json.c:
+ *	Json writer of the hot REST responses for the GreenBubble project
+ *	The body is written straight into a buffer of the calling thread, as compact
+ *	as json_dumps(JSON_COMPACT) writes it: no json_t tree and no heap string per
+ *	request. The buffer is reused by the next body of the same thread, and by
+ *	the next connection thread once this one exits.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <gb_json.h>
+#include <gb_log.h>
+
+/*
+ * Each thread that serves a body holds its own buffer while it lives, the body itself is
+ * never shared. The web server runs a thread per connection, so a thread that exits gives
+ * its buffer back to a small pool and the next connection takes it from there instead of
+ * allocating one. Only the buffers beyond JW_POOL, when more connections ran at once, are freed.
+ */
+#define JW_POOL 4
+
+static __thread jwBuf_t *My_buf;
+static __thread jwBuf_t No_buf;     //Without memory: a body that is always full
+static pthread_key_t Buf_key;
+static pthread_once_t Buf_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t Pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static jwBuf_t *Pool[JW_POOL];
+static int Pool_cnt;
+
+/***************** OUTPUT *******************/
+
+static void jw_put(jwBuf_t *w, const char *s, size_t n)
+{
+    if (w->full || (w->len + n >= JW_SIZE)) {
+        w->full = true;
+        return;
+    }
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+    return;
+}
+
+static void jw_putc(jwBuf_t *w, char c)
+{
+    if (w->full || (w->len + 1 >= JW_SIZE)) {
+        w->full = true;
+        return;
+    }
+    w->buf[w->len++] = c;
+    return;
+}
+
+/* Escaped as jansson does: \" \\ \b \f \n \r \t, the other control characters \u00XX */
+static void jw_string(jwBuf_t *w, const char *s)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const char *plain;
+    char esc[6];
+
+    jw_putc(w, '"');
+    while (*s) {
+        for (plain = s; ((unsigned char)*s >= 0x20) && (*s != '"') && (*s != '\\'); s++);
+        jw_put(w, plain, s - plain);
+        if (*s == '\0')
+            break;
+        esc[0] = '\\';
+        switch (*s) {
+            case '"':  esc[1] = '"';  break;
+            case '\\': esc[1] = '\\'; break;
+            case '\b': esc[1] = 'b';  break;
+            case '\f': esc[1] = 'f';  break;
+            case '\n': esc[1] = 'n';  break;
+            case '\r': esc[1] = 'r';  break;
+            case '\t': esc[1] = 't';  break;
+            default:
+                memcpy(esc + 1, "u00", 3);
+                esc[4] = hex[(unsigned char)*s >> 4];
+                esc[5] = hex[*s & 0xf];
+                jw_put(w, esc, 6);
+                s++;
+                continue;
+        }
+        jw_put(w, esc, 2);
+        s++;
+    }
+    jw_putc(w, '"');
+    return;
+}
+
+/* The ',' before a value and its key */
+static void jw_key(jwBuf_t *w, const char *key)
+{
+    if (w->comma)
+        jw_putc(w, ',');
+    w->comma = true;
+    if (key) {
+        jw_string(w, key);
+        jw_putc(w, ':');
+    }
+    return;
+}
+
+/***************** BODY *******************/
+
+/* Thread exit: the buffer goes back to the pool, or is freed if the pool is full */
+static void jw_release(void *arg)
+{
+    jwBuf_t *w = arg;
+
+    pthread_mutex_lock(&Pool_lock);
+    if (Pool_cnt < JW_POOL) {
+        Pool[Pool_cnt++] = w;
+        w = NULL;
+    }
+    pthread_mutex_unlock(&Pool_lock);
+    free(w);
+    return;
+}
+
+static void jw_key_init(void)
+{
+    pthread_key_create(&Buf_key, jw_release);
+    return;
+}
+
+/* Buffer of the calling thread, taken from the pool or allocated on its first body */
+static jwBuf_t *jw_buf(void)
+{
+    jwBuf_t *w = NULL;
+
+    if (My_buf)
+        return My_buf;
+
+    pthread_once(&Buf_once, jw_key_init);
+    pthread_mutex_lock(&Pool_lock);
+    if (Pool_cnt > 0)
+        w = Pool[--Pool_cnt];
+    pthread_mutex_unlock(&Pool_lock);
+    if (w) {
+        pthread_setspecific(Buf_key, w);
+        My_buf = w;
+        return w;
+    }
+    w = malloc(sizeof(*w) + JW_SIZE);
+    if (w == NULL) {
+        gb_log(LOG_ERR, "No memory for a JSON body.");
+        return NULL;
+    }
+    w->buf = (char *)(w + 1);
+    pthread_setspecific(Buf_key, w);
+    My_buf = w;
+    return w;
+}
+
+/* Empty body on the buffer of the calling thread */
+jwBuf_t *jw_begin(void)
+{
+    jwBuf_t *w = jw_buf();
+
+    if (w == NULL) {
+        No_buf.len = 0;
+        No_buf.comma = false;
+        No_buf.full = true;
+        return &No_buf;
+    }
+    w->len = 0;
+    w->comma = false;
+    w->full = false;
+    return w;
+}
+
+/* The body, valid until the next jw_begin() of the thread. NULL if it did not fit. */
+const char *jw_end(jwBuf_t *w, size_t *len)
+{
+    if (w->full)
+        return NULL;
+    w->buf[w->len] = '\0';
+    *len = w->len;
+    return w->buf;
+}
+
+void jw_obj(jwBuf_t *w, const char *key)
+{
+    jw_key(w, key);
+    jw_putc(w, '{');
+    w->comma = false;
+    return;
+}
+
+void jw_obj_end(jwBuf_t *w)
+{
+    jw_putc(w, '}');
+    w->comma = true;
+    return;
+}
+
+void jw_arr(jwBuf_t *w, const char *key)
+{
+    jw_key(w, key);
+    jw_putc(w, '[');
+    w->comma = false;
+    return;
+}
+
+void jw_arr_end(jwBuf_t *w)
+{
+    jw_putc(w, ']');
+    w->comma = true;
+    return;
+}
+
+void jw_int(jwBuf_t *w, const char *key, long long value)
+{
+    char digits[24], *p = digits + sizeof(digits);
+    unsigned long long u = (value < 0) ? -(unsigned long long)value : (unsigned long long)value;
+
+    jw_key(w, key);
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (value < 0)
+        *--p = '-';
+    jw_put(w, p, digits + sizeof(digits) - p);
+    return;
+}
+
+void jw_bool(jwBuf_t *w, const char *key, bool value)
+{
+    jw_key(w, key);
+    if (value)
+        jw_put(w, "true", 4);
+    else
+        jw_put(w, "false", 5);
+    return;
+}
+
+void jw_str(jwBuf_t *w, const char *key, const char *s)
+{
+    jw_key(w, key);
+    if (s)
+        jw_string(w, s);
+    else
+        jw_put(w, "null", 4);
+    return;
+}
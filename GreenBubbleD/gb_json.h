@@ -0,0 +1,52 @@
+/*
+ * gb_json.h:
+ *	Json writer of the hot REST responses for the GreenBubble project
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef GB_JSON_H
+#define GB_JSON_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/***************** DEFINES & ENUMS *******************/
+
+#define JW_SIZE (128*1024)  //Largest body, /config with LD_MAX full spectrums is about 60 KB
+
+typedef struct {
+    size_t len;
+    bool comma;             //A value was written on this level, the next one needs a ','
+    bool full;              //Out of buffer, the body is dropped
+    char *buf;              //JW_SIZE bytes
+} jwBuf_t;
+
+/***************** FUNCTIONS *******************/
+
+// key is NULL in an array and at the top
+jwBuf_t *jw_begin(void);
+const char *jw_end(jwBuf_t *w, size_t *len);
+void jw_obj(jwBuf_t *w, const char *key);
+void jw_obj_end(jwBuf_t *w);
+void jw_arr(jwBuf_t *w, const char *key);
+void jw_arr_end(jwBuf_t *w);
+void jw_int(jwBuf_t *w, const char *key, long long value);
+void jw_bool(jwBuf_t *w, const char *key, bool value);
+void jw_str(jwBuf_t *w, const char *key, const char *s);
+
+#endif //GB_JSON_H
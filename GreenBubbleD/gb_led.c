@@ -19,12 +19,18 @@
  ***********************************************************************
  */
 
-#include <syslog.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <gb_main.h>
 #include <gb_serial.h>
+#include <gb_sched.h>
+#include <gb_regul.h>
+#include <gb_config.h>
+#include <gb_hal.h>
+#include <gb_log.h>
 
 
 /***************** INITS *******************/
@@ -32,160 +38,334 @@
 int ld_sys_init(void)
 {
     int ret = 0;
+    ldBoard_t ld;
 
-    // White: OSRAM GW CSSRM2.CM-M5M7-XX51-1
-    Gb_ld_sys[LD_WHITE].fwd_led_curr = 700; //mA
-    Gb_ld_sys[LD_WHITE].fwd_led_volt = 2800; //mV
-    Gb_ld_sys[LD_WHITE].numb_leds = 36;
-    Gb_ld_sys[LD_WHITE].wave_length = 6500; //kelvin
-    
-    // Blue: OSRAM GD CS8PM1.14-UOVJ-W4-1
-    Gb_ld_sys[LD_BLUE].fwd_led_curr = 350; //mA
-    Gb_ld_sys[LD_BLUE].fwd_led_volt = 2850; //mV
-    Gb_ld_sys[LD_BLUE].numb_leds = 6;
-    Gb_ld_sys[LD_BLUE].wave_length = 451; //nm
-
-    // Red: OSRAM GH CS8PM1.24-4T2U-1
-    Gb_ld_sys[LD_RED].fwd_led_curr = 350; //mA
-    Gb_ld_sys[LD_RED].fwd_led_volt = 2150; //mV
-    Gb_ld_sys[LD_RED].numb_leds = 6;
-    Gb_ld_sys[LD_RED].wave_length = 660; //nm
-
-    //Max and Min led device voltage
-    Gb_ld_sys[LD_WHITE].max_volt = 120000; //mv
-    Gb_ld_sys[LD_WHITE].min_volt = 40000; //mv (vin 36 + 4 for insurrance)
-    Gb_ld_sys[LD_BLUE].max_volt = 32000; //mv (vin 36 - 4 for insurrance)
-    Gb_ld_sys[LD_BLUE].min_volt = 0; //mv
-    Gb_ld_sys[LD_RED].max_volt = 32000; //mv (vin 36 - 4 for insurrance)
-    Gb_ld_sys[LD_RED].min_volt = 0; //mv
-
-
-    // WHITE: Get System and Confirm we have a correct color-device match
-    if (ld_get_system(LD_WHITE, &Gb_ld_sys[LD_WHITE]) != 0) {
-        Gb_ld_sys[LD_WHITE].device_ok = false;
-        ret = -1;
-    } else if ((strncmp(Gb_ld_sys[LD_WHITE].model, "BST900", 6) != 0) ||
-                (strncmp(Gb_ld_sys[LD_WHITE].name, "LED_WHITE", 9) != 0)) {
-        syslog(LOG_CRIT, "White Led Device's model or name does not match with the expected.");
-        Gb_ld_sys[LD_WHITE].device_ok = false;
-        ret = -2;
-    } else {
-        Gb_ld_sys[LD_WHITE].device_ok = true;
+    // Limits come with the registry, get System and confirm we have a correct channel-device match
+    FOR_EACH_LED(ld) {
+        if (ld_get_system(ld, &Gb_ld_sys[ld]) != 0) {
+            Gb_ld_sys[ld].device_ok = false;
+            ret = -1;
+        } else if ((strcmp(Gb_ld_sys[ld].model, Gb_ch.chan[ld].model) != 0) ||
+                    (strcmp(Gb_ld_sys[ld].name, Gb_ch.chan[ld].driver) != 0)) {
+            gb_log(LOG_CRIT, "Led Device %s: model or name does not match with the expected (%s %s).",
+                    Gb_ch.chan[ld].name, Gb_ch.chan[ld].model, Gb_ch.chan[ld].driver);
+            Gb_ld_sys[ld].device_ok = false;
+            if (ret == 0)
+                ret = -2;
+        } else {
+            Gb_ld_sys[ld].device_ok = true;
+        }
     }
 
-    // BLUE: Get System and Confirm we have a correct color-device match
-    if (ld_get_system(LD_BLUE, &Gb_ld_sys[LD_BLUE]) != 0) {
-        Gb_ld_sys[LD_BLUE].device_ok = false;
-        ret = -1;
-    } else if ((strncmp(Gb_ld_sys[LD_BLUE].model, "B6303", 5) != 0) ||
-                (strncmp(Gb_ld_sys[LD_BLUE].name, "LED_BLUE", 8) != 0)) {
-        syslog(LOG_CRIT, "Blue Led Device's model or name does not match with the expected.");
-        Gb_ld_sys[LD_BLUE].device_ok = false;
-        ret = -2;
-    } else {
-        Gb_ld_sys[LD_BLUE].device_ok = true;
+    return ret;
+}
+
+/***************** FUNCT *******************/
+
+#define DAY_MS (24*3600*1000)
+#define ROUT_RETRY_MS 10000 //Retry a failing led after 10s
+#define BP_MS(spec, i) ((long long)(spec)->minute[i]*60*1000)
+
+// The main loop and the job worker can both run the routine, the lock serializes them.
+// Spec_hint is the segment of the last routine evaluation of each led, only touched under
+// Rout_lock. The routine moves forward in time, so it is almost always the same or the next.
+static pthread_mutex_t Rout_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned short Spec_hint[LD_MAX];
+// Segments of the next change search, only used by the routine timer on the event loop
+static unsigned short Tick_hint[LD_MAX];
+
+static int Routine_timer = -1;
+
+/*
+ * Breakpoints (t0, y0) and (t1, y1) around t, for a spectrum with 2 or more breakpoints.
+ * Before the first and after the last breakpoint it goes around midnight.
+ * The segment is found from the hint (O(1) while time goes forward) or by binary search.
+ */
+static void ld_spec_segment(const ldSpec_t *spec, unsigned short *hint, long long t,
+        long long *t0, long long *t1, long long *y0, long long *y1)
+{
+    unsigned int n = spec->n, i = *hint, lo, hi, mid;
+
+    if ((t < BP_MS(spec, 0)) || (t >= BP_MS(spec, n-1))) {
+        //From the last breakpoint to the first one, around midnight
+        *t0 = BP_MS(spec, n-1) - ((t < BP_MS(spec, 0)) ? DAY_MS : 0);
+        *t1 = BP_MS(spec, 0) + ((t < BP_MS(spec, 0)) ? 0 : DAY_MS);
+        *y0 = spec->perc[n-1];
+        *y1 = spec->perc[0];
+        return;
     }
 
-    // RED: Get System and Confirm we have a correct color-device match
-    if (ld_get_system(LD_RED, &Gb_ld_sys[LD_RED]) != 0) {
-        Gb_ld_sys[LD_RED].device_ok = false;
-        ret = -1;
-    } else if ((strncmp(Gb_ld_sys[LD_RED].model, "B6303", 5) != 0) ||
-                (strncmp(Gb_ld_sys[LD_RED].name, "LED_RED", 7) != 0)) {
-        syslog(LOG_CRIT, "Red Led Device's model or name does not match with the expected.");
-        Gb_ld_sys[LD_RED].device_ok = false;
-        ret = -2;
-    } else {
-        Gb_ld_sys[LD_RED].device_ok = true;
+    if ((i >= n-1) || (t < BP_MS(spec, i)) || (t >= BP_MS(spec, i+1))) {
+        if ((i+2 < n) && (t >= BP_MS(spec, i+1)) && (t < BP_MS(spec, i+2)))
+            i++;
+        else {
+            //Largest i with breakpoint i <= t, we know bp 0 <= t < bp n-1
+            lo = 0;
+            hi = n-1;
+            while (hi - lo > 1) {
+                mid = lo + (hi - lo)/2;
+                if (BP_MS(spec, mid) <= t)
+                    lo = mid;
+                else
+                    hi = mid;
+            }
+            i = lo;
+        }
+        *hint = i;
     }
+    *t0 = BP_MS(spec, i);
+    *t1 = BP_MS(spec, i+1);
+    *y0 = spec->perc[i];
+    *y1 = spec->perc[i+1];
+    return;
+}
 
-    return ret;
+/*
+ * Intensity of a spectrum at any time of the day, in Q16 percentage.
+ * Straight line between the two breakpoints around ms_of_day, computed in fixed point.
+ */
+unsigned int ld_spec_eval(const ldSpec_t *spec, unsigned short *hint, unsigned int ms_of_day)
+{
+    long long t = ms_of_day % DAY_MS, t0, t1, y0, y1;
+
+    if (spec->n == 0) return 0;
+    if (spec->n == 1) return (unsigned int)spec->perc[0] << ROUT_FRAC;
+
+    ld_spec_segment(spec, hint, t, &t0, &t1, &y0, &y1);
+
+    if (t1 <= t0)
+        return (unsigned int)(y1 << ROUT_FRAC);
+
+    //y1 - y0 is negative on a falling ramp, it is scaled by a multiplication and not a shift
+    return (unsigned int)((y0 << ROUT_FRAC) + ((y1 - y0)*(1LL << ROUT_FRAC)*(t - t0))/(t1 - t0));
 }
 
-/***************** FUNCT *******************/
+/*
+ * Time (ms from the start of today, can go past the day) when the routine current of
+ * this led changes by one driver step after ms_of_day. The ramp is a straight line, so
+ * it is solved directly: no periodic polling while the light is steady.
+ */
+static long long ld_routine_next_change(const gbCfg_t *cfg, ldBoard_t color, unsigned short *hint,
+        unsigned int ms_of_day)
+{
+    const ldSpec_t *spec = &cfg->ld_spec[color];
+    unsigned long long fwd = Gb_ld_sys[color].fwd_led_curr;
+    long long t = ms_of_day % DAY_MS, t0, t1, y0, y1, yq, level, bound, target, dist, slope, next;
+
+    if ((spec->n < 2) || (fwd == 0))
+        return -1; //Constant
 
-void ld_daily_routine(bool update_now)
+    ld_spec_segment(spec, hint, t, &t0, &t1, &y0, &y1);
+    if ((y0 == y1) || (t1 <= t0))
+        return ms_of_day + (t1 - t); //Flat until the next breakpoint
+
+    //Current level now, then the Q16 percentage where it rounds to the next level
+    yq = ld_spec_eval(spec, hint, ms_of_day);
+    level = ((fwd*yq)/100 + ((LD_CURR_STEP << ROUT_FRAC)/2)) / (LD_CURR_STEP << ROUT_FRAC);
+    if (y1 > y0) {
+        bound = (((2*level + 1)*LD_CURR_STEP) << ROUT_FRAC)/2;
+        target = (bound*100 + fwd - 1)/fwd;
+    } else if (level > 0) {
+        bound = (((2*level - 1)*LD_CURR_STEP) << ROUT_FRAC)/2;
+        target = (bound*100 + fwd - 1)/fwd - 1;
+    } else
+        return ms_of_day + (t1 - t);
+
+    //First time the line reaches target, rounded up
+    dist = llabs(target - (y0 << ROUT_FRAC));
+    slope = llabs(y1 - y0)*(1LL << ROUT_FRAC);
+    next = t0 + (dist*(t1 - t0) + slope - 1)/slope;
+    if (next <= t)
+        next = t + 1;
+    else if (next > t1)
+        next = t1;
+
+    return ms_of_day + (next - t);
+}
+
+/* Routine intensity of a led at any time of the day, in Q16 percentage */
+unsigned int ld_routine_eval(const gbCfg_t *cfg, ldBoard_t color, unsigned int ms_of_day)
 {
-    time_t t = time(NULL);
-    struct tm tmt = *localtime(&t);
-    int mins_of_day = tmt.tm_hour*60 + tmt.tm_min;
-    int ret = 0;
-    unsigned char i = 0, ld;
-    static int latest_mins = -1;
+    unsigned short hint = 0; //Own hint, the shared ones belong to the routine
+
+    if (color >= Gb_ch.numb) return 0;
+    return ld_spec_eval(&cfg->ld_spec[color], &hint, ms_of_day);
+}
+
+static unsigned int ld_ms_of_day(long long now)
+{
+    time_t sec = now / 1000000000LL;
+    struct tm tmt;
+
+    localtime_r(&sec, &tmt);
+    return (tmt.tm_hour*3600 + tmt.tm_min*60 + tmt.tm_sec)*1000 + (now % 1000000000LL)/SCHED_MS;
+}
+
+/*
+ * Called by the routine timer when the current of a led is due to change. The intensity
+ * is evaluated and a led only gets a new current when it moved by one step of the driver
+ * (LD_CURR_STEP). The dimming is smooth and the serial bus only carries the real changes.
+ */
+int ld_daily_routine(bool update_now)
+{
+    static int latest_ret;
+    const gbCfg_t *cfg = cfg_hold(); //The same config for all the leds of this step
+    unsigned int ms_of_day, curr;
+    int ret = 0, len = 0;
+    bool changed = false;
+    char line[LD_MAX*24];
+    ldBoard_t ld;
 
     //Only run the routine if we are in this mode
-    if (Gb_cfg.ld_instant_mode == true)
-        return;
+    if (cfg->ld_instant_mode == true) {
+        cfg_release(cfg);
+        return 0;
+    }
 
-    //Check if routine was generated
-    if (Gb_cfg.ld_routine_init == false)
-        return;
+    ms_of_day = ld_ms_of_day(sched_now());
 
-    //Update lights each TIME_LD min
-    if(((latest_mins != mins_of_day) & (mins_of_day%TIME_LD == 0)) || update_now) {
-  
-        //Get the value to be applied for this time and limit to 100% for protection
-        i = mins_of_day/TIME_LD;
-        if (i > ROUT_TOT) {
-           ret |= 1;
-           i = ROUT_TOT;
-        }
+    pthread_mutex_lock(&Rout_lock);
 
-        FOR_EACH_LED(ld) {
-            if (Gb_cfg.init_volt_applied[ld]) {
-                if (ld_set_current(ld, get_curr_from_perc(ld, Gb_cfg.ld_routine_perc[ld][i])) < 0)
-                    ret |= (2 << ld);
-                else if (Gb_sts.ld_sts[ld].enable == false) //routine is not contrlled by instant
-                    if (ld_set_output(ld, true))
-                        ret |= (2 << ld);
-            } else
+    FOR_EACH_LED(ld) {
+        Gb_ch.routine[ld] = ld_spec_eval(&cfg->ld_spec[ld], &Spec_hint[ld], ms_of_day);
+        Gb_ch.target[ld] = get_curr_from_perc_q(ld, Gb_ch.routine[ld]);
+        curr = regul_curr(ld, Gb_ch.target[ld]);
+
+        //The registry setpoint is the last current accepted by the driver, a failed led is retried
+        if (!update_now && (Gb_ch.setpoint_ok & (1 << ld)) && (Gb_ch.setpoint[ld] == curr))
+            continue;
+        changed = true;
+
+        if (Gb_ch.volt_ok & (1 << ld)) {
+            if (ld_set_current(ld, curr) < 0)
                 ret |= (2 << ld);
-        }
-        
-        debug("Led Routine set intensity to: [%i] W:%i B:%i R:%i.\n", i,
-                Gb_cfg.ld_routine_perc[LD_WHITE][i],
-                Gb_cfg.ld_routine_perc[LD_BLUE][i],
-                Gb_cfg.ld_routine_perc[LD_RED][i]);
-        syslog(LOG_INFO, "Led Routine set intensity to: [%i] W:%i B:%i R:%i.", i,
-                ((ret && 2) ? -1 : Gb_cfg.ld_routine_perc[LD_WHITE][i]),
-                ((ret && 4) ? -1 : Gb_cfg.ld_routine_perc[LD_BLUE][i]),
-                ((ret && 8) ? -1 : Gb_cfg.ld_routine_perc[LD_RED][i]));
-        if(ret)
-            syslog(LOG_ERR, "Error setting routine led intensity: %i", ret);
-        
-        latest_mins = mins_of_day;
+            else if (Gb_sts.ld_sts[ld].enable == false) //routine is not contrlled by instant
+                if (ld_set_output(ld, true))
+                    ret |= (2 << ld);
+        } else
+            ret |= (2 << ld);
     }
-    
+
+    if (changed) {
+        FOR_EACH_LED(ld)
+            len += snprintf(line + len, sizeof(line) - len, " %s:%i", Gb_ch.chan[ld].name,
+                    ((ret & (2 << ld)) ? -1 : (int)(Gb_ch.routine[ld] >> ROUT_FRAC)));
+        debug("Led Routine set intensity to: [%u ms]%s.\n", ms_of_day, line);
+        gb_log(LOG_INFO, "Led Routine set intensity to:%s.", line);
+    }
+
+    //Do not repeat the same error each second while a led is failing
+    if (ret && (ret != latest_ret))
+        gb_log(LOG_ERR, "Error setting routine led intensity: %i", ret);
+    latest_ret = ret;
+
+    pthread_mutex_unlock(&Rout_lock);
+    cfg_release(cfg);
+
+    return ret;
+}
+
+/* Routine timer: apply the routine and sleep until the next current change */
+static long long ld_routine_tick(void *arg, long long now)
+{
+    const gbCfg_t *cfg;
+    long long next = -1, change;
+    unsigned int ms_of_day;
+    ldBoard_t ld;
+    int ret;
+
+    ret = ld_daily_routine(false);
+
+    //Nothing to do until a spectrum job wakes it up again
+    cfg = cfg_hold();
+    if (cfg->ld_instant_mode == true) {
+        cfg_release(cfg);
+        return 0;
+    }
+
+    ms_of_day = ld_ms_of_day(now);
+    FOR_EACH_LED(ld) {
+        change = ld_routine_next_change(cfg, ld, &Tick_hint[ld], ms_of_day);
+        if ((change >= 0) && ((next < 0) || (change < next)))
+            next = change;
+    }
+    cfg_release(cfg);
+
+    //Constant spectrum: check again at the end of the day
+    if (next < 0)
+        next = DAY_MS;
+
+    //A failing led is retried, but not each time the others change
+    if (ret && (next > ms_of_day + ROUT_RETRY_MS))
+        next = ms_of_day + ROUT_RETRY_MS;
+
+    return now + (next - ms_of_day)*SCHED_MS;
+}
+
+void ld_routine_sched_init(void)
+{
+    Routine_timer = sched_add("routine", ld_routine_tick, NULL, sched_now(), SCHED_F_CLOCK);
+    return;
+}
+
+/* Apply the routine now, ex. after the spectrum or the mode changed */
+void ld_routine_wakeup(void)
+{
+    sched_set(Routine_timer, sched_now());
     return;
 }
 
-void ld_generate_points(void)
+/*
+ * Daemon stopping: leave the drivers in the safe state of the config, one driver at a time
+ * until deadline (CLOCK_REALTIME ns of the system). Returns -1 if a driver was not reached.
+ */
+int ld_shutdown(const gbCfg_t *cfg, long long deadline)
+{
+    ldBoard_t ld;
+    int ret = 0;
+
+    if (cfg->shutdown_leds == SHUTDOWN_KEEP)
+        return 0;
+
+    FOR_EACH_LED(ld) {
+        if (hal_sys_clock_ns(CLOCK_REALTIME) >= deadline) {
+            gb_log(LOG_WARNING, "Out of time to stop, Led %s and the next ones keep their light.", Gb_ch.chan[ld].name);
+            return -1;
+        }
+
+        if (cfg->shutdown_leds == SHUTDOWN_OFF) {
+            if (ld_set_output(ld, false) < 0)
+                ret = -1;
+        } else if ((ld_set_voltage(ld, cfg->ld_instant[ld].vset) < 0) ||
+                (ld_set_current(ld, cfg->ld_instant[ld].cset) < 0) ||
+                (ld_set_output(ld, cfg->ld_instant[ld].enable && cfg->ld_instant[ld].cset) < 0))
+            ret = -1;
+
+        //Not what the routine or the instant config asked: the next start sends it again
+        LD_BIT_CLR(Gb_ch.setpoint_ok, ld);
+    }
+
+    if (ret)
+        gb_log(LOG_ERR, "Error leaving the leds %s.", cfg_shutdown_str(cfg->shutdown_leds));
+    return ret;
+}
+
+
+/* Sample the routine each TIME_LD into ld_routine_perc, a coarse view of the day */
+void ld_generate_points(gbCfg_t *cfg)
 {
-    unsigned char color, s, n;
+    ldBoard_t color;
+    unsigned short hint;
     int point;
-    float ystep, curve;
 
     FOR_EACH_LED(color) {
-        point = -1;
         debug("\n\n");
-        for (s = 1; s < ROUT_STEP; s++) {
-            point++;
-            ystep = ((float)Gb_cfg.ld_spec[color][s] - (float)Gb_cfg.ld_spec[color][s-1])/ROUT_N;
-            curve = Gb_cfg.ld_spec[color][s-1];
-            Gb_cfg.ld_routine_perc[color][point] = curve;
-            debug("[%i] %d, ", point, Gb_cfg.ld_routine_perc[color][point]);
-            for (n = 1; n < ROUT_N; n++) {
-                point++;
-                curve += ystep;
-                Gb_cfg.ld_routine_perc[color][point] = curve;  
-                debug("[%i] %d, ", point, Gb_cfg.ld_routine_perc[color][point]);
-            }
+        hint = 0;
+        for (point = 0; point < ROUT_TOT; point++) {
+            cfg->ld_routine_perc[color][point] = ld_spec_eval(&cfg->ld_spec[color], &hint, point*TIME_LD*60*1000) >> ROUT_FRAC;
+            debug("[%i] %d, ", point, cfg->ld_routine_perc[color][point]);
         }
     }
     debug("\n\n");
-    
-    Gb_cfg.ld_routine_init = true;
     return;
 }
-
-
@@ -24,8 +24,13 @@
 
 
 /***************** FUNCTIONS *******************/
-void ld_daily_routine(bool update_now);
+int ld_daily_routine(bool update_now);
 int ld_sys_init(void);
-void ld_generate_points(void);
+void ld_generate_points(gbCfg_t *cfg);
+void ld_routine_sched_init(void);
+void ld_routine_wakeup(void);
+int ld_shutdown(const gbCfg_t *cfg, long long deadline);
+unsigned int ld_spec_eval(const ldSpec_t *spec, unsigned short *hint, unsigned int ms_of_day);
+unsigned int ld_routine_eval(const gbCfg_t *cfg, ldBoard_t color, unsigned int ms_of_day);
 
 #endif //GB_LED_H
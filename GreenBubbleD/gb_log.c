@@ -0,0 +1,474 @@
+/*
+ * gb_log.c:
+ *	Asynchronous logging for the GreenBubble project
+ *	A log call does not format anything: it copies the format pointer and its
+ *	arguments, by type, into a slot of a lock-free ring (a sequence number per
+ *	slot, the writers take slots with a CAS). The gb_log thread formats the
+ *	records and does the syslog or stderr output, the serial, REST and routine
+ *	paths never wait on it. With the ring full a record is dropped and counted.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+
+#include <gb_log.h>
+
+#define LOG_IDLE_MS 20   //The writer looks at the ring at least this often
+#define LOG_LINE    1024
+#define LOG_SLOT(pos) ((pos) & (LOG_SLOTS - 1))
+
+typedef struct {
+    unsigned long seq;      //Less the slot index: free for the writer of position seq, record of seq-1 ready
+    const char *fmt;
+    unsigned char level;
+    unsigned char cut;      //Arguments did not fit
+    unsigned short len;     //Bytes of args
+    unsigned char args[LOG_ARG_BYTES];
+} logRec_t;
+
+/* What a conversion of the format takes */
+typedef enum {
+    ARG_END = 0,
+    ARG_NONE,       //"%%"
+    ARG_INT,
+    ARG_UINT,
+    ARG_DOUBLE,
+    ARG_STR,
+    ARG_PTR
+} logArg_t;
+
+int Log_level = LOG_LEVEL_DFLT;
+
+static logRec_t Ring[LOG_SLOTS];
+static unsigned long Enq;           //Next position for a writer
+static unsigned long Deq;           //Next position for the thread, only it moves it
+static unsigned long Written, Dropped, Cut;
+static int Wake_fd = -1;
+static bool Wake_sent;
+static bool Stop;
+static bool Running;
+static pthread_t Writer;
+
+static const char *Level_names[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+
+/***************** FORMAT *******************/
+
+/*
+ * Next conversion of the format at *p: the text before it is [*p, lit_end), spec gets the
+ * conversion ("%08.2f", empty if there is none) and len its length modifier (0, 'l', 'L' for ll, 'z').
+ */
+static logArg_t log_next(const char **p, const char **lit_end, char *spec, size_t spec_size, char *len)
+{
+    const char *s = *p, *c;
+    logArg_t arg;
+    size_t n;
+
+    spec[0] = '\0';
+    while (*s && (*s != '%'))
+        s++;
+    *lit_end = s;
+    if (*s == '\0') {
+        *p = s;
+        return ARG_END;
+    }
+
+    c = s + 1;
+    while (*c && strchr("-+ #0123456789.", *c))
+        c++;
+    *len = 0;
+    if ((c[0] == 'l') && (c[1] == 'l')) {
+        *len = 'L';
+        c += 2;
+    } else if ((*c == 'l') || (*c == 'z')) {
+        *len = *c++;
+    } else {
+        while (*c == 'h')
+            c++;
+    }
+
+    switch (*c) {
+        case 'd': case 'i': case 'c':
+            arg = ARG_INT;
+            break;
+        case 'u': case 'x': case 'X': case 'o':
+            arg = ARG_UINT;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+            arg = ARG_DOUBLE;
+            break;
+        case 's':
+            arg = ARG_STR;
+            break;
+        case 'p':
+            arg = ARG_PTR;
+            break;
+        case '%':
+            arg = ARG_NONE;
+            break;
+        default: //Unknown or cut: printed as it is
+            *p = *lit_end = (*c ? c + 1 : c);
+            return ARG_NONE;
+    }
+
+    n = c + 1 - s;
+    if (n >= spec_size)
+        n = spec_size - 1;
+    memcpy(spec, s, n);
+    spec[n] = '\0';
+    *p = c + 1;
+    return arg;
+}
+
+/* Writer side: the arguments of fmt into the record */
+static void log_pack(logRec_t *r, const char *fmt, va_list ap)
+{
+    const char *p = fmt, *lit;
+    char spec[32], len;
+    unsigned long long u;
+    long long i;
+    double d;
+    void *ptr;
+    const char *str;
+    unsigned short n;
+    logArg_t arg;
+
+    r->len = 0;
+    r->cut = 0;
+    while ((arg = log_next(&p, &lit, spec, sizeof(spec), &len)) != ARG_END) {
+        switch (arg) {
+            case ARG_INT:
+                i = (len == 'L') ? va_arg(ap, long long) : (len == 'l') ? va_arg(ap, long) :
+                    (len == 'z') ? va_arg(ap, ssize_t) : va_arg(ap, int);
+                if (r->len + sizeof(i) > LOG_ARG_BYTES)
+                    goto cut;
+                memcpy(r->args + r->len, &i, sizeof(i));
+                r->len += sizeof(i);
+                break;
+            case ARG_UINT:
+                u = (len == 'L') ? va_arg(ap, unsigned long long) : (len == 'l') ? va_arg(ap, unsigned long) :
+                    (len == 'z') ? va_arg(ap, size_t) : va_arg(ap, unsigned int);
+                if (r->len + sizeof(u) > LOG_ARG_BYTES)
+                    goto cut;
+                memcpy(r->args + r->len, &u, sizeof(u));
+                r->len += sizeof(u);
+                break;
+            case ARG_DOUBLE:
+                d = va_arg(ap, double);
+                if (r->len + sizeof(d) > LOG_ARG_BYTES)
+                    goto cut;
+                memcpy(r->args + r->len, &d, sizeof(d));
+                r->len += sizeof(d);
+                break;
+            case ARG_PTR:
+                ptr = va_arg(ap, void *);
+                if (r->len + sizeof(ptr) > LOG_ARG_BYTES)
+                    goto cut;
+                memcpy(r->args + r->len, &ptr, sizeof(ptr));
+                r->len += sizeof(ptr);
+                break;
+            case ARG_STR:
+                str = va_arg(ap, const char *);
+                if (str == NULL)
+                    str = "(null)";
+                if (r->len + sizeof(n) > LOG_ARG_BYTES)
+                    goto cut;
+                n = strnlen(str, LOG_ARG_BYTES - r->len - sizeof(n));
+                memcpy(r->args + r->len, &n, sizeof(n));
+                memcpy(r->args + r->len + sizeof(n), str, n);
+                r->len += sizeof(n) + n;
+                break;
+            default:
+                break;
+        }
+    }
+    return;
+
+cut:
+    r->cut = 1;
+    return;
+}
+
+/* Thread side: the record as text */
+static void log_format(const logRec_t *r, char *line, size_t size)
+{
+    const char *p = r->fmt, *start, *lit;
+    size_t out = 0, off = 0;
+    char spec[32], len;
+    unsigned long long u;
+    long long i;
+    double d;
+    void *ptr;
+    unsigned short n;
+    char str[LOG_ARG_BYTES];
+    logArg_t arg;
+    bool cut = false;
+    int w = 0;
+
+    line[0] = '\0';
+    for (;;) {
+        start = p;
+        arg = log_next(&p, &lit, spec, sizeof(spec), &len);
+        if ((size_t)(lit - start) >= size - out)
+            lit = start + (size - out - 1);
+        memcpy(line + out, start, lit - start);
+        out += lit - start;
+        line[out] = '\0';
+        if (arg == ARG_END)
+            break;
+
+        if (((arg == ARG_INT) || (arg == ARG_UINT) || (arg == ARG_DOUBLE)) && (off + 8 > r->len))
+            arg = ARG_END;
+        if ((arg == ARG_PTR) && (off + sizeof(ptr) > r->len))
+            arg = ARG_END;
+        if ((arg == ARG_STR) && (off + sizeof(n) > r->len))
+            arg = ARG_END;
+
+        switch (arg) {
+            case ARG_END: //Arguments cut, the text of the format goes on
+                w = cut ? 0 : snprintf(line + out, size - out, "...");
+                cut = true;
+                break;
+            case ARG_NONE:
+                w = ((spec[0] == '%') && (spec[1] == '%')) ? snprintf(line + out, size - out, "%%") : 0;
+                break;
+            case ARG_INT:
+                memcpy(&i, r->args + off, sizeof(i));
+                off += sizeof(i);
+                w = (len == 'L') ? snprintf(line + out, size - out, spec, i) :
+                    (len == 'l') ? snprintf(line + out, size - out, spec, (long)i) :
+                    (len == 'z') ? snprintf(line + out, size - out, spec, (ssize_t)i) :
+                    snprintf(line + out, size - out, spec, (int)i);
+                break;
+            case ARG_UINT:
+                memcpy(&u, r->args + off, sizeof(u));
+                off += sizeof(u);
+                w = (len == 'L') ? snprintf(line + out, size - out, spec, u) :
+                    (len == 'l') ? snprintf(line + out, size - out, spec, (unsigned long)u) :
+                    (len == 'z') ? snprintf(line + out, size - out, spec, (size_t)u) :
+                    snprintf(line + out, size - out, spec, (unsigned int)u);
+                break;
+            case ARG_DOUBLE:
+                memcpy(&d, r->args + off, sizeof(d));
+                off += sizeof(d);
+                w = snprintf(line + out, size - out, spec, d);
+                break;
+            case ARG_PTR:
+                memcpy(&ptr, r->args + off, sizeof(ptr));
+                off += sizeof(ptr);
+                w = snprintf(line + out, size - out, spec, ptr);
+                break;
+            case ARG_STR:
+                memcpy(&n, r->args + off, sizeof(n));
+                off += sizeof(n);
+                if (n > r->len - off)
+                    n = r->len - off;
+                memcpy(str, r->args + off, n);
+                str[n] = '\0';
+                off += n;
+                w = snprintf(line + out, size - out, spec, str);
+                break;
+        }
+        if (w > 0)
+            out = ((size_t)w < size - out) ? out + w : size - 1;
+        if (out == size - 1)
+            break;
+    }
+    return;
+}
+
+/***************** RING *******************/
+
+void log_write(int level, const char *fmt, ...)
+{
+    unsigned long pos, seq;
+    logRec_t *r;
+    va_list ap;
+    long diff;
+
+    pos = __atomic_load_n(&Enq, __ATOMIC_RELAXED);
+    for (;;) {
+        r = &Ring[LOG_SLOT(pos)];
+        seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) + LOG_SLOT(pos);
+        diff = (long)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&Enq, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_add_fetch(&Dropped, 1, __ATOMIC_RELAXED); //Full
+            return;
+        } else {
+            pos = __atomic_load_n(&Enq, __ATOMIC_RELAXED);
+        }
+    }
+
+    r->fmt = fmt;
+    r->level = level;
+    va_start(ap, fmt);
+    log_pack(r, fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&r->seq, pos + 1 - LOG_SLOT(pos), __ATOMIC_RELEASE);
+
+    //Half full: wake the thread now rather than on its next look, once
+    if ((pos - __atomic_load_n(&Deq, __ATOMIC_RELAXED) >= LOG_SLOTS/2) && (Wake_fd >= 0) &&
+            !__atomic_exchange_n(&Wake_sent, true, __ATOMIC_RELAXED))
+        eventfd_write(Wake_fd, 1);
+    return;
+}
+
+/* Output of the records ready, in order. Returns how many. */
+static unsigned int log_drain(void)
+{
+    char line[LOG_LINE];
+    unsigned int n = 0;
+    logRec_t *r;
+
+    for (;;) {
+        r = &Ring[LOG_SLOT(Deq)];
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) + LOG_SLOT(Deq) != Deq + 1)
+            break;
+
+        log_format(r, line, sizeof(line));
+        if (r->cut)
+            __atomic_add_fetch(&Cut, 1, __ATOMIC_RELAXED);
+        if (r->level == LOG_DEBUG)
+            fputs(line, stderr);
+        else
+            syslog(r->level, "%s", line);
+
+        __atomic_store_n(&r->seq, Deq + LOG_SLOTS - LOG_SLOT(Deq), __ATOMIC_RELEASE);
+        __atomic_store_n(&Deq, Deq + 1, __ATOMIC_RELAXED);
+        n++;
+    }
+    __atomic_add_fetch(&Written, n, __ATOMIC_RELAXED);
+    return n;
+}
+
+static void *log_thread(void *arg)
+{
+    struct pollfd pfd = { .fd = Wake_fd, .events = POLLIN };
+    unsigned long dropped = 0, now;
+    eventfd_t v;
+
+    for (;;) {
+        log_drain();
+        fflush(stderr);
+
+        now = __atomic_load_n(&Dropped, __ATOMIC_RELAXED);
+        if (now != dropped) {
+            syslog(LOG_WARNING, "Log ring full, %lu records dropped.", now - dropped);
+            dropped = now;
+        }
+
+        if (__atomic_load_n(&Stop, __ATOMIC_ACQUIRE)) {
+            log_drain();
+            break;
+        }
+        if (poll(&pfd, 1, LOG_IDLE_MS) > 0) {
+            eventfd_read(Wake_fd, &v);
+            __atomic_store_n(&Wake_sent, false, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/***************** API *******************/
+
+/* The records written before are kept and go out once the thread runs. An exit() drains the ring too. */
+int log_init(void)
+{
+    sigset_t all, old;
+    int ret;
+
+    Wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (Wake_fd < 0)
+        return -1;
+
+    // Started before the signals are blocked for the signalfd: it must never take one
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&Writer, NULL, log_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0) {
+        syslog(LOG_ERR, "Unable to start the log thread.");
+        close(Wake_fd);
+        Wake_fd = -1;
+        return -1;
+    }
+    pthread_setname_np(Writer, "gb_log");
+    Running = true;
+    atexit(log_stop);
+    return 0;
+}
+
+/* Daemon stopping: out with everything written so far */
+void log_stop(void)
+{
+    if (!Running)
+        return;
+    __atomic_store_n(&Stop, true, __ATOMIC_RELEASE);
+    eventfd_write(Wake_fd, 1);
+    pthread_join(Writer, NULL);
+    Running = false;
+    return;
+}
+
+void log_set_level(int level)
+{
+    if ((level < LOG_EMERG) || (level > LOG_DEBUG))
+        return;
+    __atomic_store_n(&Log_level, level, __ATOMIC_RELAXED);
+    gb_log(LOG_NOTICE, "Log level %s.", log_level_str(level));
+    return;
+}
+
+int log_level_parse(const char *str)
+{
+    int i;
+
+    for (i = LOG_EMERG; i <= LOG_DEBUG; i++)
+        if (str && !strcmp(str, Level_names[i]))
+            return i;
+    return -1;
+}
+
+const char *log_level_str(int level)
+{
+    return ((level >= LOG_EMERG) && (level <= LOG_DEBUG)) ? Level_names[level] : "?";
+}
+
+json_t *log_to_json(void)
+{
+    return json_pack("{sssssIsIsIsI}",
+            "level", log_level_str(__atomic_load_n(&Log_level, __ATOMIC_RELAXED)),
+            "compiled", log_level_str(LOG_LEVEL_MAX),
+            "written", (json_int_t)__atomic_load_n(&Written, __ATOMIC_RELAXED),
+            "dropped", (json_int_t)__atomic_load_n(&Dropped, __ATOMIC_RELAXED),
+            "cut", (json_int_t)__atomic_load_n(&Cut, __ATOMIC_RELAXED),
+            "waiting", (json_int_t)(__atomic_load_n(&Enq, __ATOMIC_RELAXED) - __atomic_load_n(&Deq, __ATOMIC_RELAXED)));
+}
@@ -0,0 +1,59 @@
+/*
+ * gb_log.h:
+ *	Asynchronous logging for the GreenBubble project
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef GB_LOG_H
+#define GB_LOG_H
+
+#include <syslog.h>
+#include <jansson.h>
+
+/***************** DEFINES & ENUMS *******************/
+
+// Levels are the syslog ones. Above LOG_LEVEL_MAX the calls are not compiled in (make LOG_MAX=LOG_INFO).
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_DEBUG
+#endif
+
+#define LOG_LEVEL_DFLT LOG_INFO //Run time level without -l
+#define LOG_SLOTS      2048     //Records waiting for the writer thread, power of 2
+#define LOG_ARG_BYTES  224      //Arguments of a record, longer strings are cut
+
+extern int Log_level;
+
+/*
+ * Formats must be static strings, only the pointer is kept: the arguments are stored
+ * by type and formatted later by the writer thread. No "*" width or precision.
+ * LOG_DEBUG goes to stderr as is (a line can be made of several calls), the others to syslog.
+ */
+#define gb_log(level, fmt, ...) \
+            do { if (((level) <= LOG_LEVEL_MAX) && ((level) <= __atomic_load_n(&Log_level, __ATOMIC_RELAXED))) \
+                    log_write((level), fmt, ##__VA_ARGS__); } while (0)
+
+/***************** FUNCTIONS *******************/
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int log_init(void);
+void log_stop(void);
+void log_set_level(int level);
+int log_level_parse(const char *str);
+const char *log_level_str(int level);
+json_t *log_to_json(void);
+
+#endif //GB_LOG_H
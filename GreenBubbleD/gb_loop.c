@@ -0,0 +1,226 @@
+/*
+ * gb_loop.c:
+ *	Event loop of the control plane for the GreenBubble project
+ *	Every fd the daemon waits on (timers, signals, config watch) is registered
+ *	here with its handler and the main thread sleeps in a single epoll_wait.
+ *	Each handler is accounted for how long it kept the loop busy.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <gb_loop.h>
+#include <gb_main.h>
+#include <gb_trace.h>
+#include <gb_log.h>
+
+#define LOOP_EVENTS 8 //Ready fds taken per epoll_wait
+
+static loopHandler_t Handlers[LOOP_MAX];
+static int Handlers_numb;
+static int Efd = -1;
+static int Stop_fd = -1;
+static bool Stop;
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long loop_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* loop_stop() from another thread or a handler */
+static void loop_wake(int fd, uint32_t events, void *arg)
+{
+    uint64_t val;
+
+    if (read(fd, &val, sizeof(val)) < 0)
+        return;
+    Stop = true;
+    return;
+}
+
+/***************** API *******************/
+
+int loop_init(void)
+{
+    Efd = epoll_create1(EPOLL_CLOEXEC);
+    Stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if ((Efd < 0) || (Stop_fd < 0)) {
+        gb_log(LOG_CRIT, "Unable to create the event loop: %s", strerror(errno));
+        return -1;
+    }
+    if (loop_add("stop", Stop_fd, EPOLLIN, loop_wake, NULL) < 0)
+        return -1;
+    return 0;
+}
+
+/* Register the handler of a fd, returns its id */
+int loop_add(const char *name, int fd, uint32_t events, loopFn_t fn, void *arg)
+{
+    struct epoll_event ev;
+    int id;
+
+    pthread_mutex_lock(&Lock);
+    if (Handlers_numb >= LOOP_MAX) {
+        pthread_mutex_unlock(&Lock);
+        gb_log(LOG_ERR, "Too many event handlers, %s not added.", name);
+        return -1;
+    }
+
+    id = Handlers_numb;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u32 = id;
+    if (epoll_ctl(Efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        pthread_mutex_unlock(&Lock);
+        gb_log(LOG_ERR, "Unable to add the %s event handler: %s", name, strerror(errno));
+        return -1;
+    }
+
+    memset(&Handlers[id], 0, sizeof(Handlers[id]));
+    Handlers[id].name = name;
+    Handlers[id].fd = fd;
+    Handlers[id].fn = fn;
+    Handlers[id].arg = arg;
+    Handlers_numb++;
+    pthread_mutex_unlock(&Lock);
+
+    return id;
+}
+
+/* Stop waiting on the fd of a handler, before it is closed. Its statistics are kept. */
+void loop_del(int id)
+{
+    if ((id < 0) || (id >= Handlers_numb))
+        return;
+
+    pthread_mutex_lock(&Lock);
+    if (Handlers[id].fd >= 0) {
+        epoll_ctl(Efd, EPOLL_CTL_DEL, Handlers[id].fd, NULL);
+        Handlers[id].fd = -1;
+    }
+    pthread_mutex_unlock(&Lock);
+    return;
+}
+
+/* Wait on other events of a handler, or move it to a new fd (a socket opened again). Its id and statistics stay. */
+int loop_mod(int id, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+    int ret;
+
+    if ((id < 0) || (id >= Handlers_numb))
+        return -1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u32 = id;
+    pthread_mutex_lock(&Lock);
+    if (Handlers[id].fd == fd) {
+        ret = epoll_ctl(Efd, EPOLL_CTL_MOD, fd, &ev);
+    } else {
+        if (Handlers[id].fd >= 0)
+            epoll_ctl(Efd, EPOLL_CTL_DEL, Handlers[id].fd, NULL);
+        Handlers[id].fd = -1;
+        ret = epoll_ctl(Efd, EPOLL_CTL_ADD, fd, &ev);
+        if (ret == 0)
+            Handlers[id].fd = fd;
+    }
+    pthread_mutex_unlock(&Lock);
+    if (ret < 0)
+        gb_log(LOG_ERR, "Unable to change the %s event handler: %s", Handlers[id].name, strerror(errno));
+    return ret;
+}
+
+/* Dispatch the ready fds until loop_stop() */
+void loop_run(void)
+{
+    struct epoll_event evs[LOOP_EVENTS];
+    loopHandler_t *h;
+    long long start, lat;
+    int n, i;
+
+    while (!Stop) {
+        n = epoll_wait(Efd, evs, LOOP_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            gb_log(LOG_CRIT, "Event loop failed: %s", strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            h = &Handlers[evs[i].data.u32];
+            if (h->fd < 0)
+                continue; //Removed by a handler of this same round
+
+            start = loop_clock();
+            TRACE_BEGIN("loop", h->name);
+            h->fn(h->fd, evs[i].events, h->arg);
+            TRACE_END("loop", h->name);
+            lat = loop_clock() - start;
+
+            pthread_mutex_lock(&Lock);
+            h->calls++;
+            h->latency_last = lat;
+            h->latency_sum += lat;
+            if (lat > h->latency_max)
+                h->latency_max = lat;
+            pthread_mutex_unlock(&Lock);
+        }
+    }
+    Stop = false;
+    return;
+}
+
+/* Make loop_run() return, from any thread */
+void loop_stop(void)
+{
+    uint64_t one = 1;
+
+    if (write(Stop_fd, &one, sizeof(one)) != sizeof(one))
+        gb_log(LOG_ERR, "Unable to stop the event loop: %s", strerror(errno));
+    return;
+}
+
+int loop_count(void)
+{
+    return Handlers_numb;
+}
+
+/* Copy of a handler with its statistics */
+int loop_get(int id, loopHandler_t *handler)
+{
+    if ((id < 0) || (id >= Handlers_numb))
+        return -1;
+
+    pthread_mutex_lock(&Lock);
+    *handler = Handlers[id];
+    pthread_mutex_unlock(&Lock);
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * gb_loop.h:
+ *	Event loop of the control plane for the GreenBubble project
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef GB_LOOP_H
+#define GB_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <gb_main.h>
+
+/***************** DEFINES & ENUMS *******************/
+
+#define LOOP_MAX 16
+
+/* Handler of a ready fd, events are the EPOLL* bits. Runs on the loop thread and must not block. */
+typedef void (*loopFn_t)(int fd, uint32_t events, void *arg);
+
+typedef struct {
+    const char *name;
+    int fd;                 //-1 once removed
+    loopFn_t fn;
+    void *arg;
+    unsigned long calls;
+    long long latency_last; //ns the handler kept the loop busy
+    long long latency_max;
+    long long latency_sum;
+} loopHandler_t;
+
+/***************** FUNCTIONS *******************/
+int loop_init(void);
+int loop_add(const char *name, int fd, uint32_t events, loopFn_t fn, void *arg);
+void loop_del(int id);
+int loop_mod(int id, int fd, uint32_t events);
+void loop_run(void);
+void loop_stop(void);
+int loop_count(void);
+int loop_get(int id, loopHandler_t *handler);
+
+#endif //GB_LOOP_H
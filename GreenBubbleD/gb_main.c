@@ -23,9 +23,11 @@
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <syslog.h>
+#include <sys/signalfd.h>
 
 #include <gb_main.h>
 #include <gb_config.h>
@@ -34,11 +36,25 @@
 #include <gb_rest.h>
 #include <gb_led.h>
 #include <gb_gpio.h>
+#include <gb_jobs.h>
+#include <gb_sched.h>
+#include <gb_regul.h>
+#include <gb_snap.h>
+#include <gb_loop.h>
+#include <gb_hal.h>
+#include <gb_hal_rec.h>
+#include <gb_log.h>
+#include <gb_act.h>
+#include <gb_export.h>
 
 //Global GreenBubble entities
-ldSys_t Gb_ld_sys[LD_NUMB];
+gbChan_t Gb_ch;
+ldSys_t Gb_ld_sys[LD_MAX];
 gbSts_t Gb_sts;
-gbCfg_t Gb_cfg;
+
+static int Sig_fd = -1;
+static const char *Export;    //Sink of -e
+static unsigned int Web_port = REST_PORT;
 
 static void daemon_init()
 {
@@ -95,57 +111,228 @@ static void daemon_init()
     openlog("GreenBubbleD", LOG_PID, LOG_DAEMON);
 }
 
-int main()
+/* Event loop handler of the signals: SIGTERM/SIGINT stop the daemon, SIGHUP reloads CFG.json */
+static void main_signal(int fd, uint32_t events, void *arg)
+{
+    struct signalfd_siginfo si;
+
+    while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+        switch (si.ssi_signo) {
+            case SIGHUP:
+                cfg_reload();
+                break;
+            case SIGTERM:
+            case SIGINT:
+                gb_log(LOG_NOTICE, "Signal %u received, terminating.", si.ssi_signo);
+                loop_stop();
+                break;
+        }
+    }
+    return;
+}
+
+/* Signals are only taken by the event loop: blocked in every thread, the ones created later inherit it */
+static int main_signal_init(void)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+        return -1;
+
+    Sig_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (Sig_fd < 0) {
+        gb_log(LOG_CRIT, "Unable to handle signals: %s", strerror(errno));
+        return -1;
+    }
+    return loop_add("signals", Sig_fd, EPOLLIN, main_signal, NULL);
+}
+
+/*
+ * -r <capture> records the hardware traffic, -p <capture> replays one instead of the hardware, -x speed times faster.
+ * -l <level> logs up to this syslog level (err, warning, notice, info, debug).
+ * -e <sink> pushes the samples to influx://host:port or mqtt://host:port/topic.
+ * -w <port> serves the REST endpoints on this port (several daemons on one host).
+ */
+static int main_options(int argc, char *argv[])
+{
+    const char *record = NULL, *replay = NULL;
+    unsigned int speed = 1;
+    int opt, level = LOG_LEVEL_DFLT;
+
+    while ((opt = getopt(argc, argv, "r:p:x:l:e:w:")) != -1) {
+        switch (opt) {
+            case 'r':
+                record = optarg;
+                break;
+            case 'p':
+                replay = optarg;
+                break;
+            case 'x':
+                speed = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                level = log_level_parse(optarg);
+                break;
+            case 'e':
+                Export = optarg;
+                break;
+            case 'w':
+                Web_port = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                record = replay = NULL;
+                speed = 0;
+                break;
+        }
+    }
+    if ((record && replay) || (speed == 0) || (level < 0) || (Web_port == 0) || (optind < argc)) {
+        fprintf(stderr, "Usage: %s [-l level] [-e sink] [-w port] [-r capture | -p capture [-x speed]]\n", argv[0]);
+        return -1;
+    }
+
+    if (level != LOG_LEVEL_DFLT)
+        log_set_level(level);
+
+    if (record)
+        return hal_record_start(record);
+    if (replay)
+        return hal_replay_start(replay, speed);
+    return 0;
+}
+
+/* Timer at the end of the replayed capture: nothing more to answer with */
+static long long main_replay_end(void *arg, long long now)
+{
+    gb_log(LOG_NOTICE, "End of the replayed capture, terminating.");
+    loop_stop();
+    return 0;
+}
+
+/*
+ * SIGTERM: finish the queued jobs, leave the leds in the configured safe state and
+ * checkpoint the state and the history, within shutdown_ms. The web server goes last.
+ */
+static void main_shutdown(struct _u_instance *ulfius_instance)
+{
+    long long start = hal_sys_clock_ns(CLOCK_REALTIME); //Shutdown runs on the system time, even on a replay
+    long long deadline = start + cfg_get()->shutdown_ms*SCHED_MS;
+    const gbCfg_t *cfg;
+
+    // No new work: config edits are not watched anymore and new jobs are refused
+    cfg_watch_stop();
+    if (job_stop(deadline) < 0)
+        gb_log(LOG_WARNING, "Out of time to stop, the jobs still queued were dropped.");
+
+    // The jobs may have published a new config
+    cfg = cfg_hold();
+    ld_shutdown(cfg, deadline);
+    cfg_release(cfg);
+    act_stop();
+
+    // Checkpoints are written even late, the data is only in memory
+    cfg_save_pending();
+    snap_stop(deadline);
+    if (gb_stats_save(&Gb_sts) < 0)
+        gb_log(LOG_ERR, "History of this run is lost.");
+
+    export_stop();
+    rest_ulfius_stop(ulfius_instance);
+    hal_record_stop();
+    gb_log(LOG_NOTICE, "GreenBubble daemon stopped in %lld ms.", (hal_sys_clock_ns(CLOCK_REALTIME) - start)/SCHED_MS);
+    return;
+}
+
+int main(int argc, char *argv[])
 {
     struct _u_instance ulfius_instance;
+    bool snap;
 
     //Initilize global entities
     memset(&Gb_ld_sys, 0, sizeof(Gb_ld_sys));
     memset(&Gb_sts, 0, sizeof(Gb_sts));
-    memset(&Gb_cfg, 0, sizeof(Gb_cfg));
-    gb_stats_init(&Gb_sts);
     
     // Initialiye the Daemon
     daemon_init();
+    if ((log_init() < 0) || (main_options(argc, argv) < 0))
+        return EXIT_FAILURE;
+
+    // Everything the daemon waits on goes through the event loop, signals before any thread is created
+    if ((loop_init() < 0) || (main_signal_init() < 0))
+        return EXIT_FAILURE;
+
+    // Load the led channels and the Config, everything below loops over the channels.
+    // The snapshot of the last run has them ready, CFG.json is only parsed without it.
+    snap = (snap_load() == 0);
+    if (!snap)
+        cfg_load();
+    gb_stats_init(&Gb_sts);
+
+    // Timers must exist before anything schedules on them
+    if (sched_init() < 0)
+        return EXIT_FAILURE;
+    if (hal_replay_end() != 0)
+        sched_add("replay end", main_replay_end, NULL, hal_replay_end(), 0);
 
-    // Initialize WiringPi and Pins
-    gb_gpio_init();
+    // Initialize the hardware backend and Pins
+    if (gb_gpio_init() < 0)
+        return EXIT_FAILURE;
 
     // Initialiye the UART to communicate with Led Drivers
     if (ld_serial_init() < 0)
-        syslog(LOG_CRIT, "Unable to open serial device.");
+        gb_log(LOG_CRIT, "Unable to open serial device.");
+
+    // Routine steps, current regulation, actuators, status sampling and config flushes each run when they are due.
+    // Their timers exist before the job worker and the REST server, which wake and save through them.
+    ld_routine_sched_init();
+    regul_sched_init(cfg_get()->regul_ms);
+    act_sched_init(&Gb_sts);
+    gb_stats_sched_init(&Gb_sts);
+    cfg_sched_init();
+    snap_sched_init();
+
+    // Start the worker that applies the config posted on the REST endpoints
+    job_init();
 
     // Initialiye the web server for the REST endpoints
-    if (rest_ulfius_init(&ulfius_instance) < 0)
-        syslog(LOG_CRIT, "Unable to start ulfius web service.");
+    if (rest_ulfius_init(&ulfius_instance, Web_port) < 0)
+        gb_log(LOG_CRIT, "Unable to start ulfius web service.");
 
-    //Get LED System information
-    if (ld_sys_init() < 0)
-        syslog(LOG_CRIT, "Unable to get Led Device System's information.");
+    if (snap) {
+        // Light back with the snapshot setpoints, the drivers are probed afterwards
+        snap_resume();
+    } else {
+        //Get LED System information
+        if (ld_sys_init() < 0)
+            gb_log(LOG_CRIT, "Unable to get Led Device System's information.");
 
-    // Load and Apply Config
-    cfg_load(&Gb_cfg);
-    cfg_apply(&Gb_cfg);
+        // Apply Config
+        cfg_apply();
 
-    syslog(LOG_NOTICE, "GreenBubble daemon started.");
+        //First call updates immediatly
+        ld_daily_routine(true);
+    }
 
-    //First call updates immediatly
-    ld_daily_routine(true);
-    gb_get_status(&Gb_sts, true);
+    // Follow the changes made on the config file
+    cfg_watch_init();
 
-    while (1)
-    {
-        ld_daily_routine(false);
+    // Push the samples, from the first one, to the sink of -e
+    if (Export && (export_init(Export) < 0))
+        gb_log(LOG_CRIT, "Unable to export to %s.", Export);
 
-        gb_get_status(&Gb_sts, false);
+    gb_log(LOG_NOTICE, "GreenBubble daemon started.");
+    gb_get_status(&Gb_sts);
 
-        sleep (MAIN_LOOP_SEC);
-    }
+    loop_run();
 
     // Terminate the Daemon
+    main_shutdown(&ulfius_instance);
     gb_stats_decref(&Gb_sts);
-    rest_ulfius_stop(&ulfius_instance);
-    syslog(LOG_NOTICE, "GreenBubble daemon terminated.");
+    gb_log(LOG_NOTICE, "GreenBubble daemon terminated.");
+    log_stop();
     closelog();
 
     return EXIT_SUCCESS;
@@ -25,28 +25,57 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <jansson.h>
+#include <gb_log.h>
 
 /***************** DEFINES & ENUMS *******************/
 
-#define DEBUG 1
+// Through the log thread to stderr, out of the build with LOG_MAX below LOG_DEBUG
 #define debug(fmt, ...) \
-            do { if (DEBUG) fprintf(stderr, fmt, ##__VA_ARGS__); } while (0)
+            gb_log(LOG_DEBUG, fmt, ##__VA_ARGS__)
 
 #define debugl(fmt, ...) \
-        do { if (DEBUG) fprintf(stderr, "%s:%d:%s(): " fmt, __FILE__, \
-                                __LINE__, __func__, ##__VA_ARGS__); } while (0)
+        gb_log(LOG_DEBUG, "%s:%d:%s(): " fmt, __FILE__, \
+                                __LINE__, __func__, ##__VA_ARGS__)
 
 #define MAX_LIMIT(VALUE, LIMIT) (VALUE > LIMIT) ? LIMIT : VALUE
 
-#define MAIN_LOOP_SEC 30
+#define LD_CS_MAX 4 //Addresses of the 2-bit chip select mux, one driver on each
+#define LD_MAX LD_CS_MAX //Max led channels in the registry
+#define FOR_EACH_LED(x) for (x = 0; x < Gb_ch.numb; x++)
+typedef unsigned int ldBoard_t; //Index of a led channel in the registry
 
-#define LD_NUMB 3
-#define FOR_EACH_LED(x) for (x = 0; x < LD_NUMB; x++)
-typedef enum {
-    LD_WHITE = 0,
-    LD_BLUE,
-    LD_RED
-} ldBoard_t;
+/***************** CHANNELS *******************/
+
+typedef struct {
+    char name[17];      //Used on the config and on the rest ("white")
+    char model[10];     //Expected driver model ("BST900")
+    char driver[17];    //Expected driver name ("LED_WHITE")
+    unsigned int cs;    //Address of the driver on the chip select mux (bit 1: BCM_22, bit 0: BCM_23)
+} ldChan_t;
+
+/*
+ * Led channel registry, loaded from the config. The state used on each routine step and
+ * status read is kept as one array per field, so the loops over the channels stay compact.
+ */
+typedef struct {
+    unsigned int numb;
+    ldChan_t chan[LD_MAX];
+    unsigned int setpoint[LD_MAX];  //mA - last current accepted by the driver
+    unsigned int setpoint_ok;       //Bit per channel, setpoint is known
+    unsigned int output;            //Bit per channel, last output accepted by the driver
+    unsigned int output_ok;         //Bit per channel, output is known
+    unsigned int cout[LD_MAX];      //mA - last current measured by the driver
+    unsigned int routine[LD_MAX];   //Routine intensity, Q16 percentage
+    unsigned int target[LD_MAX];    //mA - current the routine asks for
+    int trim[LD_MAX];               //mA - added to the target by the regulation loop
+    int error[LD_MAX];              //mA - target minus measured, on the last regulation step
+    unsigned int vset[LD_MAX];      //mV - last voltage accepted by the driver
+    unsigned int volt_ok;           //Bit per channel, the config voltage was accepted by the driver
+} gbChan_t;
+
+// The bits per channel are written from the job worker, the loop and main: never with a plain |= or &=
+#define LD_BIT_SET(mask, ld) __atomic_or_fetch(&(mask), 1u << (ld), __ATOMIC_RELAXED)
+#define LD_BIT_CLR(mask, ld) __atomic_and_fetch(&(mask), ~(1u << (ld)), __ATOMIC_RELAXED)
 
 /***************** SYSTEM *******************/
 
@@ -69,9 +98,28 @@ typedef struct {
 /***************** CONFIG *******************/
 
 #define TIME_LD    10 //in Minuts
-#define ROUT_STEP  9  //1 each 3 hs - 9 points in a day (repeats 0hr), 8 sessions
-#define ROUT_N     18 //180min/TIME_LD (Points between Steps)
+#define ROUT_STEP  9  //Default spectrum: 1 each 3 hs - 9 points in a day (repeats 0hr), 8 sessions
 #define ROUT_TOT   (1440/TIME_LD)
+#define ROUT_FRAC  16 //Routine percentages are evaluated in fixed point Q16 (perc << ROUT_FRAC)
+
+#define LD_SPEC_MAX  2048 //Max breakpoints of a led spectrum
+#define LD_SPEC_MINS 1440 //Breakpoints go from minute 0 to 1440 (end of the day)
+
+#define SHUTDOWN_DFLT_MS 5000 //Time the daemon has to stop cleanly
+
+/* What the led drivers are left with when the daemon stops */
+typedef enum {
+    SHUTDOWN_KEEP = 0,  //Untouched, the drivers keep the light (no glitch on a restart)
+    SHUTDOWN_OFF,       //Outputs off
+    SHUTDOWN_INSTANT    //The instant config
+} shutdownLeds_t;
+
+/* Spectrum of a led: sorted (minute_of_day, percent) breakpoints, interpolated in between */
+typedef struct {
+    unsigned short n;
+    unsigned short minute[LD_SPEC_MAX];
+    unsigned char perc[LD_SPEC_MAX];
+} ldSpec_t;
 
 typedef struct {
     bool enable;
@@ -79,15 +127,26 @@ typedef struct {
     unsigned int cset; // mA
 } ldCfg_t;
 
+/* Duty cycle of an actuator: on for on_s at the start of each period_s of the day clock, 0 period is off */
+typedef struct {
+    unsigned int period_s;
+    unsigned int on_s;
+} actCfg_t;
+
+/*
+ * Config only, never changed once published: see cfg_begin() and cfg_commit().
+ * Readers get the current one with cfg_get().
+ */
 typedef struct {
     bool ld_instant_mode;                               //If TRUE, it uses the instant config and stops the led routine operation mode
-    ldCfg_t ld_instant[LD_NUMB];                        //Instantaneous config, if want to stop the routine and apply only this
-    unsigned char ld_spec[LD_NUMB][ROUT_STEP];          //Config received from the rest, limited to the main points within 24hs (spectrum)
-    unsigned char ld_routine_perc[LD_NUMB][ROUT_TOT];   //Config generated by the SW from the ld_spec, containing much more points
-    
-    //Below values are cfg statuses
-    bool ld_routine_init;
-    bool init_volt_applied[LD_NUMB];
+    unsigned int regul_ms;                              //Period of the current regulation loop, 0 disables it
+    shutdownLeds_t shutdown_leds;                       //Safe state of the led drivers when the daemon stops
+    unsigned int shutdown_ms;                           //Time budget to stop: jobs, safe state and checkpoints
+    actCfg_t fog;                                       //Fog (BCM_17), paused while it rains
+    actCfg_t pwc;                                       //Periodic water change (BCM_16)
+    ldCfg_t ld_instant[LD_MAX];                        //Instantaneous config, if want to stop the routine and apply only this
+    ldSpec_t ld_spec[LD_MAX];                          //Config received from the rest, the breakpoints within 24hs (spectrum)
+    unsigned char ld_routine_perc[LD_MAX][ROUT_TOT];   //Config generated by the SW from the ld_spec, containing much more points
 } gbCfg_t;
 
 /***************** STATUS *******************/
@@ -105,7 +164,7 @@ typedef struct {
 
 /* The struct below contains all historic data we want to transmit to the website */
 typedef struct {
-    json_t *intens[LD_NUMB]; //pointer to an array for each led intensity
+    json_t *intens[LD_MAX]; //pointer to an array for each led intensity
     json_t *humidity;
     json_t *rain;
     json_t *fog;
@@ -122,16 +181,15 @@ typedef struct {
     unsigned char humidity_air; //%
     bool rain;
     bool fog;
-    ldSts_t ld_sts[LD_NUMB];
+    bool pwc;
+    ldSts_t ld_sts[LD_MAX];
     gbHis_t hist;
 } gbSts_t;
 
-extern gbSts_t Gb_sts;
-
 /***************** EXTERNS *******************/
 
-extern ldSys_t Gb_ld_sys[LD_NUMB];
-extern gbCfg_t Gb_cfg;
+extern gbChan_t Gb_ch;
+extern ldSys_t Gb_ld_sys[LD_MAX];
 extern gbSts_t Gb_sts;
 
 #endif //GB_MAIN_H
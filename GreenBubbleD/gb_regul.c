@@ -0,0 +1,214 @@
+/*
+ * gb_regul.c:
+ *	Closed-loop current regulation of the Led Drivers for the GreenBubble project
+ *	The routine sets CURRENT open-loop. On each step this loop reads the STATUS of
+ *	the drivers and compares the measured current with the routine target:
+ *	- in constant current, an error bigger than one driver step is trimmed on CSET
+ *	- in constant voltage the led can not reach CSET, so VSET is raised
+ *	Both stay within the limits of Gb_ld_sys.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <gb_regul.h>
+#include <gb_main.h>
+#include <gb_serial.h>
+#include <gb_sched.h>
+#include <gb_config.h>
+#include <gb_log.h>
+
+#define REGUL_TRIM_MAX(x) ((int)Gb_ld_sys[x].fwd_led_curr/5) //Trim at most 20% of the led current
+
+static regulStats_t Stats;
+static int Regul_timer = -1;
+static unsigned int Volt_limited; //Bit per channel, already logged at max_volt
+static unsigned int Volt_raised;  //Bit per channel, VSET above the config by the loop
+static unsigned int Trim_target[LD_MAX]; //Target the trim was found on
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+
+/***************** LOOP *******************/
+
+/* Current to send for a routine target, with the trim of the loop */
+unsigned int regul_curr(ldBoard_t color, unsigned int target)
+{
+    int curr;
+
+    if (color >= Gb_ch.numb)
+        return 0;
+
+    //A trim is only good for the target it was found on, the routine moved on
+    if (target != Trim_target[color]) {
+        Trim_target[color] = target;
+        Gb_ch.trim[color] = 0;
+    }
+    if (target == 0)
+        return 0; //Off is off, no trim
+
+    curr = (int)target + Gb_ch.trim[color];
+    if (curr < 0)
+        return 0;
+    if (curr > (int)Gb_ld_sys[color].fwd_led_curr)
+        return Gb_ld_sys[color].fwd_led_curr;
+    return (unsigned int)curr;
+}
+
+/* VSET back to the config once the loop no longer regulates the channel */
+static void regul_volt_restore(ldBoard_t ld)
+{
+    unsigned int vset = cfg_get()->ld_instant[ld].vset;
+
+    if (!(Volt_raised & (1 << ld)))
+        return;
+    if (ld_set_voltage(ld, vset) < 0) {
+        gb_log(LOG_ERR, "Regulation: unable to bring Led %s back to %u mV.", Gb_ch.chan[ld].name, vset);
+        return;
+    }
+    LD_BIT_CLR(Volt_raised, ld);
+    gb_log(LOG_INFO, "Led %s back to the %u mV of the config.", Gb_ch.chan[ld].name, vset);
+    return;
+}
+
+static void regul_channel(ldBoard_t ld)
+{
+    ldSts_t sts;
+    unsigned int curr;
+    int err, trim;
+
+    if (!Gb_ld_sys[ld].device_ok || !(Gb_ch.volt_ok & (1 << ld)) || !(Gb_ch.setpoint_ok & (1 << ld)))
+        return;
+
+    if (ld_get_status(ld, &sts) < 0)
+        return;
+    Gb_sts.ld_sts[ld] = sts;
+    Gb_ch.cout[ld] = sts.cout;
+
+    if ((Gb_ch.target[ld] == 0) || !sts.enable) {
+        Gb_ch.error[ld] = 0;
+        Gb_ch.trim[ld] = 0;
+        regul_volt_restore(ld);
+        return;
+    }
+
+    err = (int)Gb_ch.target[ld] - (int)sts.cout;
+    Gb_ch.error[ld] = err;
+
+    if (!sts.constant_current) {
+        //Voltage limited: more CSET would not help, give the leds more voltage
+        if (Gb_ch.vset[ld] < Gb_ld_sys[ld].max_volt) {
+            if (ld_set_voltage(ld, Gb_ch.vset[ld] + REGUL_VOLT_STEP) == 0)
+                LD_BIT_SET(Volt_raised, ld);
+            Volt_limited &= ~(1 << ld);
+        } else if (!(Volt_limited & (1 << ld))) {
+            gb_log(LOG_WARNING, "Led %s is voltage limited at %u mV, %i mA below the target.",
+                    Gb_ch.chan[ld].name, Gb_ld_sys[ld].max_volt, err);
+            Volt_limited |= (1 << ld);
+        }
+        return;
+    }
+    Volt_limited &= ~(1 << ld);
+
+    //Within one driver step is the resolution of CURRENT, nothing to do
+    if (abs(err) <= LD_CURR_STEP)
+        return;
+
+    //Half of the error each step, so the noise of the measure does not make it swing
+    trim = Gb_ch.trim[ld] + err/2;
+    if (trim > REGUL_TRIM_MAX(ld))
+        trim = REGUL_TRIM_MAX(ld);
+    else if (trim < -REGUL_TRIM_MAX(ld))
+        trim = -REGUL_TRIM_MAX(ld);
+    if (trim == Gb_ch.trim[ld])
+        return;
+
+    Gb_ch.trim[ld] = trim;
+    curr = regul_curr(ld, Gb_ch.target[ld]);
+    if ((curr != Gb_ch.setpoint[ld]) && (ld_set_current(ld, curr) < 0))
+        gb_log(LOG_ERR, "Regulation: unable to set the current of Led %s.", Gb_ch.chan[ld].name);
+    return;
+}
+
+/* Regulation timer. Only the routine is regulated, instant mode keeps what was asked. */
+static long long regul_tick(void *arg, long long now)
+{
+    long long lat, period;
+    ldBoard_t ld;
+
+    if (cfg_get()->ld_instant_mode == false) {
+        FOR_EACH_LED(ld)
+            regul_channel(ld);
+
+        lat = sched_now() - now;
+        pthread_mutex_lock(&Lock);
+        Stats.steps++;
+        Stats.latency_last = lat;
+        Stats.latency_sum += lat;
+        if (lat > Stats.latency_max)
+            Stats.latency_max = lat;
+        pthread_mutex_unlock(&Lock);
+    }
+
+    pthread_mutex_lock(&Lock);
+    period = Stats.period_ms*SCHED_MS;
+    pthread_mutex_unlock(&Lock);
+
+    return period ? now + period : 0;
+}
+
+/***************** API *******************/
+
+void regul_sched_init(unsigned int period_ms)
+{
+    Stats.period_ms = period_ms;
+    if (period_ms == 0)
+        gb_log(LOG_NOTICE, "Current regulation disabled.");
+
+    //Added even if disabled, so a config reload can start it
+    Regul_timer = sched_add("regulation", regul_tick, NULL, period_ms ? sched_now() + period_ms*SCHED_MS : 0, 0);
+    return;
+}
+
+/* New period from any thread, 0 stops the loop. Trims and raised VSETs are dropped when it stops. */
+void regul_set_period(unsigned int period_ms)
+{
+    ldBoard_t ld;
+
+    pthread_mutex_lock(&Lock);
+    Stats.period_ms = period_ms;
+    pthread_mutex_unlock(&Lock);
+
+    if (period_ms == 0)
+        FOR_EACH_LED(ld) {
+            Gb_ch.trim[ld] = 0;
+            regul_volt_restore(ld);
+        }
+
+    sched_set(Regul_timer, period_ms ? sched_now() + period_ms*SCHED_MS : 0);
+    gb_log(LOG_NOTICE, "Current regulation period set to %u ms.", period_ms);
+    return;
+}
+
+void regul_get(regulStats_t *stats)
+{
+    pthread_mutex_lock(&Lock);
+    *stats = Stats;
+    pthread_mutex_unlock(&Lock);
+    return;
+}
@@ -0,0 +1,46 @@
+/*
+ * gb_regul.h:
+ *	Closed-loop current regulation of the Led Drivers for the GreenBubble project
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef GB_REGUL_H
+#define GB_REGUL_H
+
+#include <gb_main.h>
+
+/***************** DEFINES & ENUMS *******************/
+
+#define REGUL_DFLT_MS   5000 //Default period of the loop
+#define REGUL_VOLT_STEP 500  //mV - VSET raise each step while a driver is voltage limited
+
+typedef struct {
+    unsigned int period_ms;
+    unsigned long steps;
+    long long latency_last;  //ns - duration of a step, bus transactions included
+    long long latency_max;
+    long long latency_sum;
+} regulStats_t;
+
+/***************** FUNCTIONS *******************/
+void regul_sched_init(unsigned int period_ms);
+void regul_set_period(unsigned int period_ms);
+unsigned int regul_curr(ldBoard_t color, unsigned int target);
+void regul_get(regulStats_t *stats);
+
+#endif //GB_REGUL_H
@@ -20,9 +20,10 @@
  ***********************************************************************
  */
 
+#include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <errno.h>
-#include <syslog.h>
 #include <jansson.h>
 
 #include <sys/socket.h>
@@ -35,8 +36,16 @@
 #include <gb_serial.h>
 #include <gb_led.h>
 #include <gb_config.h>
+#include <gb_jobs.h>
+#include <gb_stats.h>
+#include <gb_sched.h>
+#include <gb_regul.h>
+#include <gb_loop.h>
+#include <gb_trace.h>
+#include <gb_export.h>
+#include <gb_json.h>
+#include <gb_log.h>
 
-#define PORT 8537
 #define PREFIX "/GBBL"
 #define PREFIXJSON "/testjson"
 #define PREFIXCOOKIE "/testcookie"
@@ -49,27 +58,77 @@ int callback_gb_charts (const struct _u_request * request, struct _u_response *
 int callback_gb_system (const struct _u_request * request, struct _u_response * response, void * user_data);
 int callback_gb_config (const struct _u_request * request, struct _u_response * response, void * user_data);
 int callback_post_config (const struct _u_request * request, struct _u_response * response, void * user_data);
+int callback_gb_job (const struct _u_request * request, struct _u_response * response, void * user_data);
+int callback_gb_sched (const struct _u_request * request, struct _u_response * response, void * user_data);
+int callback_gb_regul (const struct _u_request * request, struct _u_response * response, void * user_data);
+int callback_gb_loop (const struct _u_request * request, struct _u_response * response, void * user_data);
+int callback_gb_versions (const struct _u_request * request, struct _u_response * response, void * user_data);
+int callback_post_rollback (const struct _u_request * request, struct _u_response * response, void * user_data);
+int callback_gb_trace (const struct _u_request * request, struct _u_response * response, void * user_data);
+int callback_post_trace (const struct _u_request * request, struct _u_response * response, void * user_data);
+int callback_gb_log (const struct _u_request * request, struct _u_response * response, void * user_data);
+int callback_post_log (const struct _u_request * request, struct _u_response * response, void * user_data);
+int callback_gb_export (const struct _u_request * request, struct _u_response * response, void * user_data);
 int callback_options (const struct _u_request * request, struct _u_response * response, void * user_data);
 int callback_default (const struct _u_request * request, struct _u_response * response, void * user_data);
 
-int rest_ulfius_init (struct _u_instance *instance) {
-    if (ulfius_init_instance(instance, PORT, NULL, NULL) != U_OK) {
-        fprintf (stderr, "Ulfius unable to initiate instance: %s\n", strerror(errno));
+typedef struct {
+    const char *method;
+    const char *url;
+    int (*cb)(const struct _u_request *, struct _u_response *, void *);
+} restRoute_t;
+
+// Endpoint list, each callback runs inside a trace span named by its url
+static const restRoute_t Routes[] = {
+    { "GET",     "/status",                 &callback_gb_status },
+    { "GET",     "/charts",                 &callback_gb_charts },
+    { "GET",     "/system",                 &callback_gb_system },
+    { "GET",     "/config",                 &callback_gb_config },
+    { "POST",    "/post/config",            &callback_post_config },
+    { "OPTIONS", "/post/config",            &callback_options },
+    { "GET",     "/jobs/:id",               &callback_gb_job },
+    { "GET",     "/sched",                  &callback_gb_sched },
+    { "GET",     "/regul",                  &callback_gb_regul },
+    { "GET",     "/loop",                   &callback_gb_loop },
+    { "GET",     "/config/versions",        &callback_gb_versions },
+    { "POST",    "/post/rollback/:version", &callback_post_rollback },
+    { "OPTIONS", "/post/rollback/:version", &callback_options },
+    { "GET",     "/trace",                  &callback_gb_trace },
+    { "POST",    "/post/trace",             &callback_post_trace },
+    { "OPTIONS", "/post/trace",             &callback_options },
+    { "GET",     "/log",                    &callback_gb_log },
+    { "POST",    "/post/log",               &callback_post_log },
+    { "OPTIONS", "/post/log",               &callback_options },
+    { "GET",     "/export",                 &callback_gb_export }
+};
+#define ROUTES_NUMB (sizeof(Routes)/sizeof(Routes[0]))
+
+static int rest_traced (const struct _u_request * request, struct _u_response * response, void * user_data) {
+    const restRoute_t *route = user_data;
+    int ret;
+
+    TRACE_BEGIN("rest", route->url);
+    ret = route->cb(request, response, NULL);
+    TRACE_END("rest", route->url);
+    return ret;
+}
+
+int rest_ulfius_init (struct _u_instance *instance, unsigned int port) {
+    unsigned int i;
+
+    if (ulfius_init_instance(instance, port, NULL, NULL) != U_OK) {
+        gb_log(LOG_ERR, "Ulfius unable to initiate instance: %s\n", strerror(errno));
         return -1;
     }
   
     //u_map_put(instance.default_headers, "Access-Control-Allow-Origin", "*");
   
-    // Maximum body size sent by the client is 16 Kb
-    instance->max_post_body_size = 16*1024;
+    // Maximum body size sent by the client is 64 Kb, room for breakpoint spectrums
+    instance->max_post_body_size = 64*1024;
   
     // Endpoint list declaration
-    ulfius_add_endpoint_by_val(instance, "GET", PREFIX, "/status", 0, &callback_gb_status, NULL);
-    ulfius_add_endpoint_by_val(instance, "GET", PREFIX, "/charts", 0, &callback_gb_charts, NULL);
-    ulfius_add_endpoint_by_val(instance, "GET", PREFIX, "/system", 0, &callback_gb_system, NULL);
-    ulfius_add_endpoint_by_val(instance, "GET", PREFIX, "/config", 0, &callback_gb_config, NULL);
-    ulfius_add_endpoint_by_val(instance, "POST", PREFIX, "/post/config", 0, &callback_post_config, NULL);
-    ulfius_add_endpoint_by_val(instance, "OPTIONS", PREFIX, "/post/config", 0, &callback_options, NULL);
+    for (i = 0; i < ROUTES_NUMB; i++)
+        ulfius_add_endpoint_by_val(instance, Routes[i].method, PREFIX, Routes[i].url, 0, &rest_traced, (void *)&Routes[i]);
 
     // Set default headers for CORS
     u_map_put(instance->default_headers, "Access-Control-Allow-Origin", "*");
@@ -86,9 +145,9 @@ int rest_ulfius_init (struct _u_instance *instance) {
 
     // Start the framework
     if (ulfius_start_framework(instance) == U_OK) {
-        syslog(LOG_INFO, "Ulfius Started framework on port %d\n", instance->port);
+        gb_log(LOG_INFO, "Ulfius Started framework on port %d\n", instance->port);
     } else {
-        fprintf (stderr, "Unable to start Ulfius framework: %s\n", strerror(errno));
+        gb_log(LOG_ERR, "Unable to start Ulfius framework: %s\n", strerror(errno));
         rest_ulfius_stop(instance);
         return -1;
     }
@@ -119,96 +178,186 @@ int callback_options (const struct _u_request * request, struct _u_response * re
     return U_CALLBACK_CONTINUE;
 }
 
-//sends a json
+/* A body of gb_json.c. ulfius keeps its own copy, the thread buffer is free again on return. */
+static void rest_body_response(struct _u_response *response, const char *what, const char *body, size_t len)
+{
+    if (!body) {
+        gb_log(LOG_ERR, "The %s body is over %d bytes.", what, JW_SIZE);
+        ulfius_set_string_body_response(response, 500, "Response too large\n");
+        return;
+    }
+    ulfius_set_binary_body_response(response, 200, body, len);
+    u_map_put(response->map_header, "Content-Type", "application/json");
+    return;
+}
+
+/* History series served on /charts, besides the leds of the registry grouped inside hist_ld_spec */
+static const struct {
+    const char *name;   //name used on the series= parameter
+    const char *key;
+    json_t **hist;
+} Chart_series[] = {
+    { "vin",       "hist_vin",       &Gb_sts.hist.vin },
+    { "humidity",  "hist_humidity",  &Gb_sts.hist.humidity },
+    { "rain",      "hist_rain",      &Gb_sts.hist.rain },
+    { "fog",       "hist_fog",       &Gb_sts.hist.fog },
+    { "tempPS",    "hist_tempPS",    &Gb_sts.hist.tPS },
+    { "tempAir",   "hist_tempAir",   &Gb_sts.hist.tAir },
+    { "tempWater", "hist_tempWater", &Gb_sts.hist.tWater }
+};
+#define CHART_SERIES_NUMB (sizeof(Chart_series)/sizeof(Chart_series[0]))
+
+/* Parse an optional integer query parameter. Returns -1 if present but invalid. */
+static int rest_query_ll(const struct _u_request *request, const char *key, long long *value)
+{
+    const char *str = u_map_get(request->map_url, key);
+    char *end;
+
+    if (str == NULL)
+        return 0;
+
+    errno = 0;
+    *value = strtoll(str, &end, 10);
+    if ((errno != 0) || (end == str) || (*end != '\0') || (*value < 0))
+        return -1;
+
+    return 0;
+}
+
+/* True if name is in the comma separated list (NULL list selects all) */
+static bool rest_series_selected(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = list;
+
+    if (list == NULL)
+        return true;
+
+    while ((p = strstr(p, name)) != NULL) {
+        if (((p == list) || (p[-1] == ',')) && ((p[len] == ',') || (p[len] == '\0')))
+            return true;
+        p += len;
+    }
+    return false;
+}
+
+/* Body of /charts: the selected series (NULL for all) within from..to, downsampled to max_points (0: all) */
+json_t *rest_charts_json(const char *series, long long from, long long to, unsigned int max_points)
+{
+    json_t *j_body, *j_group;
+    ldBoard_t ld;
+    size_t i;
+
+    j_body = json_object();
+    j_group = NULL;
+    FOR_EACH_LED(ld) {
+        if (!rest_series_selected(series, Gb_ch.chan[ld].name))
+            continue;
+
+        if (j_group == NULL) {
+            j_group = json_object();
+            json_object_set_new(j_body, "hist_ld_spec", j_group);
+        }
+        json_object_set_new(j_group, Gb_ch.chan[ld].name,
+                hist_query(Gb_sts.hist.intens[ld], from, to, max_points));
+    }
+
+    for (i = 0; i < CHART_SERIES_NUMB; i++)
+        if (rest_series_selected(series, Chart_series[i].name))
+            json_object_set_new(j_body, Chart_series[i].key,
+                    hist_query(*Chart_series[i].hist, from, to, max_points));
+
+    return j_body;
+}
+
+/**
+ * sends a json with the history. Optional query parameters:
+ *  series=white,tempWater  Only these series (default all)
+ *  from=<ms> to=<ms>       Time range, same time base as the points
+ *  max_points=<n>          Downsample each series with LTTB to at most n points
+ */
 int callback_gb_charts (const struct _u_request * request, struct _u_response * response, void * user_data) {
 
-    json_t *j_body = json_pack("{s{sososo}sososososososo}",
-            "hist_ld_spec",
-                "white", Gb_sts.hist.intens[LD_WHITE],
-                "blue", Gb_sts.hist.intens[LD_BLUE],
-                "red", Gb_sts.hist.intens[LD_RED],
-            "hist_vin", Gb_sts.hist.vin,
-            "hist_humidity", Gb_sts.hist.humidity,
-            "hist_rain", Gb_sts.hist.rain,
-            "hist_fog", Gb_sts.hist.fog,
-            "hist_tempPS", Gb_sts.hist.tPS,
-            "hist_tempAir", Gb_sts.hist.tAir,
-            "hist_tempWater", Gb_sts.hist.tWater);
+    long long from = 0, to = LLONG_MAX, max_points = 0;
+    json_t *j_body;
+
+    if (rest_query_ll(request, "from", &from) || rest_query_ll(request, "to", &to) ||
+            rest_query_ll(request, "max_points", &max_points) || (max_points > UINT_MAX) || (from > to)) {
+        ulfius_set_string_body_response(response, 400, "Invalid charts query: from, to and max_points must be positive integers\n");
+        return U_CALLBACK_CONTINUE;
+    }
 
+    j_body = rest_charts_json(u_map_get(request->map_url, "series"), from, to, (unsigned int)max_points);
     ulfius_set_json_body_response(response, 200, j_body);
 
     /*Used to debug only */
     //if (json_dump_file(j_body, "./jsonTime.json", JSON_INDENT(4)) != 0)
-    //    syslog(LOG_ERR, "Unable to save config.");
+    //    gb_log(LOG_ERR, "Unable to save config.");
 
-    //Do not decref! As it continues to be used.
+    json_decref(j_body);
     return U_CALLBACK_CONTINUE;
 }
 
-//sends a json
+/* Body of /status, with a led_<name> object per led channel. NULL if it does not fit. */
+const char *rest_status_body(size_t *len)
+{
+    jwBuf_t *w = jw_begin();
+    char key[32];
+    ldBoard_t ld;
+
+    jw_obj(w, NULL);
+    jw_int(w, "temp_air", Gb_sts.temp_air);
+    jw_int(w, "temp_water", Gb_sts.temp_water);
+    jw_int(w, "humidity_air", Gb_sts.humidity_air);
+    jw_bool(w, "rain", Gb_sts.rain);
+    jw_bool(w, "fog", Gb_sts.fog);
+    jw_bool(w, "pwc", Gb_sts.pwc);
+    jw_int(w, "temp_PS", Gb_sts.temp_PS);
+    jw_int(w, "voltage_in", Gb_sts.ld_sts[0].vin);
+
+    FOR_EACH_LED(ld) {
+        snprintf(key, sizeof(key), "led_%s", Gb_ch.chan[ld].name);
+        jw_obj(w, key);
+        jw_int(w, "voltage", Gb_sts.ld_sts[ld].vout);
+        jw_int(w, "current", Gb_sts.ld_sts[ld].cout);
+        jw_int(w, "intens", get_perc_from_curr(ld, Gb_sts.ld_sts[ld].cout));
+        jw_obj_end(w);
+    }
+    jw_obj_end(w);
+    return jw_end(w, len);
+}
+
+//sends a json, with a led_<name> object per led channel
 int callback_gb_status (const struct _u_request * request, struct _u_response * response, void * user_data) {
 
-    json_t * j_body = json_pack("{sisisisbsbsisis{sisisi}s{sisisi}s{sisisi}}",
-            "temp_air", Gb_sts.temp_air,
-            "temp_water", Gb_sts.temp_water,
-            "humidity_air", Gb_sts.humidity_air,
-            "rain", Gb_sts.rain,
-            "fog", Gb_sts.fog,
-            "temp_PS", Gb_sts.temp_PS,
-            "voltage_in", Gb_sts.ld_sts[LD_WHITE].vin,
-            "led_white",
-                "voltage", Gb_sts.ld_sts[LD_WHITE].vout,
-                "current", Gb_sts.ld_sts[LD_WHITE].cout,
-                "intens", get_perc_from_curr(LD_WHITE, Gb_sts.ld_sts[LD_WHITE].cout),
-            "led_blue",
-                "voltage", Gb_sts.ld_sts[LD_BLUE].vout,
-                "current", Gb_sts.ld_sts[LD_BLUE].cout,
-                "intens", get_perc_from_curr(LD_BLUE, Gb_sts.ld_sts[LD_BLUE].cout),
-            "led_red",
-                "voltage", Gb_sts.ld_sts[LD_RED].vout,
-                "current", Gb_sts.ld_sts[LD_RED].cout,
-                "intens", get_perc_from_curr(LD_RED, Gb_sts.ld_sts[LD_RED].cout));
+    size_t len;
+    const char *body = rest_status_body(&len);
 
-    ulfius_set_json_body_response(response, 200, j_body);
-    json_decref(j_body);
+    rest_body_response(response, "status", body, len);
 
   return U_CALLBACK_CONTINUE;
 }
 
-//sends a json
+//sends a json, with a ld_<name> object per led channel
 int callback_gb_system (const struct _u_request * request, struct _u_response * response, void * user_data) {
 
-    json_t * j_body = json_pack("{s{sssssssbsbsisisisi}s{sssssssbsbsisisisi}s{sssssssbsbsisisisi}}",
-            "ld_white",
-                "model", Gb_ld_sys[LD_WHITE].model,
-                "version", Gb_ld_sys[LD_WHITE].version,
-                "name", Gb_ld_sys[LD_WHITE].name,
-                "default_on", Gb_ld_sys[LD_WHITE].default_on,
-                "autocommit", Gb_ld_sys[LD_WHITE].autocommit,
-                "fwd_led_curr", Gb_ld_sys[LD_WHITE].fwd_led_curr,
-                "fwd_led_volt", Gb_ld_sys[LD_WHITE].fwd_led_volt,
-                "numb_leds", Gb_ld_sys[LD_WHITE].numb_leds,
-                "wave_length", Gb_ld_sys[LD_WHITE].wave_length,
-            "ld_blue",
-                "model", Gb_ld_sys[LD_BLUE].model,
-                "version", Gb_ld_sys[LD_BLUE].version,
-                "name", Gb_ld_sys[LD_BLUE].name,
-                "default_on", Gb_ld_sys[LD_BLUE].default_on,
-                "autocommit", Gb_ld_sys[LD_BLUE].autocommit,
-                "fwd_led_curr", Gb_ld_sys[LD_BLUE].fwd_led_curr,
-                "fwd_led_volt", Gb_ld_sys[LD_BLUE].fwd_led_volt,
-                "numb_leds", Gb_ld_sys[LD_BLUE].numb_leds,
-                "wave_length", Gb_ld_sys[LD_BLUE].wave_length,
-            "ld_red",
-                "model", Gb_ld_sys[LD_RED].model,
-                "version", Gb_ld_sys[LD_RED].version,
-                "name", Gb_ld_sys[LD_RED].name,
-                "default_on", Gb_ld_sys[LD_RED].default_on,
-                "autocommit", Gb_ld_sys[LD_RED].autocommit,
-                "fwd_led_curr", Gb_ld_sys[LD_RED].fwd_led_curr,
-                "fwd_led_volt", Gb_ld_sys[LD_RED].fwd_led_volt,
-                "numb_leds", Gb_ld_sys[LD_RED].numb_leds,
-                "wave_length", Gb_ld_sys[LD_RED].wave_length);
+    char key[32];
+    ldBoard_t ld;
+    json_t * j_body = json_object();
+
+    FOR_EACH_LED(ld) {
+        snprintf(key, sizeof(key), "ld_%s", Gb_ch.chan[ld].name);
+        json_object_set_new(j_body, key, json_pack("{sssssssbsbsisisisi}",
+                "model", Gb_ld_sys[ld].model,
+                "version", Gb_ld_sys[ld].version,
+                "name", Gb_ld_sys[ld].name,
+                "default_on", Gb_ld_sys[ld].default_on,
+                "autocommit", Gb_ld_sys[ld].autocommit,
+                "fwd_led_curr", Gb_ld_sys[ld].fwd_led_curr,
+                "fwd_led_volt", Gb_ld_sys[ld].fwd_led_volt,
+                "numb_leds", Gb_ld_sys[ld].numb_leds,
+                "wave_length", Gb_ld_sys[ld].wave_length));
+    }
 
     ulfius_set_json_body_response(response, 200, j_body);
     json_decref(j_body);
@@ -216,46 +365,27 @@ int callback_gb_system (const struct _u_request * request, struct _u_response *
   return U_CALLBACK_CONTINUE;
 }
 
+/* Body of /config: the running config and its version. NULL if it does not fit. */
+const char *rest_config_body(size_t *len)
+{
+    const gbCfg_t *cfg = cfg_hold();
+    jwBuf_t *w = jw_begin();
+
+    jw_obj(w, NULL);
+    jw_int(w, "version", cfg_version_of(cfg));
+    cfg_to_jw(w, cfg);
+    jw_obj_end(w);
+    cfg_release(cfg);
+    return jw_end(w, len);
+}
+
 //sends a json
 int callback_gb_config (const struct _u_request * request, struct _u_response * response, void * user_data) {
-    int i;
-    json_t *array_w = json_array();
-    json_t *array_b = json_array();
-    json_t *array_r = json_array();
-    json_t *j_body;
-
-    for (i = 0; i < ROUT_STEP; i++) {
-        json_array_append_new(array_w, json_integer(Gb_cfg.ld_spec[LD_WHITE][i]));
-        json_array_append_new(array_b, json_integer(Gb_cfg.ld_spec[LD_BLUE][i]));
-        json_array_append_new(array_r, json_integer(Gb_cfg.ld_spec[LD_RED][i]));
-    }
 
-    j_body = json_pack("{sbs{s{sbsisi}s{sbsisi}s{sbsisi}}s{sososo}}",
-            "ld_instant_mode", Gb_cfg.ld_instant_mode,
-            "ld_instant",
-                "white",
-                    "enable", Gb_cfg.ld_instant[LD_WHITE].enable,
-                    "vset", Gb_cfg.ld_instant[LD_WHITE].vset,
-                    "cset", Gb_cfg.ld_instant[LD_WHITE].cset, 
-                "blue",
-                    "enable", Gb_cfg.ld_instant[LD_BLUE].enable,
-                    "vset", Gb_cfg.ld_instant[LD_BLUE].vset,
-                    "cset", Gb_cfg.ld_instant[LD_BLUE].cset, 
-                "red",
-                    "enable", Gb_cfg.ld_instant[LD_RED].enable,
-                    "vset", Gb_cfg.ld_instant[LD_RED].vset,
-                    "cset", Gb_cfg.ld_instant[LD_RED].cset,
-            "ld_spec",
-                "white", array_w,
-                "blue", array_b,
-                "red", array_r);
+    size_t len;
+    const char *body = rest_config_body(&len);
 
-    ulfius_set_json_body_response(response, 200, j_body);
-
-    json_decref(j_body);
-    json_decref(array_w);
-    json_decref(array_b);
-    json_decref(array_r);
+    rest_body_response(response, "config", body, len);
 
   return U_CALLBACK_CONTINUE;
 }
@@ -271,100 +401,350 @@ int callback_gb_config (const struct _u_request * request, struct _u_response *
  *      "red_intensity": 88
  *      "light_spec": [[0, 100, 100, 75, 100, 100, 75, 0, 0], [0, 0, 0, 80, 40, 10, 0, 3, 0],…]
  *}
+ * There is a <name>_intensity and a light_spec entry per led channel, in the registry order.
+ * Each light_spec entry can also be a list of [minute_of_day, percent] breakpoints:
+ *      [[0, 0], [390, 0], [420, 60], [1080, 60], [1140, 0]]
+ * The request is only validated here and queued as a job. It answers 202 with the job id,
+ * the result can be followed on /GBBL/jobs/<id>.
  */
 int callback_post_config (const struct _u_request * request, struct _u_response * response, void * user_data) {
     
-    bool save, instant_mode, enable, en;
-    int ret=0, count=0;
-    unsigned int intens, curr;
+    gbJob_t job;
+    int id;
+    ldBoard_t ld;
+    char key[32];
     char * response_body;
+    char location[32];
+    json_t * j_value;
     json_t * json_body_req = ulfius_get_json_body_request(request, NULL);
-    
-    save = json_boolean_value(json_object_get(json_body_req,"save_cfg"));
-    instant_mode = json_boolean_value(json_object_get(json_body_req,"instant_mode"));
-    en = json_boolean_value(json_object_get(json_body_req,"enable"));
+
+    if (!json_is_object(json_body_req)) {
+        ulfius_set_string_body_response(response, 400, "Invalid config: body must be a json object\n");
+        json_decref(json_body_req);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.save = json_boolean_value(json_object_get(json_body_req,"save_cfg"));
+    job.enable = json_boolean_value(json_object_get(json_body_req,"enable"));
+    job.type = json_boolean_value(json_object_get(json_body_req,"instant_mode")) ? JOB_INSTANT : JOB_SPECTRUM;
     
     /* Check the Mode of Operation */
-    if (instant_mode) {
+    if (job.type == JOB_INSTANT) {
         //Instant Mode
-
-        //White
-        intens = json_integer_value(json_object_get(json_body_req,"white_intensity"));
-        curr = get_curr_from_perc(LD_WHITE, intens);
-        enable = (en & intens);
-        if ((ld_set_current(LD_WHITE, curr) < 0) || (ld_set_output(LD_WHITE, enable) < 0))
-            ret |= 1;
-        else {
-            Gb_cfg.ld_instant[LD_WHITE].cset = curr;
-            Gb_cfg.ld_instant[LD_WHITE].enable = enable;
-        }
-
-        //Blue
-        intens = json_integer_value(json_object_get(json_body_req,"blue_intensity"));
-        curr = get_curr_from_perc(LD_BLUE, intens);
-        enable = (en & intens);
-        if ((ld_set_current(LD_BLUE, curr) < 0) || (ld_set_output(LD_BLUE, enable) < 0))
-            ret |= 2;
-        else {
-            Gb_cfg.ld_instant[LD_BLUE].cset = curr;
-            Gb_cfg.ld_instant[LD_BLUE].enable = enable;
+        FOR_EACH_LED(ld) {
+            snprintf(key, sizeof(key), "%s_intensity", Gb_ch.chan[ld].name);
+            j_value = json_object_get(json_body_req, key);
+            if (j_value && (!json_is_integer(j_value) ||
+                        (json_integer_value(j_value) < 0) || (json_integer_value(j_value) > 100)))
+                goto invalid;
+            job.intens[ld] = (unsigned char) json_integer_value(j_value);
         }
-
-        //RED
-        intens = json_integer_value(json_object_get(json_body_req,"red_intensity"));
-        curr = get_curr_from_perc(LD_RED, intens);
-        enable = (en & intens);
-        if ((ld_set_current(LD_RED, curr) < 0) || (ld_set_output(LD_RED, enable) < 0))
-            ret |= 4;
-        else {
-            Gb_cfg.ld_instant[LD_RED].cset = curr;
-            Gb_cfg.ld_instant[LD_RED].enable = enable;
-        }
-
     } else {
         //Spectrum Mode
-        int a, e;
-        unsigned char *p = &(Gb_cfg.ld_spec[0][0]);
-        json_t * j_element, * j_array;
         json_t * j_obj = json_object_get(json_body_req,"light_spec");
 
-        //Iterate over Json points
-        json_array_foreach(j_obj, a, j_array) {
-            json_array_foreach(j_array, e, j_element) {
-                count++;
-                if(count <= LD_NUMB*ROUT_STEP) {
-                    *p = (unsigned char) json_integer_value(j_element);
-                    p++;
-                } else
-                    ret |= 8;
-            }
+        if (!json_is_array(j_obj) || (json_array_size(j_obj) != Gb_ch.numb))
+            goto invalid;
+
+        job.spec = malloc(Gb_ch.numb*sizeof(ldSpec_t));
+        if (job.spec == NULL) {
+            ulfius_set_string_body_response(response, 500, "Unable to allocate the spectrum\n");
+            json_decref(json_body_req);
+            return U_CALLBACK_CONTINUE;
         }
-        //Generate intemediate points
-        ld_generate_points();
-        ld_daily_routine(1);
+
+        FOR_EACH_LED(ld)
+            if (cfg_parse_spec(json_array_get(j_obj, ld), &job.spec[ld]))
+                goto invalid;
+    }
+    json_decref(json_body_req);
+
+    id = job_submit(&job);
+    if (id < 0) {
+        free(job.spec);
+        gb_log(LOG_ERR, "Job queue is full, config refused.");
+        ulfius_set_string_body_response(response, 503, "Job queue is full, try again later\n");
+        return U_CALLBACK_CONTINUE;
     }
 
-    Gb_cfg.ld_instant_mode = instant_mode;
+    snprintf(location, sizeof(location), PREFIX "/jobs/%d", id);
+    u_map_put(response->map_header, "Location", location);
 
-    if (save) {
-        cfg_save(&Gb_cfg);
+    response_body = msprintf("{\"job_id\":%d,\"state\":\"%s\",\"location\":\"%s\"}", id, job_state_str(JOB_QUEUED), location);
+    u_map_put(response->map_header, "Content-Type", "application/json");
+    ulfius_set_string_body_response(response, 202, response_body);
+    o_free(response_body);
+    return U_CALLBACK_CONTINUE;
+
+invalid:
+    ulfius_set_string_body_response(response, 400, "Invalid config: intensities must be 0 to 100 and light_spec "
+            "points 0 to 100, or [minute, percent] breakpoints with increasing minutes up to 1440\n");
+    free(job.spec);
+    json_decref(json_body_req);
+    return U_CALLBACK_CONTINUE;
+}
+
+//sends a json with the state and the per led driver result of a job
+int callback_gb_job (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    gbJob_t job;
+    ldBoard_t ld;
+    char *end;
+    const char *str_id = u_map_get(request->map_url, "id");
+    unsigned long id = str_id ? strtoul(str_id, &end, 10) : 0;
+    json_t *j_lds, *j_body;
+
+    if ((str_id == NULL) || (*end != '\0') || (job_get(id, &job) != 0)) {
+        ulfius_set_string_body_response(response, 404, "GreenBubble - Job not found");
+        return U_CALLBACK_CONTINUE;
     }
 
-    if (ret) {
-        response_body = msprintf("Error setting config: Code %i\n", ret);
-        syslog(LOG_ERR, response_body);
-        ulfius_set_string_body_response(response, 500, response_body);
-        o_free(response_body);
-        json_decref(json_body_req);
+    j_lds = json_object();
+    FOR_EACH_LED(ld)
+        json_object_set_new(j_lds, Gb_ch.chan[ld].name, json_string(job_ld_result_str(job.ld_result[ld])));
+
+    j_body = json_pack("{sisssssbsiso}",
+            "job_id", job.id,
+            "type", job_type_str(job.type),
+            "state", job_state_str(job.state),
+            "save_cfg", job.save,
+            "code", job.ret,
+            "channels", j_lds);
+
+    ulfius_set_json_body_response(response, 200, j_body);
+    json_decref(j_body);
+
+  return U_CALLBACK_CONTINUE;
+}
+
+//sends a json with the timers and how late they fired (jitter, us)
+int callback_gb_sched (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    schedTimer_t t;
+    json_t *j_body = json_array();
+    int id;
+
+    for (id = 0; id < sched_count(); id++) {
+        if (sched_get(id, &t) != 0)
+            continue;
+        json_array_append_new(j_body, json_pack("{sssIsIsIsIsIsI}",
+                "name", t.name,
+                "deadline_ms", (json_int_t)(t.deadline/SCHED_MS),
+                "fired", (json_int_t)t.fired,
+                "jitter_last_us", (json_int_t)(t.jitter_last/1000),
+                "jitter_max_us", (json_int_t)(t.jitter_max/1000),
+                "jitter_avg_us", (json_int_t)(t.fired ? t.jitter_sum/t.fired/1000 : 0),
+                "late", (json_int_t)t.late));
+    }
+
+    ulfius_set_json_body_response(response, 200, j_body);
+    json_decref(j_body);
+
+  return U_CALLBACK_CONTINUE;
+}
+
+//sends a json with the event loop handlers and how long each one kept the loop busy (us)
+int callback_gb_loop (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    loopHandler_t h;
+    json_t *j_body = json_array();
+    int id;
+
+    for (id = 0; id < loop_count(); id++) {
+        if (loop_get(id, &h) != 0)
+            continue;
+        json_array_append_new(j_body, json_pack("{sssbsIsIsIsI}",
+                "name", h.name,
+                "active", h.fd >= 0,
+                "calls", (json_int_t)h.calls,
+                "latency_last_us", (json_int_t)(h.latency_last/1000),
+                "latency_max_us", (json_int_t)(h.latency_max/1000),
+                "latency_avg_us", (json_int_t)(h.calls ? h.latency_sum/h.calls/1000 : 0)));
+    }
+
+    ulfius_set_json_body_response(response, 200, j_body);
+    json_decref(j_body);
+
+  return U_CALLBACK_CONTINUE;
+}
+
+//sends a json with the regulation loop: step latency (us) and the error of each led channel (mA)
+int callback_gb_regul (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    regulStats_t st;
+    ldBoard_t ld;
+    json_t *j_lds = json_object();
+    json_t *j_body;
+
+    regul_get(&st);
+
+    FOR_EACH_LED(ld)
+        json_object_set_new(j_lds, Gb_ch.chan[ld].name, json_pack("{sisisisisisb}",
+                "target", Gb_ch.target[ld],
+                "current", Gb_ch.cout[ld],
+                "error", Gb_ch.error[ld],
+                "trim", Gb_ch.trim[ld],
+                "vset", Gb_ch.vset[ld],
+                "constant_current", Gb_sts.ld_sts[ld].constant_current));
+
+    j_body = json_pack("{sisIsIsIsIso}",
+            "period_ms", st.period_ms,
+            "steps", (json_int_t)st.steps,
+            "latency_last_us", (json_int_t)(st.latency_last/1000),
+            "latency_max_us", (json_int_t)(st.latency_max/1000),
+            "latency_avg_us", (json_int_t)(st.steps ? st.latency_sum/st.steps/1000 : 0),
+            "channels", j_lds);
+
+    ulfius_set_json_body_response(response, 200, j_body);
+    json_decref(j_body);
+
+  return U_CALLBACK_CONTINUE;
+}
+
+//sends a json with the config versions that can be restored, newest (the running one) first
+int callback_gb_versions (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    cfgVersion_t list[CFG_VERSIONS];
+    json_t *j_body = json_array();
+    int i, n;
+
+    n = cfg_versions(list, CFG_VERSIONS);
+    for (i = 0; i < n; i++)
+        json_array_append_new(j_body, json_pack("{sisIss}",
+                "version", list[i].version,
+                "time", (json_int_t)list[i].time,
+                "source", list[i].source));
+
+    ulfius_set_json_body_response(response, 200, j_body);
+    json_decref(j_body);
+
+  return U_CALLBACK_CONTINUE;
+}
+
+/**
+ * Go back to a config version listed on /GBBL/config/versions. Like a post of config,
+ * it is queued as a job and answers 202 with the job id. Only what differs is sent to the drivers.
+ */
+int callback_post_rollback (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    gbJob_t job;
+    int id;
+    char *end;
+    char location[32];
+    char * response_body;
+    const char *str_version = u_map_get(request->map_url, "version");
+    unsigned long version = str_version ? strtoul(str_version, &end, 10) : 0;
+
+    memset(&job, 0, sizeof(job));
+    job.type = JOB_ROLLBACK;
+    job.save = true;
+    job.cfg = malloc(sizeof(gbCfg_t));
+    if (job.cfg == NULL) {
+        ulfius_set_string_body_response(response, 500, "Unable to allocate the config\n");
         return U_CALLBACK_CONTINUE;
     }
 
-    response_body = msprintf("%s:\nConfig Successfully Applied%s\n", instant_mode ? "Instant Control" : "Spectrum", save ? " and Saved." : ".");
-    syslog(LOG_INFO, response_body);
-    debug(response_body);
-  
-    ulfius_set_string_body_response(response, 200, response_body);
+    if ((str_version == NULL) || (*end != '\0') || (version > UINT_MAX) || cfg_version_get(version, job.cfg)) {
+        free(job.cfg);
+        ulfius_set_string_body_response(response, 404, "GreenBubble - Config version not found");
+        return U_CALLBACK_CONTINUE;
+    }
+
+    id = job_submit(&job);
+    if (id < 0) {
+        free(job.cfg);
+        gb_log(LOG_ERR, "Job queue is full, rollback refused.");
+        ulfius_set_string_body_response(response, 503, "Job queue is full, try again later\n");
+        return U_CALLBACK_CONTINUE;
+    }
+    gb_log(LOG_NOTICE, "Rolling the config back to version %lu.", version);
+
+    snprintf(location, sizeof(location), PREFIX "/jobs/%d", id);
+    u_map_put(response->map_header, "Location", location);
+
+    response_body = msprintf("{\"job_id\":%d,\"state\":\"%s\",\"location\":\"%s\"}", id, job_state_str(JOB_QUEUED), location);
+    u_map_put(response->map_header, "Content-Type", "application/json");
+    ulfius_set_string_body_response(response, 202, response_body);
     o_free(response_body);
-    json_decref(json_body_req);
     return U_CALLBACK_CONTINUE;
 }
+
+//sends the trace rings as Chrome trace events, open it on ui.perfetto.dev
+int callback_gb_trace (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    json_t *j_body = trace_to_json();
+
+    if (j_body == NULL) {
+        ulfius_set_string_body_response(response, 500, "Unable to export the trace\n");
+        return U_CALLBACK_CONTINUE;
+    }
+    ulfius_set_json_body_response(response, 200, j_body);
+    json_decref(j_body);
+
+  return U_CALLBACK_CONTINUE;
+}
+
+//turns the tracing on or off: {"enable": true}
+int callback_post_trace (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    json_t * json_body_req = ulfius_get_json_body_request(request, NULL);
+    json_t * j_enable = json_object_get(json_body_req, "enable");
+
+    if (!json_is_boolean(j_enable)) {
+        ulfius_set_string_body_response(response, 400, "Invalid trace: enable must be a boolean\n");
+        json_decref(json_body_req);
+        return U_CALLBACK_CONTINUE;
+    }
+    trace_enable(json_boolean_value(j_enable));
+    json_decref(json_body_req);
+
+    j_enable = json_pack("{sb}", "enable", trace_enabled());
+    ulfius_set_json_body_response(response, 200, j_enable);
+    json_decref(j_enable);
+
+  return U_CALLBACK_CONTINUE;
+}
+
+//sends the log level and the counters of the log ring
+int callback_gb_log (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    json_t *j_body = log_to_json();
+
+    ulfius_set_json_body_response(response, 200, j_body);
+    json_decref(j_body);
+
+  return U_CALLBACK_CONTINUE;
+}
+
+//sends the sink of the exporter, its state and the queued/spooled/sent/dropped counters
+int callback_gb_export (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    json_t *j_body = export_to_json();
+
+    ulfius_set_json_body_response(response, 200, j_body);
+    json_decref(j_body);
+
+  return U_CALLBACK_CONTINUE;
+}
+
+//sets the run time log level: {"level": "debug"}
+int callback_post_log (const struct _u_request * request, struct _u_response * response, void * user_data) {
+
+    json_t * json_body_req = ulfius_get_json_body_request(request, NULL);
+    int level = log_level_parse(json_string_value(json_object_get(json_body_req, "level")));
+    json_t *j_body;
+
+    json_decref(json_body_req);
+    if (level < 0) {
+        ulfius_set_string_body_response(response, 400, "Invalid log: level must be a syslog level, from emerg to debug\n");
+        return U_CALLBACK_CONTINUE;
+    }
+    log_set_level(level);
+
+    j_body = log_to_json();
+    ulfius_set_json_body_response(response, 200, j_body);
+    json_decref(j_body);
+
+  return U_CALLBACK_CONTINUE;
+}
@@ -23,8 +23,16 @@
 #define GB_REST_H
 
 #include <ulfius.h>
+#include <jansson.h>
 
-int rest_ulfius_init (struct _u_instance *instance);
+#define REST_PORT 8537 //Without -w
+
+int rest_ulfius_init (struct _u_instance *instance, unsigned int port);
 void rest_ulfius_stop (struct _u_instance *instance);
 
+// Response bodies, also used without a request (bench)
+const char *rest_status_body(size_t *len);
+const char *rest_config_body(size_t *len);
+json_t *rest_charts_json(const char *series, long long from, long long to, unsigned int max_points);
+
 #endif //GB_REST_H
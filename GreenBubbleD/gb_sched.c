@@ -0,0 +1,293 @@
+/*
+ * gb_sched.c:
+ *	Timer scheduler for the GreenBubble project
+ *	Timers have absolute CLOCK_REALTIME deadlines kept in a min-heap. A single
+ *	timerfd, handled by the event loop, is armed for the earliest one, so the
+ *	daemon only wakes up when something is due.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include <gb_sched.h>
+#include <gb_main.h>
+#include <gb_loop.h>
+#include <gb_trace.h>
+#include <gb_hal.h>
+#include <gb_log.h>
+
+static schedTimer_t Timers[SCHED_MAX];
+static int Timers_numb;
+static int Running = -1;            //Timer whose callback is running
+static bool Running_kicked;         //sched_set() received while it was running...
+static long long Running_kick;      //...with this deadline, 0 disarms it
+
+// Min-heap of the armed timers, by deadline
+static int Heap[SCHED_MAX];
+static int Heap_pos[SCHED_MAX];     //Position of each timer in the heap, -1 if not armed
+static int Heap_len;
+
+static int Tfd = -1;
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+
+/***************** HEAP *******************/
+
+static void heap_swap(int a, int b)
+{
+    int tmp = Heap[a];
+
+    Heap[a] = Heap[b];
+    Heap[b] = tmp;
+    Heap_pos[Heap[a]] = a;
+    Heap_pos[Heap[b]] = b;
+    return;
+}
+
+static void heap_up(int pos)
+{
+    while ((pos > 0) && (Timers[Heap[pos]].deadline < Timers[Heap[(pos-1)/2]].deadline)) {
+        heap_swap(pos, (pos-1)/2);
+        pos = (pos-1)/2;
+    }
+    return;
+}
+
+static void heap_down(int pos)
+{
+    int min, child;
+
+    while (1) {
+        min = pos;
+        child = 2*pos + 1;
+        if ((child < Heap_len) && (Timers[Heap[child]].deadline < Timers[Heap[min]].deadline))
+            min = child;
+        if ((child + 1 < Heap_len) && (Timers[Heap[child+1]].deadline < Timers[Heap[min]].deadline))
+            min = child + 1;
+        if (min == pos)
+            break;
+        heap_swap(pos, min);
+        pos = min;
+    }
+    return;
+}
+
+static void heap_remove(int id)
+{
+    int pos = Heap_pos[id];
+
+    if (pos < 0)
+        return;
+
+    Heap_len--;
+    if (pos != Heap_len) {
+        heap_swap(pos, Heap_len);
+        heap_up(pos);
+        heap_down(pos);
+    }
+    Heap_pos[id] = -1;
+    return;
+}
+
+/* Must hold the lock. Deadline 0 disarms the timer. */
+static void heap_set(int id, long long deadline)
+{
+    heap_remove(id);
+    Timers[id].deadline = deadline;
+    if (deadline == 0)
+        return;
+
+    Heap[Heap_len] = id;
+    Heap_pos[id] = Heap_len;
+    Heap_len++;
+    heap_up(Heap_len - 1);
+    return;
+}
+
+/* Must hold the lock. Arm the timerfd for the earliest deadline, on the system clock (a replay runs its own). */
+static void sched_arm(void)
+{
+    struct itimerspec its;
+    long long deadline;
+
+    memset(&its, 0, sizeof(its));
+    if (Heap_len > 0) {
+        deadline = hal_clock_to_sys(Timers[Heap[0]].deadline);
+        its.it_value.tv_sec = deadline / 1000000000LL;
+        its.it_value.tv_nsec = deadline % 1000000000LL;
+    }
+
+    if (timerfd_settime(Tfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) < 0)
+        gb_log(LOG_ERR, "Unable to arm the scheduler timer: %s", strerror(errno));
+    return;
+}
+
+/***************** DISPATCH *******************/
+
+/* Event loop handler of the timerfd: run the due timers and arm it for the next one */
+static void sched_dispatch(int fd, uint32_t events, void *arg)
+{
+    uint64_t expirations;
+    long long now, next, jitter;
+    schedTimer_t *t;
+    int id;
+
+    if (read(Tfd, &expirations, sizeof(expirations)) < 0) {
+        if (errno == ECANCELED) {
+            //Wall clock was set: deadlines are absolute, fire the ones that depend on the time of day
+            gb_log(LOG_NOTICE, "System clock changed, rescheduling timers.");
+            now = sched_now();
+            pthread_mutex_lock(&Lock);
+            for (id = 0; id < Timers_numb; id++)
+                if ((Timers[id].flags & SCHED_F_CLOCK) && (Timers[id].deadline != 0))
+                    heap_set(id, now);
+            pthread_mutex_unlock(&Lock);
+        } else if (errno != EAGAIN) {
+            gb_log(LOG_ERR, "Scheduler timer failed: %s", strerror(errno));
+        }
+    }
+
+    pthread_mutex_lock(&Lock);
+    now = sched_now();
+    while ((Heap_len > 0) && (Timers[Heap[0]].deadline <= now)) {
+        id = Heap[0];
+        t = &Timers[id];
+        jitter = now - t->deadline;
+        t->fired++;
+        t->jitter_last = jitter;
+        t->jitter_sum += jitter;
+        if (jitter > t->jitter_max)
+            t->jitter_max = jitter;
+        heap_set(id, 0);
+
+        Running = id;
+        Running_kicked = false;
+        pthread_mutex_unlock(&Lock);
+
+        TRACE_BEGIN("timer", t->name);
+        next = t->fn(t->arg, now);
+        TRACE_END("timer", t->name);
+
+        pthread_mutex_lock(&Lock);
+        Running = -1;
+        //A deadline already past would run it again right away, forever: one ms later at least
+        if ((next != 0) && (next <= now)) {
+            if (t->late++ == 0)
+                gb_log(LOG_WARNING, "Timer %s asked for a deadline already past, run 1 ms later.", t->name);
+            next = now + SCHED_MS;
+        }
+        if (Running_kicked && ((Running_kick == 0) || (next == 0) || (Running_kick < next)))
+            next = Running_kick;
+        heap_set(id, next);
+        now = sched_now();
+    }
+    sched_arm();
+    pthread_mutex_unlock(&Lock);
+    return;
+}
+
+/***************** API *******************/
+
+long long sched_now(void)
+{
+    return hal_clock_ns(CLOCK_REALTIME);
+}
+
+/* The timers run on the event loop, it must be initialized first */
+int sched_init(void)
+{
+    Tfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (Tfd < 0) {
+        gb_log(LOG_CRIT, "Unable to create the scheduler timer: %s", strerror(errno));
+        return -1;
+    }
+    if (loop_add("timers", Tfd, EPOLLIN, sched_dispatch, NULL) < 0)
+        return -1;
+
+    pthread_mutex_lock(&Lock);
+    sched_arm();
+    pthread_mutex_unlock(&Lock);
+    return 0;
+}
+
+/* Register a timer. Deadline 0 adds it disarmed, to be armed later with sched_set(). */
+int sched_add(const char *name, schedFn_t fn, void *arg, long long deadline, int flags)
+{
+    int id;
+
+    pthread_mutex_lock(&Lock);
+    if (Timers_numb >= SCHED_MAX) {
+        pthread_mutex_unlock(&Lock);
+        gb_log(LOG_ERR, "Too many timers, %s not scheduled.", name);
+        return -1;
+    }
+
+    id = Timers_numb++;
+    memset(&Timers[id], 0, sizeof(Timers[id]));
+    Timers[id].name = name;
+    Timers[id].fn = fn;
+    Timers[id].arg = arg;
+    Timers[id].flags = flags;
+    Heap_pos[id] = -1;
+    heap_set(id, deadline);
+    if ((Tfd >= 0) && (Heap_len > 0) && (Heap[0] == id))
+        sched_arm();
+    pthread_mutex_unlock(&Lock);
+
+    return id;
+}
+
+/* Move the deadline of a timer, from any thread. Deadline 0 disarms it. */
+void sched_set(int id, long long deadline)
+{
+    if ((id < 0) || (id >= Timers_numb))
+        return;
+
+    pthread_mutex_lock(&Lock);
+    if (id == Running) {
+        Running_kicked = true;
+        Running_kick = deadline;
+    } else {
+        heap_set(id, deadline);
+        sched_arm();
+    }
+    pthread_mutex_unlock(&Lock);
+    return;
+}
+
+int sched_count(void)
+{
+    return Timers_numb;
+}
+
+/* Copy of a timer with its statistics */
+int sched_get(int id, schedTimer_t *timer)
+{
+    if ((id < 0) || (id >= Timers_numb))
+        return -1;
+
+    pthread_mutex_lock(&Lock);
+    *timer = Timers[id];
+    pthread_mutex_unlock(&Lock);
+    return 0;
+}
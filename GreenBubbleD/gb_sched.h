@@ -0,0 +1,61 @@
+/*
+ * gb_sched.h:
+ *	Timer scheduler for the GreenBubble project
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef GB_SCHED_H
+#define GB_SCHED_H
+
+#include <gb_main.h>
+
+/***************** DEFINES & ENUMS *******************/
+
+#define SCHED_MAX 16
+#define SCHED_MS  1000000LL //ns in a ms, deadlines are CLOCK_REALTIME ns
+
+#define SCHED_F_CLOCK 1 //Also fire when the wall clock is set (ntp, manual change)
+
+/*
+ * Timer callback. Returns the next absolute deadline (ns) or 0 to disarm the timer.
+ * A deadline already past is run 1 ms later, counted in late.
+ */
+typedef long long (*schedFn_t)(void *arg, long long now);
+
+typedef struct {
+    const char *name;
+    schedFn_t fn;
+    void *arg;
+    int flags;
+    long long deadline;     //ns, 0 when disarmed
+    unsigned long fired;
+    long long jitter_last;  //ns between the deadline and the call
+    long long jitter_max;
+    long long jitter_sum;
+    unsigned long late;     //Deadlines returned already past, run one ms later instead
+} schedTimer_t;
+
+/***************** FUNCTIONS *******************/
+int sched_init(void);
+int sched_add(const char *name, schedFn_t fn, void *arg, long long deadline, int flags);
+void sched_set(int id, long long deadline);
+long long sched_now(void);
+int sched_count(void);
+int sched_get(int id, schedTimer_t *timer);
+
+#endif //GB_SCHED_H
@@ -22,82 +22,153 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
-#include <wiringPi.h>
-#include <wiringSerial.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "gb_serial.h"
 #include "gb_main.h"
 #include "gb_gpio.h"
+#include "gb_hal.h"
+#include "gb_snap.h"
+#include "gb_trace.h"
 
-#define CHECK(x) if ((Fd < 0) || (x >= LD_NUMB) || (Gb_ld_sys[x].device_ok == false)) return -1
+#define CHECK(x) if ((Fd < 0) || (x >= Gb_ch.numb) || (Gb_ld_sys[x].device_ok == false)) return -1
 
 int Fd = -1;
 char Rd_buffer[512];
 char Driver[17];
 
+// One transaction at a time on the bus: select, command and feedback.
+// The main loop and the job worker both talk to the drivers.
+static pthread_mutex_t Bus_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Pins of the chip select mux, bit 0 and bit 1 of the channel address
+static const int Mux_pins[] = { BCM_23, BCM_22 };
+
+/* The chip select mux picks the driver, both pins change at once where the backend can */
 static void ld_select_driver(ldBoard_t color)
 {
-    switch (color) {
-        case LD_WHITE:
-            digitalWrite(BCM_22, LOW);
-            digitalWrite(BCM_23, LOW);
-            strcpy(Driver, "LED_WHITE");
-            break;
-        case LD_BLUE:
-            digitalWrite(BCM_22, LOW);
-            digitalWrite(BCM_23, HIGH);
-            strcpy(Driver, "LED_BLUE");
-            break;
-        case LD_RED:
-            digitalWrite(BCM_22, HIGH);
-            digitalWrite(BCM_23, LOW);
-            strcpy(Driver, "LED_RED");
-            break;
-    }
-    serialFlush(Fd);
+    TRACE_BEGIN("serial", "mux");
+    hal_gpio_write_lines(Mux_pins, 2, Gb_ch.chan[color].cs);
+    strcpy(Driver, Gb_ch.chan[color].driver);
+    TRACE_END("serial", "mux");
+
+    TRACE_BEGIN("serial", "flush");
+    hal_uart_flush(Fd);
+    TRACE_END("serial", "flush");
     return;
 }
 
+/* Wait for the feedback of the driver, up to LD_FEEDBACK_MS. The thread sleeps in poll() between bytes. */
 static int ld_read_feedback()
 {
-    unsigned int start = millis();
-    int i = 0;
-    
-    while ((millis() - start) < 10) {
-        if (serialDataAvail(Fd)) {
-             Rd_buffer[i] = serialGetchar(Fd);
-             if ((i >= 2) && (strncmp((Rd_buffer + i-2), "OK\n", 3) == 0))
-                 break;
-             if ((i >= 2) && (strncmp((Rd_buffer + i-2), "E!\n", 3) == 0)) {
-                 errno = EBADMSG;
-                 break;
-             }
-             i++;
+    struct pollfd pfd = { .fd = Fd, .events = POLLIN };
+    long long deadline, left;
+    size_t i = 0;
+    ssize_t n;
+    int ret = -1;
+
+    deadline = hal_clock_ns(CLOCK_MONOTONIC)/1000000 + LD_FEEDBACK_MS;
+    errno = ETIMEDOUT;
+
+    while (i < sizeof(Rd_buffer) - 1) {
+        left = deadline - hal_clock_ns(CLOCK_MONOTONIC)/1000000;
+        if (left <= 0)
+            break;
+
+        n = poll(&pfd, 1, (int)left);
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = ETIMEDOUT;
+            break;
         }
-    } 
-    if ((errno != 0) || (errno != EBADMSG))
-        errno = EIO;
 
-    Rd_buffer[i+1]='\0';
-    serialFlush(Fd);
+        n = hal_uart_read(Fd, Rd_buffer + i, sizeof(Rd_buffer) - 1 - i);
+        if (n <= 0) {
+            if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+                continue;
+            errno = EIO;
+            break;
+        }
+        i += n;
+        Rd_buffer[i] = '\0';
+
+        if ((i >= 3) && (strcmp(Rd_buffer + i-3, "OK\n") == 0)) {
+            ret = 0;
+            break;
+        }
+        if ((i >= 3) && (strcmp(Rd_buffer + i-3, "E!\n") == 0)) {
+            errno = EBADMSG;
+            break;
+        }
+    }
+    Rd_buffer[i] = '\0';
+    hal_uart_flush(Fd);
 
-    if (errno) {
-        fprintf (stderr, "%s: Unable to complete serial reading: %s\n", Driver, strerror(errno));
+    if (ret < 0) {
+        gb_log(LOG_DEBUG, "%s: Unable to complete serial reading: %s\n", Driver, strerror(errno));
         return -1;
     }
 
     return 0;
 }
 
+static void ld_bus_lock(void)
+{
+    TRACE_BEGIN("serial", "bus_lock");
+    pthread_mutex_lock(&Bus_lock);
+    TRACE_END("serial", "bus_lock");
+    return;
+}
+
+/* Must hold Bus_lock. Run a full transaction with the driver and copy its feedback into reply */
+static int ld_transfer(ldBoard_t color, const char *cmd, char *reply, size_t len)
+{
+    int ret;
+
+    TRACE_BEGIN("serial", "ld_command");
+    ld_select_driver(color);
+
+    TRACE_BEGIN("serial", "write");
+    hal_uart_write(Fd, cmd);
+    TRACE_END("serial", "write");
+
+    TRACE_BEGIN("serial", "reply");
+    ret = ld_read_feedback();
+    TRACE_END("serial", "reply");
+    if (!ret && reply) {
+        strncpy(reply, Rd_buffer, len - 1);
+        reply[len - 1] = '\0';
+    }
+    TRACE_END("serial", "ld_command");
+
+    return ret;
+}
+
+static int ld_command(ldBoard_t color, const char *cmd, char *reply, size_t len)
+{
+    int ret;
+
+    ld_bus_lock();
+    ret = ld_transfer(color, cmd, reply, len);
+    pthread_mutex_unlock(&Bus_lock);
+
+    return ret;
+}
+
 static int ld_onoff2bool(char *str_sts, bool *bool_sts)
 {
     if (strncmp(str_sts, "ON", 2) == 0)
-        *bool_sts = TRUE;
+        *bool_sts = true;
     else if (strncmp(str_sts, "OFF", 3) == 0)
-        *bool_sts = FALSE;
+        *bool_sts = false;
     else {
         errno = EINVAL;
-        fprintf (stderr, "%s: Error reading ON/OFF parameter: %s\n", Driver, str_sts);
+        gb_log(LOG_DEBUG, "%s: Error reading ON/OFF parameter: %s\n", Driver, str_sts);
         return -1;
     }
 
@@ -107,19 +178,20 @@ static int ld_onoff2bool(char *str_sts, bool *bool_sts)
 int ld_get_system(ldBoard_t color, ldSys_t *sys)
 {
     char sts1[5], sts2[5];
+    char reply[sizeof(Rd_buffer)];
+    int ret;
 
-    if ((Fd < 0) || (color >= LD_NUMB)) return -1; //Do not use check macro here
-
-    // Select the Board and send the command
-    ld_select_driver(color);
-    serialPrintf(Fd, "SYSTEM\n");
+    if ((Fd < 0) || (color >= Gb_ch.numb)) return -1; //Do not use check macro here
 
-    // Get the message
-    if (ld_read_feedback())
+    // Send the command and get the message
+    if (ld_command(color, "SYSTEM\n", reply, sizeof(reply)))
         return -1;
 
     // Parse the result
-    if (sscanf(Rd_buffer, "M: %s\r\nV: %s\r\nN: %s\r\nO: %s\r\nAC: %s\r\n", sys->model, sys->version, sys->name, sts1, sts2) == EOF)
+    TRACE_BEGIN("serial", "sscanf SYSTEM");
+    ret = sscanf(reply, "M: %s\r\nV: %s\r\nN: %s\r\nO: %s\r\nAC: %s\r\n", sys->model, sys->version, sys->name, sts1, sts2);
+    TRACE_END("serial", "sscanf SYSTEM");
+    if (ret == EOF)
         return -1;
     
     if (ld_onoff2bool(sts1, &sys->default_on)) return -1;
@@ -132,19 +204,20 @@ int ld_get_config(ldBoard_t color, ldCfg_t *cfg)
 {
     char sts1[5];
     float fv, fc;
+    char reply[sizeof(Rd_buffer)];
+    int ret;
 
     CHECK(color);
     
-    // Select the Board and send the command
-    ld_select_driver(color);
-    serialPrintf(Fd, "CONFIG\n");
-
-    // Get the message
-    if (ld_read_feedback())
+    // Send the command and get the message
+    if (ld_command(color, "CONFIG\n", reply, sizeof(reply)))
         return -1;
 
     // Parse the result
-    if (sscanf(Rd_buffer, "OUTPUT: %s\r\nVSET: %f\r\nCSET: %f\r\n", sts1, &fv, &fc) == EOF)
+    TRACE_BEGIN("serial", "sscanf CONFIG");
+    ret = sscanf(reply, "OUTPUT: %s\r\nVSET: %f\r\nCSET: %f\r\n", sts1, &fv, &fc);
+    TRACE_END("serial", "sscanf CONFIG");
+    if (ret == EOF)
         return -1;
     
     cfg->vset = (unsigned int)(fv*1000); //convert to mV
@@ -159,20 +232,21 @@ int ld_get_status(ldBoard_t color, ldSts_t *sts)
 {
     char sts1[5], sts2[10];
     float fvi, fv, fc;
+    char reply[sizeof(Rd_buffer)];
+    int ret;
 
     CHECK(color);
     
-    // Select the Board and send the command
-    ld_select_driver(color);
-    serialPrintf(Fd, "STATUS\n");
-
-    // Get the message
-    if (ld_read_feedback())
+    // Send the command and get the message
+    if (ld_command(color, "STATUS\n", reply, sizeof(reply)))
         return -1;
 
     // Parse the result
-    if (sscanf(Rd_buffer, "OUTPUT: %s\r\nVIN: %f %u\r\nVOUT: %f %u\r\nCOUT: %f %u\r\nCONSTANT: %s\r\n",
-            sts1, &fvi, &sts->vin_raw, &fv, &sts->vout_raw, &fc, &sts->cout_raw, sts2) == EOF)
+    TRACE_BEGIN("serial", "sscanf STATUS");
+    ret = sscanf(reply, "OUTPUT: %s\r\nVIN: %f %u\r\nVOUT: %f %u\r\nCOUT: %f %u\r\nCONSTANT: %s\r\n",
+            sts1, &fvi, &sts->vin_raw, &fv, &sts->vout_raw, &fc, &sts->cout_raw, sts2);
+    TRACE_END("serial", "sscanf STATUS");
+    if (ret == EOF)
         return -1;
 
     sts->vin = (unsigned int)(fvi*1000); //convert to mV
@@ -182,9 +256,9 @@ int ld_get_status(ldBoard_t color, ldSts_t *sts)
     if (ld_onoff2bool(sts1, &sts->enable)) return -1;
 
     if (strncmp(sts2, "VOLTAGE", 7) == 0)
-        sts->constant_current = FALSE;
+        sts->constant_current = false;
     else if (strncmp(sts2, "CURRENT", 7) == 0)
-        sts->constant_current = TRUE;
+        sts->constant_current = true;
     else {
         errno = EIO;
         return -1;
@@ -196,6 +270,8 @@ int ld_get_status(ldBoard_t color, ldSts_t *sts)
 int ld_set_voltage(ldBoard_t color, unsigned int voltage)
 {
     float fv;
+    char cmd[32];
+    int ret;
 
     CHECK(color);
 
@@ -207,20 +283,26 @@ int ld_set_voltage(ldBoard_t color, unsigned int voltage)
 
     fv = ((float)(voltage))/1000; //convert to 1.23 format
 
-    // Select the Board and send the command
-    ld_select_driver(color);
-    serialPrintf(Fd, "VOLTAGE %.2f\n", fv);
-
-    // Get the message
-    if (ld_read_feedback())
+    // Send the command and get the message
+    snprintf(cmd, sizeof(cmd), "VOLTAGE %.2f\n", fv);
+    //The registry is written with the bus held, in the order the drivers got the commands
+    ld_bus_lock();
+    ret = ld_transfer(color, cmd, NULL, 0);
+    if (!ret)
+        Gb_ch.vset[color] = voltage;
+    pthread_mutex_unlock(&Bus_lock);
+    if (ret)
         return -1;
 
+    snap_save_later();
     return 0;
 }
 
 int ld_set_current(ldBoard_t color, unsigned int current)
 {
     float fc;
+    char cmd[32];
+    int ret;
 
     CHECK(color);
 
@@ -229,27 +311,45 @@ int ld_set_current(ldBoard_t color, unsigned int current)
 
     fc = ((float)(current))/1000; //convert to 1.23 format
 
-    // Select the Board and send the command
-    ld_select_driver(color);
-    serialPrintf(Fd, "CURRENT %.2f\n", fc);
-
-    // Get the message
-    if (ld_read_feedback())
+    // Send the command and get the message
+    snprintf(cmd, sizeof(cmd), "CURRENT %.2f\n", fc);
+    //Keep the registry setpoint, routine and jobs skip commands that change nothing
+    ld_bus_lock();
+    ret = ld_transfer(color, cmd, NULL, 0);
+    if (ret)
+        LD_BIT_CLR(Gb_ch.setpoint_ok, color);
+    else {
+        Gb_ch.setpoint[color] = current;
+        LD_BIT_SET(Gb_ch.setpoint_ok, color);
+    }
+    pthread_mutex_unlock(&Bus_lock);
+    if (ret)
         return -1;
 
+    snap_save_later();
     return 0;
 }
 
 int ld_set_output(ldBoard_t color, bool output)
 {
+    int ret;
+
     CHECK(color);
     
-    // Select the Board and send the command
-    ld_select_driver(color);
-    serialPrintf(Fd, "OUTPUT %b\n", output);
-
-    // Get the message
-    if (ld_read_feedback())
+    // Send the command and get the message, the registry keeps the output as for the setpoint
+    ld_bus_lock();
+    ret = ld_transfer(color, output ? "OUTPUT 1\n" : "OUTPUT 0\n", NULL, 0);
+    if (ret)
+        LD_BIT_CLR(Gb_ch.output_ok, color);
+    else {
+        if (output)
+            LD_BIT_SET(Gb_ch.output, color);
+        else
+            LD_BIT_CLR(Gb_ch.output, color);
+        LD_BIT_SET(Gb_ch.output_ok, color);
+    }
+    pthread_mutex_unlock(&Bus_lock);
+    if (ret)
         return -1;
 
     return 0;
@@ -259,7 +359,7 @@ unsigned int get_curr_from_perc(ldBoard_t color, unsigned char perc)
 {
     unsigned int curr;
 
-    if (color >= LD_NUMB) return 0;
+    if (color >= Gb_ch.numb) return 0;
     
     curr = (Gb_ld_sys[color].fwd_led_curr * perc)/100;
     if (curr > Gb_ld_sys[color].fwd_led_curr)
@@ -268,17 +368,36 @@ unsigned int get_curr_from_perc(ldBoard_t color, unsigned char perc)
        return curr; 
 }
 
+/* Same as above for a Q16 percentage, rounded to the resolution of the driver */
+unsigned int get_curr_from_perc_q(ldBoard_t color, unsigned int perc_q)
+{
+    unsigned long long curr;
+
+    if (color >= Gb_ch.numb) return 0;
+
+    curr = ((unsigned long long)Gb_ld_sys[color].fwd_led_curr * perc_q)/100;
+    curr = (curr + ((LD_CURR_STEP << ROUT_FRAC)/2)) / (LD_CURR_STEP << ROUT_FRAC) * LD_CURR_STEP;
+    if (curr > Gb_ld_sys[color].fwd_led_curr)
+       return Gb_ld_sys[color].fwd_led_curr;
+    else
+       return (unsigned int)curr;
+}
+
+/* Measured current as a percentage of the led current, a driver above it reads 100 and not a wrapped char */
 unsigned char get_perc_from_curr(ldBoard_t color, unsigned int curr)
 {
-    if (color >= LD_NUMB) return 0;
-    return (unsigned char) ((curr*100)/(Gb_ld_sys[color].fwd_led_curr));
+    unsigned int perc;
+
+    if (color >= Gb_ch.numb) return 0;
+    perc = (curr*100)/(Gb_ld_sys[color].fwd_led_curr);
+    return (unsigned char) MAX_LIMIT(perc, 100);
 }
 
 int ld_serial_init()
 {
-	Fd = serialOpen("/dev/ttyAMA0", 38400);
+	Fd = hal_uart_open("/dev/ttyAMA0", 38400);
 	if (Fd < 0)
-		fprintf (stderr, "Unable to open serial device: %s\n", strerror(errno));
+		gb_log(LOG_ERR, "Unable to open serial device: %s\n", strerror(errno));
 		
 	return Fd;
 }
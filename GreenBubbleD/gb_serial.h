@@ -24,6 +24,9 @@
 
 #include "gb_main.h"
 
+#define LD_CURR_STEP 10 //mA - Resolution of the CURRENT command (A with 2 decimals)
+#define LD_FEEDBACK_MS 10 //Time a driver has to answer a command
+
 int ld_get_system(ldBoard_t color, ldSys_t *sys);
 int ld_get_config(ldBoard_t color, ldCfg_t *cfg);
 int ld_get_status(ldBoard_t color, ldSts_t *sts);
@@ -32,6 +35,7 @@ int ld_set_current(ldBoard_t color, unsigned int current);
 int ld_set_output(ldBoard_t color, bool output);
 int ld_serial_init();
 unsigned int get_curr_from_perc(ldBoard_t color, unsigned char perc);
+unsigned int get_curr_from_perc_q(ldBoard_t color, unsigned int perc_q);
 unsigned char get_perc_from_curr(ldBoard_t color, unsigned int curr);
 
 #endif //GB_SERIAL_H
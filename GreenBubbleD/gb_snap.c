@@ -0,0 +1,305 @@
+/*
+ * gb_snap.c:
+ *	Binary state snapshot for a fast startup of the GreenBubble project
+ *	The registry, the driver identities, the setpoints and the running config are
+ *	written to GB.snap on change and at shutdown. On boot the snapshot is mapped and
+ *	the leds get their light back at once. Parsing CFG.json and probing each driver
+ *	with SYSTEM are skipped. The drivers are checked against it afterwards, on a
+ *	thread, and a channel that does not match gets its config again.
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <gb_snap.h>
+#include <gb_main.h>
+#include <gb_config.h>
+#include <gb_serial.h>
+#include <gb_led.h>
+#include <gb_sched.h>
+#include <gb_log.h>
+
+#define SNAP_TMP SNAP_FILE ".tmp"
+#define SNAP_CFG "./CFG.json"
+
+#define SNAP_NEAR(a, b, tol) (((a) > (b) ? (a) - (b) : (b) - (a)) <= (tol))
+
+static int Snap_timer = -1;
+static bool Dirty;
+static bool Validating;
+static pthread_t Validator;
+static ldSys_t Snap_sys[LD_MAX];    //Driver identities of the snapshot, for the validation
+
+/***************** FILE *******************/
+
+static uint32_t snap_sum(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* CFG.json the daemon was started with. A missing file gives -1. */
+static void snap_cfg_stat(int64_t *mtime, int64_t *size)
+{
+    struct stat st;
+
+    if (stat(SNAP_CFG, &st) < 0) {
+        *mtime = -1;
+        *size = -1;
+        return;
+    }
+    *mtime = (int64_t)st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+    *size = st.st_size;
+    return;
+}
+
+/* Written to a temporary file and renamed, a crash never leaves half a snapshot */
+void snap_save(void)
+{
+    const gbCfg_t *cfg;
+    gbSnap_t *snap;
+    int fd;
+    ssize_t len;
+
+    snap = calloc(1, sizeof(*snap));
+    if (snap == NULL)
+        return;
+
+    snap->ch = Gb_ch;
+    memcpy(snap->sys, Gb_ld_sys, sizeof(snap->sys));
+    cfg = cfg_hold();
+    snap->cfg = *cfg;
+    cfg_release(cfg);
+
+    snap->hdr.magic = SNAP_MAGIC;
+    snap->hdr.version = SNAP_VERSION;
+    snap->hdr.size = sizeof(*snap);
+    snap_cfg_stat(&snap->hdr.cfg_mtime, &snap->hdr.cfg_size);
+    snap->hdr.sum = snap_sum((char *)snap + sizeof(snap->hdr), sizeof(*snap) - sizeof(snap->hdr));
+
+    fd = open(SNAP_TMP, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        gb_log(LOG_ERR, "Unable to write the state snapshot: %s", strerror(errno));
+        free(snap);
+        return;
+    }
+    len = write(fd, snap, sizeof(*snap));
+    if ((len != (ssize_t)sizeof(*snap)) || (fsync(fd) < 0) || (close(fd) < 0) || (rename(SNAP_TMP, SNAP_FILE) < 0)) {
+        gb_log(LOG_ERR, "Unable to write the state snapshot: %s", strerror(errno));
+        unlink(SNAP_TMP);
+    }
+    free(snap);
+    Dirty = false;
+    return;
+}
+
+/*
+ * Restore the registry, the driver identities and the config from the snapshot.
+ * Returns -1 if there is none, or it does not belong to this build or to the current CFG.json.
+ */
+int snap_load(void)
+{
+    const gbSnap_t *snap;
+    gbCfg_t *cfg;
+    int64_t mtime, size;
+    struct stat st;
+    int fd, ret = -1;
+
+    fd = open(SNAP_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if ((fstat(fd, &st) < 0) || (st.st_size != sizeof(gbSnap_t))) {
+        close(fd);
+        gb_log(LOG_NOTICE, "State snapshot is from another build, not used.");
+        return -1;
+    }
+
+    snap = mmap(NULL, sizeof(*snap), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (snap == MAP_FAILED)
+        return -1;
+
+    snap_cfg_stat(&mtime, &size);
+    if ((snap->hdr.magic != SNAP_MAGIC) || (snap->hdr.version != SNAP_VERSION) || (snap->hdr.size != sizeof(*snap)) ||
+            (snap->hdr.sum != snap_sum((const char *)snap + sizeof(snap->hdr), sizeof(*snap) - sizeof(snap->hdr)))) {
+        gb_log(LOG_NOTICE, "State snapshot is invalid, not used.");
+        goto unmap;
+    }
+    if ((snap->hdr.cfg_mtime != mtime) || (snap->hdr.cfg_size != size)) {
+        gb_log(LOG_NOTICE, "Config file changed since the state snapshot, not used.");
+        goto unmap;
+    }
+    if ((snap->ch.numb == 0) || (snap->ch.numb > LD_MAX))
+        goto unmap;
+
+    Gb_ch = snap->ch;
+    memcpy(Gb_ld_sys, snap->sys, sizeof(Gb_ld_sys));
+    memcpy(Snap_sys, snap->sys, sizeof(Snap_sys));
+
+    cfg = cfg_begin();
+    memcpy(cfg, &snap->cfg, sizeof(*cfg));
+    if (cfg_commit(cfg, "snapshot") < 0)
+        goto unmap;
+
+    gb_log(LOG_NOTICE, "State restored from the snapshot.");
+    ret = 0;
+
+unmap:
+    munmap((void *)snap, sizeof(*snap));
+    return ret;
+}
+
+/***************** VALIDATION *******************/
+
+/* The driver lost what the snapshot says it has (ex. power cycled): send it the config again */
+static void snap_fix_channel(const gbCfg_t *cfg, ldBoard_t ld)
+{
+    if (ld_set_voltage(ld, cfg->ld_instant[ld].vset) == 0)
+        LD_BIT_SET(Gb_ch.volt_ok, ld);
+    else
+        LD_BIT_CLR(Gb_ch.volt_ok, ld);
+
+    if (cfg->ld_instant_mode) {
+        if ((ld_set_current(ld, cfg->ld_instant[ld].cset) < 0) ||
+                (ld_set_output(ld, (cfg->ld_instant[ld].enable && cfg->ld_instant[ld].cset)) < 0))
+            gb_log(LOG_ERR, "Error applying the config on Led %s.", Gb_ch.chan[ld].name);
+    } else {
+        LD_BIT_CLR(Gb_ch.setpoint_ok, ld); //The routine sends it on its next step
+        LD_BIT_CLR(Gb_ch.output_ok, ld);
+    }
+    return;
+}
+
+static void *snap_validate(void *arg)
+{
+    const gbCfg_t *cfg = cfg_hold();
+    ldCfg_t drv;
+    ldBoard_t ld;
+    bool fix = false;
+
+    //Same probe as a normal boot, it also refuses a driver that is not the expected one
+    if (ld_sys_init() < 0)
+        gb_log(LOG_CRIT, "Unable to get Led Device System's information.");
+
+    FOR_EACH_LED(ld) {
+        if (!Gb_ld_sys[ld].device_ok)
+            continue;
+
+        if (strcmp(Gb_ld_sys[ld].version, Snap_sys[ld].version) != 0)
+            gb_log(LOG_NOTICE, "Led %s driver version changed since the snapshot: %s.", Gb_ch.chan[ld].name, Gb_ld_sys[ld].version);
+
+        //CONFIG has 10 mV and 10 mA of resolution
+        if ((ld_get_config(ld, &drv) < 0) || !SNAP_NEAR(drv.vset, Gb_ch.vset[ld], 10) ||
+                (((Gb_ch.setpoint_ok & (1 << ld)) != 0) && !SNAP_NEAR(drv.cset, Gb_ch.setpoint[ld], LD_CURR_STEP))) {
+            gb_log(LOG_WARNING, "Led %s driver does not have the snapshot setpoints, applying them again.", Gb_ch.chan[ld].name);
+            snap_fix_channel(cfg, ld);
+            fix = true;
+        }
+    }
+
+    cfg_release(cfg);
+    if (fix)
+        ld_routine_wakeup();
+    gb_log(LOG_NOTICE, "Led drivers checked against the state snapshot.");
+    return NULL;
+}
+
+/* Light back at once from the snapshot state, the drivers are checked on a thread */
+void snap_resume(void)
+{
+    const gbCfg_t *cfg = cfg_hold();
+    ldBoard_t ld;
+
+    FOR_EACH_LED(ld)
+        if (cfg->ld_instant_mode && !((Gb_ch.setpoint_ok & (1 << ld)) && (Gb_ch.setpoint[ld] == cfg->ld_instant[ld].cset)))
+            snap_fix_channel(cfg, ld);
+    cfg_release(cfg);
+    ld_daily_routine(false); //Only the leds whose current moved while the daemon was down
+
+    if (pthread_create(&Validator, NULL, snap_validate, NULL) != 0) {
+        gb_log(LOG_ERR, "Unable to start the snapshot validation, checking the drivers now.");
+        snap_validate(NULL);
+        return;
+    }
+    pthread_setname_np(Validator, "gb_snap");
+    Validating = true;
+    return;
+}
+
+/***************** TIMER *******************/
+
+static long long snap_tick(void *arg, long long now)
+{
+    snap_save();
+    return 0;
+}
+
+void snap_sched_init(void)
+{
+    Snap_timer = sched_add("snapshot", snap_tick, NULL, 0, 0);
+
+    //The state the daemon started with is written soon
+    Dirty = true;
+    sched_set(Snap_timer, sched_now() + SNAP_FLUSH_MS*SCHED_MS);
+    return;
+}
+
+/* Something in the snapshot changed: write it shortly, once for a burst of changes */
+void snap_save_later(void)
+{
+    schedTimer_t t;
+
+    Dirty = true;
+    if ((Snap_timer < 0) || ((sched_get(Snap_timer, &t) == 0) && (t.deadline != 0)))
+        return;
+    sched_set(Snap_timer, sched_now() + SNAP_FLUSH_MS*SCHED_MS);
+    return;
+}
+
+/* Shutdown: wait for the validation until deadline (CLOCK_REALTIME ns) and write the last state */
+void snap_stop(long long deadline)
+{
+    struct timespec ts;
+
+    if (Validating) {
+        ts.tv_sec = deadline / 1000000000LL;
+        ts.tv_nsec = deadline % 1000000000LL;
+        if (pthread_timedjoin_np(Validator, NULL, &ts) != 0)
+            gb_log(LOG_WARNING, "Led drivers still being checked against the state snapshot at shutdown.");
+        Validating = false;
+    }
+    if (Dirty)
+        snap_save();
+    return;
+}
@@ -0,0 +1,59 @@
+/*
+ * gb_snap.h:
+ *	Binary state snapshot for a fast startup of the GreenBubble project
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef GB_SNAP_H
+#define GB_SNAP_H
+
+#include <stdint.h>
+#include <gb_main.h>
+
+/***************** DEFINES & ENUMS *******************/
+
+#define SNAP_FILE     "./GB.snap"
+#define SNAP_MAGIC    0x31534247 //"GBS1"
+#define SNAP_VERSION  4          //Bump when the layout of gbSnap_t changes
+#define SNAP_FLUSH_MS 5000       //Changes within this time are written once
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          //sizeof(gbSnap_t), a build with other structs does not load it
+    uint32_t sum;           //FNV-1a of everything after the header
+    int64_t cfg_mtime;      //ns, CFG.json the snapshot comes from. Edited since: not used
+    int64_t cfg_size;
+} snapHdr_t;
+
+typedef struct {
+    snapHdr_t hdr;
+    gbChan_t ch;            //Registry and the setpoints the drivers have
+    ldSys_t sys[LD_MAX];    //Limits and last driver identities
+    gbCfg_t cfg;            //Running config, routine points included
+} gbSnap_t;
+
+/***************** FUNCTIONS *******************/
+int snap_load(void);
+void snap_resume(void);
+void snap_save(void);
+void snap_save_later(void);
+void snap_sched_init(void);
+void snap_stop(long long deadline);
+
+#endif //GB_SNAP_H
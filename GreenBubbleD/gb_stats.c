@@ -19,17 +19,48 @@
  ***********************************************************************
  */
 
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <limits.h>
 #include <string.h>
-#include <syslog.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
 #include <jansson.h>
-#include <sys/time.h>
-#include <wiringPi.h>
 
 #include <gb_stats.h>
 #include <gb_led.h>
 #include <gb_main.h>
 #include <gb_serial.h>
 #include <gb_gpio.h>
+#include <gb_sched.h>
+#include <gb_hal.h>
+#include <gb_export.h>
+#include <gb_log.h>
+
+#define HIST_FILE    "./HIST.json"
+#define HIST_TMP     HIST_FILE ".tmp"
+#define HIST_KEEP_MS 259200000LL //3 days
+
+// History arrays are appended by the main loop and read by the web threads
+static pthread_mutex_t Hist_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Series of the history checkpoint, same keys as /charts. The leds go under hist_ld_spec.
+static const struct {
+    const char *key;
+    size_t offset;
+} Hist_series[] = {
+    { "hist_vin",       offsetof(gbHis_t, vin) },
+    { "hist_humidity",  offsetof(gbHis_t, humidity) },
+    { "hist_rain",      offsetof(gbHis_t, rain) },
+    { "hist_fog",       offsetof(gbHis_t, fog) },
+    { "hist_tempPS",    offsetof(gbHis_t, tPS) },
+    { "hist_tempAir",   offsetof(gbHis_t, tAir) },
+    { "hist_tempWater", offsetof(gbHis_t, tWater) }
+};
+#define HIST_SERIES_NUMB (sizeof(Hist_series)/sizeof(Hist_series[0]))
+#define HIST_SERIES(sts, i) (*(json_t **)((char *)&(sts)->hist + Hist_series[i].offset))
 
 void cfg_big_json_test(gbCfg_t *cfg)
 {
@@ -54,7 +85,7 @@ void cfg_big_json_test(gbCfg_t *cfg)
 
 
     if (json_dump_file(j_body, "./BigChart_1x10mx3D.json", JSON_INDENT(4)) != 0)
-        syslog(LOG_ERR, "Unable to save config.");
+        gb_log(LOG_ERR, "Unable to save config.");
 
     json_decref(j_body);
     json_decref(array_w);
@@ -78,6 +109,7 @@ void gb_stats_init(gbSts_t *sts)
     sts->hist.tPS = json_array();
 
     //TODO: could test if the above was OK.
+    gb_stats_load(sts);
     return;
 }
 
@@ -99,19 +131,21 @@ void gb_stats_decref(gbSts_t *sts)
     return;
 }
 
-static void hist_append(json_t *jarray, unsigned int value)
+/* Time of the history points */
+static long long hist_now_ms(void)
 {
-    static int apagar;
     long long time_ms;
-    struct timeval te;
-    json_t *elem = json_array(); //decrefing it was generating a problem, therefore using append_new
-    
-    apagar++;
-    value = apagar;
 
-    gettimeofday(&te, NULL); // get current time
-    time_ms = te.tv_sec*1000LL + te.tv_usec/1000;
+    time_ms = hal_clock_ns(CLOCK_REALTIME)/1000000; // get current time
     time_ms += 2*3600*1000; //add 2hs summer timezone. It should be changed for smtg smarter...nothing worked.
+    return time_ms;
+}
+
+/* Append a point at time_ms, dropping the oldest one once out of the history window */
+void hist_append(json_t *jarray, long long time_ms, unsigned int value)
+{
+    json_t *elem = json_array(); //decrefing it was generating a problem, therefore using append_new
+
     //debug("milliseconds: %lld\n", time_ms);
 
     json_array_append_new(elem, json_integer(time_ms));
@@ -119,47 +153,302 @@ static void hist_append(json_t *jarray, unsigned int value)
     json_array_append_new(jarray, elem);
 
     //Check if oldest data is older than 3 Days. If yes, remove it.
-    if(json_integer_value(json_array_get(json_array_get(jarray, 0), 0)) < (time_ms - 259200000))
+    if(json_integer_value(json_array_get(json_array_get(jarray, 0), 0)) < (time_ms - HIST_KEEP_MS))
         json_array_remove(jarray, 0);
 
     return;
 }
 
+/* A change between two samples (rain, fog), at the CLOCK_MONOTONIC ns it happened */
+void gb_stats_change(json_t *jarray, long long mono_ns, unsigned int value)
+{
+    long long time_ms = hist_now_ms() - (hal_clock_ns(CLOCK_MONOTONIC) - mono_ns)/1000000;
+    json_t *last;
+
+    pthread_mutex_lock(&Hist_lock);
+    last = json_array_get(jarray, json_array_size(jarray) - 1);
+    if (last && (json_integer_value(json_array_get(last, 0)) > time_ms))
+        time_ms = json_integer_value(json_array_get(last, 0)); //A sample was taken meanwhile, points stay sorted
+    hist_append(jarray, time_ms, value);
+    pthread_mutex_unlock(&Hist_lock);
+    return;
+}
+
+/* Index of the first point not older than time_ms. Points are sorted by time. */
+static size_t hist_lower_bound(json_t *jarray, long long time_ms)
+{
+    size_t lo = 0, hi = json_array_size(jarray), mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (json_integer_value(json_array_get(json_array_get(jarray, mid), 0)) < time_ms)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void hist_point_append(json_t *jarray, long long time_ms, long long value)
+{
+    json_t *elem = json_array();
+
+    json_array_append_new(elem, json_integer(time_ms));
+    json_array_append_new(elem, json_integer(value));
+    json_array_append_new(jarray, elem);
+    return;
+}
+
+/*
+ * Largest-Triangle-Three-Buckets: keep the first and last points and, for each bucket
+ * in between, the point making the largest triangle with the previous kept point and
+ * the average of the next bucket. It keeps the visual shape with max_points points.
+ */
+static void hist_lttb(json_t *out, long long *t, long long *v, size_t n, size_t max_points)
+{
+    double every = (double)(n - 2)/(max_points - 2);
+    double avg_t, avg_v, area, max_area;
+    size_t a = 0, b, i, j, start, end, next_start, next_end;
+
+    hist_point_append(out, t[0], v[0]);
+
+    for (i = 0; i < max_points - 2; i++) {
+        //Average of the next bucket (the last point for the last bucket)
+        next_start = (size_t)((i + 1)*every) + 1;
+        next_end = (size_t)((i + 2)*every) + 1;
+        if (next_end > n)
+            next_end = n;
+        avg_t = avg_v = 0;
+        for (j = next_start; j < next_end; j++) {
+            avg_t += t[j];
+            avg_v += v[j];
+        }
+        if (next_end > next_start) {
+            avg_t /= (next_end - next_start);
+            avg_v /= (next_end - next_start);
+        } else {
+            avg_t = t[n - 1];
+            avg_v = v[n - 1];
+        }
+
+        //Point of the current bucket with the largest triangle
+        start = (size_t)(i*every) + 1;
+        end = (size_t)((i + 1)*every) + 1;
+        max_area = -1;
+        b = start;
+        for (j = start; j < end; j++) {
+            area = ((double)(t[a] - avg_t)*(v[j] - v[a]) - (double)(t[a] - t[j])*(avg_v - v[a]));
+            if (area < 0)
+                area = -area;
+            if (area > max_area) {
+                max_area = area;
+                b = j;
+            }
+        }
+
+        hist_point_append(out, t[b], v[b]);
+        a = b;
+    }
+
+    hist_point_append(out, t[n - 1], v[n - 1]);
+    return;
+}
+
+/*
+ * Return a new array with the points of jarray between from and to (ms, inclusive).
+ * If there are more than max_points, they are downsampled with LTTB. max_points 0 means no limit.
+ */
+json_t *hist_query(json_t *jarray, long long from, long long to, unsigned int max_points)
+{
+    json_t *out = json_array();
+    long long *t, *v;
+    size_t first, n, i;
+    json_t *elem;
+
+    pthread_mutex_lock(&Hist_lock);
+
+    first = hist_lower_bound(jarray, from);
+    n = hist_lower_bound(jarray, (to == LLONG_MAX) ? to : to + 1) - first;
+
+    if ((max_points == 0) || (n <= max_points) || (max_points < 3)) {
+        //Small enough, or too small a budget for buckets: keep the most recent points
+        if ((max_points != 0) && (n > max_points)) {
+            first += n - max_points;
+            n = max_points;
+        }
+        for (i = first; i < first + n; i++)
+            json_array_append(out, json_array_get(jarray, i));
+        pthread_mutex_unlock(&Hist_lock);
+        return out;
+    }
+
+    t = malloc(n*sizeof(*t));
+    v = malloc(n*sizeof(*v));
+    if (!t || !v) {
+        pthread_mutex_unlock(&Hist_lock);
+        gb_log(LOG_ERR, "Unable to allocate memory to downsample the history.");
+        free(t);
+        free(v);
+        return out;
+    }
+    for (i = 0; i < n; i++) {
+        elem = json_array_get(jarray, first + i);
+        t[i] = json_integer_value(json_array_get(elem, 0));
+        v[i] = json_integer_value(json_array_get(elem, 1));
+    }
+    pthread_mutex_unlock(&Hist_lock);
+
+    hist_lttb(out, t, v, n, max_points);
+
+    free(t);
+    free(v);
+    return out;
+}
+
+/***************** CHECKPOINT *******************/
+
+/* Append the saved points of a series still within the history window */
+static void hist_restore(json_t *jarray, json_t *saved, long long since)
+{
+    size_t i;
+
+    if (!json_is_array(saved))
+        return;
+    for (i = hist_lower_bound(saved, since); i < json_array_size(saved); i++)
+        json_array_append(jarray, json_array_get(saved, i));
+    return;
+}
+
+/* History written by the last shutdown, only the channels still registered are taken */
+void gb_stats_load(gbSts_t *sts)
+{
+    long long since = hist_now_ms() - HIST_KEEP_MS;
+    json_t *j_body, *j_lds;
+    json_error_t error;
+    unsigned int i;
+
+    j_body = json_load_file(HIST_FILE, 0, &error);
+    if (!j_body)
+        return;
+
+    j_lds = json_object_get(j_body, "hist_ld_spec");
+    FOR_EACH_LED(i)
+        hist_restore(sts->hist.intens[i], json_object_get(j_lds, Gb_ch.chan[i].name), since);
+    for (i = 0; i < HIST_SERIES_NUMB; i++)
+        hist_restore(HIST_SERIES(sts, i), json_object_get(j_body, Hist_series[i].key), since);
+
+    json_decref(j_body);
+    gb_log(LOG_INFO, "History restored from the last checkpoint.");
+    return;
+}
+
+/* Checkpoint of the history, the next start goes on from it */
+int gb_stats_save(gbSts_t *sts)
+{
+    json_t *j_body = json_object();
+    json_t *j_lds = json_object();
+    unsigned int i;
+    char *dump;
+    FILE *fp;
+    bool err;
+
+    pthread_mutex_lock(&Hist_lock);
+    FOR_EACH_LED(i)
+        json_object_set(j_lds, Gb_ch.chan[i].name, sts->hist.intens[i]);
+    json_object_set_new(j_body, "hist_ld_spec", j_lds);
+    for (i = 0; i < HIST_SERIES_NUMB; i++)
+        json_object_set(j_body, Hist_series[i].key, HIST_SERIES(sts, i));
+    dump = json_dumps(j_body, JSON_COMPACT);
+    pthread_mutex_unlock(&Hist_lock);
+    json_decref(j_body);
+
+    //Written aside and renamed, a crash never leaves half a history
+    fp = dump ? fopen(HIST_TMP, "w") : NULL;
+    err = (fp == NULL) || (fputs(dump, fp) == EOF) || (fflush(fp) != 0) || (fsync(fileno(fp)) != 0);
+    if (fp && (fclose(fp) != 0))
+        err = true;
+    if (err || (rename(HIST_TMP, HIST_FILE) < 0)) {
+        gb_log(LOG_ERR, "Unable to save the history.");
+        unlink(HIST_TMP);
+        free(dump);
+        return -1;
+    }
+    free(dump);
+    return 0;
+}
+
+/* Reading of a sensor times scale, false without one: the status keeps the last and the history skips it */
+static bool stats_sensor(int node, int scale, int *value)
+{
+    int reading = hal_sensor_read(node);
+
+    if (reading == HAL_NO_READING)
+        return false;
+    *value = reading*scale;
+    return true;
+}
+
 #define STATUS_TIMER 600 //10min
-void gb_get_status(gbSts_t *sts, bool update_now)
+void gb_get_status(gbSts_t *sts)
 {
-    int i;
-    static int timer;
-
-    timer += MAIN_LOOP_SEC;
-    if ((timer >= STATUS_TIMER) || update_now) {
-        /* Get last data */
-        //Leds
-        FOR_EACH_LED(i)        
-            ld_get_status(i, &Gb_sts.ld_sts[i]);
-
-        //DS18B20 Sensors
-        sts->temp_PS    = analogRead(DS18_01)*10;
-        sts->temp_water = analogRead(DS18_02)*10;
-
-        //DHT22 Sensor
-        sts->temp_air     = analogRead(DHT22_01)*10;
-        sts->humidity_air = analogRead(DHT22_01+1);
-
-        /* Append all into the history */
-        FOR_EACH_LED(i)        
-            hist_append(sts->hist.intens[i], get_perc_from_curr(i, sts->ld_sts[i].cout));
-
-        hist_append(sts->hist.vin, sts->ld_sts[LD_WHITE].vin);
-        hist_append(sts->hist.humidity, sts->humidity_air);
-        hist_append(sts->hist.rain, sts->rain ? 100 : 0);
-        hist_append(sts->hist.fog, sts->fog ? 100 : 0);
-        hist_append(sts->hist.tPS, sts->temp_PS);
-        hist_append(sts->hist.tAir, sts->temp_air);
-        hist_append(sts->hist.tWater, sts->temp_water);
-
-        timer = 0;
+    bool ps, water, air, humidity;
+    long long now;
+    int i, value;
+
+    /* Get last data */
+    //Leds
+    FOR_EACH_LED(i) {
+        if (ld_get_status(i, &Gb_sts.ld_sts[i]) == 0)
+            Gb_ch.cout[i] = Gb_sts.ld_sts[i].cout;
     }
 
+    //DS18B20 Sensors
+    ps    = stats_sensor(DS18_01, 10, &sts->temp_PS);
+    water = stats_sensor(DS18_02, 10, &sts->temp_water);
+
+    //DHT22 Sensor
+    air      = stats_sensor(DHT22_01, 10, &sts->temp_air);
+    humidity = stats_sensor(DHT22_01+1, 1, &value);
+    if (humidity)
+        sts->humidity_air = value/10; //Tenths of %
+
+    /* Append all into the history */
+    now = hist_now_ms();
+    pthread_mutex_lock(&Hist_lock);
+    FOR_EACH_LED(i)        
+        hist_append(sts->hist.intens[i], now, get_perc_from_curr(i, sts->ld_sts[i].cout));
+
+    hist_append(sts->hist.vin, now, sts->ld_sts[0].vin); //All drivers share the power supply
+    if (humidity)
+        hist_append(sts->hist.humidity, now, sts->humidity_air);
+    hist_append(sts->hist.rain, now, sts->rain ? 100 : 0);
+    hist_append(sts->hist.fog, now, sts->fog ? 100 : 0);
+    if (ps)
+        hist_append(sts->hist.tPS, now, sts->temp_PS);
+    if (air)
+        hist_append(sts->hist.tAir, now, sts->temp_air);
+    if (water)
+        hist_append(sts->hist.tWater, now, sts->temp_water);
+    pthread_mutex_unlock(&Hist_lock);
+
+    export_sample(sts);
+
+    return;
+}
+
+/* Sampling timer, on each STATUS_TIMER boundary of the wall clock */
+static long long gb_stats_tick(void *arg, long long now)
+{
+    long long period = STATUS_TIMER*1000*SCHED_MS;
+
+    gb_get_status((gbSts_t *)arg);
+    return (now/period + 1)*period;
+}
+
+void gb_stats_sched_init(gbSts_t *sts)
+{
+    long long period = STATUS_TIMER*1000*SCHED_MS;
+
+    sched_add("sampling", gb_stats_tick, sts, (sched_now()/period + 1)*period, 0);
     return;
 }
@@ -27,6 +27,12 @@
 void cfg_big_json_test(gbCfg_t *cfg);
 void gb_stats_init(gbSts_t *sts);
 void gb_stats_decref(gbSts_t *sts);
-void gb_get_status(gbSts_t *sts, bool update_now);
+void gb_stats_load(gbSts_t *sts);
+int gb_stats_save(gbSts_t *sts);
+void gb_get_status(gbSts_t *sts);
+void gb_stats_sched_init(gbSts_t *sts);
+void hist_append(json_t *jarray, long long time_ms, unsigned int value);
+void gb_stats_change(json_t *jarray, long long mono_ns, unsigned int value);
+json_t *hist_query(json_t *jarray, long long from, long long to, unsigned int max_points);
 
 #endif //GB_STATS_H
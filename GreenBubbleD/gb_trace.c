@@ -0,0 +1,215 @@
+/*
+ * gb_trace.c:
+ *	In-memory tracing for the GreenBubble project
+ *	Each thread writes timestamped begin/end events in a ring of its own, with
+ *	no lock: it is the only writer and publishes its head with a release store.
+ *	/GBBL/trace copies the rings and exports them as Chrome trace events
+ *	(chrome://tracing, ui.perfetto.dev).
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <jansson.h>
+
+#include <gb_trace.h>
+#include <gb_main.h>
+#include <gb_log.h>
+
+typedef struct {
+    bool owned;                     //A live thread writes in it
+    unsigned int gen;               //Changes each time the ring gets a new thread
+    unsigned long head;             //Events written so far
+    pid_t tid;
+    char thread[16];
+    traceEvent_t ev[TRACE_EVENTS];
+} traceRing_t;
+
+bool Trace_on;
+
+static traceRing_t Rings[TRACE_RINGS];
+static __thread traceRing_t *My_ring;
+static __thread bool No_ring;       //All the rings were taken when this thread started tracing
+static pthread_key_t Ring_key;
+static pthread_once_t Ring_once = PTHREAD_ONCE_INIT;
+
+/***************** RINGS *******************/
+
+static long long trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* The thread exits: its events stay readable until another thread takes the ring */
+static void trace_release(void *arg)
+{
+    traceRing_t *r = arg;
+
+    __atomic_store_n(&r->owned, false, __ATOMIC_RELEASE);
+    return;
+}
+
+static void trace_key_init(void)
+{
+    pthread_key_create(&Ring_key, trace_release);
+    return;
+}
+
+/* Ring of the calling thread, taken on its first event */
+static traceRing_t *trace_ring(void)
+{
+    traceRing_t *r;
+    bool expected;
+    unsigned int i;
+
+    if (My_ring || No_ring)
+        return My_ring;
+
+    pthread_once(&Ring_once, trace_key_init);
+    for (i = 0; i < TRACE_RINGS; i++) {
+        r = &Rings[i];
+        expected = false;
+        if (!__atomic_compare_exchange_n(&r->owned, &expected, true, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+
+        //Readers drop what they copied of the old thread when gen moved
+        __atomic_add_fetch(&r->gen, 1, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&r->head, 0, __ATOMIC_RELEASE);
+        r->tid = syscall(SYS_gettid);
+        if (pthread_getname_np(pthread_self(), r->thread, sizeof(r->thread)) != 0)
+            r->thread[0] = '\0';
+
+        pthread_setspecific(Ring_key, r);
+        My_ring = r;
+        return r;
+    }
+
+    No_ring = true;
+    gb_log(LOG_WARNING, "No trace ring left, a thread is not traced.");
+    return NULL;
+}
+
+void trace_event(const char *cat, const char *name, char ph)
+{
+    traceRing_t *r = trace_ring();
+    traceEvent_t *e;
+    unsigned long head;
+
+    if (r == NULL)
+        return;
+
+    head = r->head;
+    e = &r->ev[head & (TRACE_EVENTS - 1)];
+    e->ts = trace_now();
+    e->cat = cat;
+    e->name = name;
+    e->ph = ph;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return;
+}
+
+/***************** API *******************/
+
+void trace_enable(bool on)
+{
+    __atomic_store_n(&Trace_on, on, __ATOMIC_RELAXED);
+    gb_log(LOG_NOTICE, "Tracing %s.", on ? "enabled" : "disabled");
+    return;
+}
+
+bool trace_enabled(void)
+{
+    return __atomic_load_n(&Trace_on, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copy the events of a ring, oldest first. The writer does not wait for us: the events it may
+ * have overwritten during the copy are skipped. Returns how many are left after skip.
+ */
+static unsigned long trace_copy(traceRing_t *r, traceEvent_t *out, unsigned long *skip)
+{
+    unsigned long head, first, last, i;
+    unsigned int gen;
+
+    gen = __atomic_load_n(&r->gen, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    first = (head > TRACE_EVENTS) ? head - TRACE_EVENTS : 0;
+    for (i = first; i < head; i++)
+        out[i - first] = r->ev[i & (TRACE_EVENTS - 1)];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&r->gen, __ATOMIC_ACQUIRE) != gen)
+        return 0; //Taken by another thread meanwhile
+
+    //Event i shares its slot with i + TRACE_EVENTS, which may be being written as event last
+    last = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    *skip = (last + 1 > first + TRACE_EVENTS) ? last + 1 - TRACE_EVENTS - first : 0;
+    if (*skip >= head - first)
+        return 0;
+    return head - first - *skip;
+}
+
+/* All the rings in Chrome trace event format, ts in us */
+json_t *trace_to_json(void)
+{
+    json_t *j_events = json_array();
+    traceEvent_t *buf;
+    traceRing_t *r;
+    unsigned long n, skip, i;
+    unsigned int ring;
+    pid_t pid = getpid();
+
+    buf = malloc(TRACE_EVENTS*sizeof(*buf));
+    if (buf == NULL)
+        return NULL;
+
+    for (ring = 0; ring < TRACE_RINGS; ring++) {
+        r = &Rings[ring];
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == 0)
+            continue;
+
+        n = trace_copy(r, buf, &skip);
+        if (n == 0)
+            continue;
+
+        json_array_append_new(j_events, json_pack("{sssssisis{ss}}",
+                "name", "thread_name",
+                "ph", "M",
+                "pid", (int)pid,
+                "tid", (int)r->tid,
+                "args", "name", r->thread[0] ? r->thread : "thread"));
+        for (i = skip; i < skip + n; i++)
+            json_array_append_new(j_events, json_pack("{sssssssfsisi}",
+                    "name", buf[i].name,
+                    "cat", buf[i].cat,
+                    "ph", (buf[i].ph == 'B') ? "B" : "E",
+                    "ts", buf[i].ts/1000.0,
+                    "pid", (int)pid,
+                    "tid", (int)r->tid));
+    }
+    free(buf);
+
+    return json_pack("{soss}", "traceEvents", j_events, "displayTimeUnit", "ms");
+}
@@ -0,0 +1,53 @@
+/*
+ * gb_trace.h:
+ *	In-memory tracing for the GreenBubble project
+ *
+ * Copyright (c) 2018-2019 Fabiano R. Maioli <frmaioli@gmail.com>
+ ***********************************************************************
+ *    GreenBubble is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    GreenBubble is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with GreenBubble.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef GB_TRACE_H
+#define GB_TRACE_H
+
+#include <jansson.h>
+#include <gb_main.h>
+
+/***************** DEFINES & ENUMS *******************/
+
+#define TRACE_RINGS  16   //Threads tracing at the same time, a ring is reused when its thread exits
+#define TRACE_EVENTS 4096 //Events kept per thread, power of 2
+
+/* Names and categories must be static strings, only the pointer is kept */
+typedef struct {
+    long long ts;       //ns, CLOCK_MONOTONIC
+    const char *cat;
+    const char *name;
+    char ph;            //'B' begin, 'E' end
+} traceEvent_t;
+
+extern bool Trace_on;
+
+// Nearly free while tracing is off: a relaxed load and a branch
+#define TRACE_BEGIN(cat, name) do { if (__atomic_load_n(&Trace_on, __ATOMIC_RELAXED)) trace_event((cat), (name), 'B'); } while (0)
+#define TRACE_END(cat, name)   do { if (__atomic_load_n(&Trace_on, __ATOMIC_RELAXED)) trace_event((cat), (name), 'E'); } while (0)
+
+/***************** FUNCTIONS *******************/
+void trace_event(const char *cat, const char *name, char ph);
+void trace_enable(bool on);
+bool trace_enabled(void);
+json_t *trace_to_json(void);
+
+#endif //GB_TRACE_H